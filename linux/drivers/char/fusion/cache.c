@@ -0,0 +1,77 @@
+/*
+   (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+   (c) Copyright 2002-2004  Convergence (integrated media) GmbH
+
+   All rights reserved.
+
+   Written by Denis Oliver Kropp <dok@directfb.org>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version
+   2 of the License, or (at your option) any later version.
+*/
+
+#include <linux/version.h>
+#include <linux/module.h>
+#ifdef HAVE_LINUX_CONFIG_H
+#include <linux/config.h>
+#endif
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/fusion.h>
+
+#include "fusiondev.h"
+#include "list.h"
+#include "cache.h"
+
+typedef struct {
+     FusionLink    link;
+
+     FusionCache **cache;
+} CacheRegistration;
+
+/* caches in use, shared by all worlds, most recently registered first */
+static FusionLink *caches;
+
+int fusion_cache_register( FusionCache **cache, const char *name, size_t size )
+{
+     int                ret = 0;
+     CacheRegistration *registration;
+
+     fusion_core_lock( fusion_core );
+
+     if (!*cache) {
+          registration = fusion_core_malloc( fusion_core, sizeof(CacheRegistration) );
+          if (!registration)
+               ret = -ENOMEM;
+          else if (fusion_core_cache_create( fusion_core, name, size, cache )) {
+               fusion_core_free( fusion_core, registration );
+               ret = -ENOMEM;
+          }
+          else {
+               registration->cache = cache;
+
+               direct_list_prepend( &caches, &registration->link );
+          }
+     }
+
+     fusion_core_unlock( fusion_core );
+
+     return ret;
+}
+
+void fusion_caches_destroy( void )
+{
+     while (caches) {
+          CacheRegistration *registration = (CacheRegistration *) caches;
+
+          fusion_list_remove( &caches, &registration->link );
+
+          fusion_core_cache_destroy( fusion_core, *registration->cache );
+
+          *registration->cache = NULL;
+
+          fusion_core_free( fusion_core, registration );
+     }
+}
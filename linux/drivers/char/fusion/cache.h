@@ -0,0 +1,29 @@
+/*
+   (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+   (c) Copyright 2002-2004  Convergence (integrated media) GmbH
+
+   All rights reserved.
+
+   Written by Denis Oliver Kropp <dok@directfb.org>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version
+   2 of the License, or (at your option) any later version.
+*/
+
+#ifndef __FUSION__CACHE_H__
+#define __FUSION__CACHE_H__
+
+#include "fusioncore.h"
+
+/*
+ * Creates the cache on first use, it's kept until fusion_caches_destroy().
+ */
+int  fusion_cache_register( FusionCache **cache, const char *name, size_t size );
+
+/* module cleanup, after all objects have been freed */
+
+void fusion_caches_destroy( void );
+
+#endif
@@ -29,18 +29,41 @@
 #include <linux/smp_lock.h>
 #endif
 #include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
 #include <linux/fusion.h>
 #include <linux/sched/signal.h>
+#include <linux/sched/task.h>
 
 #include "fusiondev.h"
 #include "fusionee.h"
 #include "list.h"
 #include "hash.h"
+#include "cache.h"
 #include "skirmish.h"
 #include "call.h"
 
+/*
+ * Block of the call arena, holding arguments and return data of executions with FCEF_ARENA.
+ */
+typedef struct {
+     FusionLink    link;      /* in the list of blocks of the owner */
+
+     unsigned int  offset;
+     unsigned int  size;
+
+     Fusionee     *owner;     /* NULL if the owner left while the block was in use */
+     bool          busy;      /* in use by an execution */
+} FusionCallBlock;
+
+/* buckets of pending executions per call, a power of two */
+#define CALL_SERIAL_BUCKETS  32
+
 typedef struct {
      FusionLink link;
+     FusionLink serial_link;  /* in the bucket of the call, see lookup_serial() */
 
      Fusionee *caller;
 
@@ -58,6 +81,19 @@ typedef struct {
      unsigned int ret_size;
      unsigned int ret_length;
 
+     bool async;              /* result is collected via the call ring of the caller */
+     FusionLink async_link;   /* in the list of asynchronous executions of the caller */
+     void *ret_ptr;           /* return buffer in the caller */
+     unsigned long user_data; /* of the submission */
+     int error;               /* non-zero if completed without returning, e.g. call destroyed */
+     unsigned int handle;     /* non-zero if started with FCEF_ASYNC instead of via the call ring */
+
+     bool handoff;            /* caller is woken up with a hint that the callee is going to sleep */
+
+     FusionCallBlock *block;  /* holds arguments and return data instead of the message and this execution */
+
+     struct __Fusion_CallWorker *worker; /* the execution has been sent to, NULL for the owner */
+
      /* return data follows */
 } FusionCallExecution;
 
@@ -65,19 +101,41 @@ typedef struct {
      FusionEntry entry;
 
      Fusionee *fusionee;      /* owner */
+     FusioneeOwnedLink owner; /* in the list of the owner */
 
      void *handler;
      void *ctx;
 
      FusionLink *executions;
+     FusionLink *serials[CALL_SERIAL_BUCKETS];  /* pending executions by the low bits of their serial */
 
      int count;          /* number of calls ever made */
 
      unsigned int serial;
 
      FusionHash *quotas;
+
+     FusionLink   *workers;   /* fusionees serving the call besides the owner */
+     unsigned int  pending;   /* number of executions sent to the owner */
 } FusionCall;
 
+/*
+ * Fusionee serving a call besides the owner, see FUSION_CALL_ADD_WORKER.
+ */
+typedef struct __Fusion_CallWorker {
+     FusionLink         link;      /* in the list of workers of the call */
+     FusioneeOwnedLink  owned;     /* in the list of the worker */
+
+     FusionCall        *call;
+     Fusionee          *fusionee;  /* NULL if the worker left */
+
+     void              *handler;   /* handler and context of the worker */
+     void              *ctx;
+
+     unsigned int       pending;   /* number of executions sent to the worker */
+     bool               removed;   /* freed once it left and no more executions are pending */
+} CallWorker;
+
 typedef struct {
      FusionID            fusion_id;
 
@@ -93,6 +151,9 @@ struct fusion_construct_ctx {
      FusionCallNew *call_new;
 };
 
+/* executions with up to CACHE_EXECUTIONS_DATA_LEN bytes of return data */
+static FusionCache *execution_cache;
+
 /******************************************************************************/
 
 static FusionCallExecution *add_execution(FusionCall * call,
@@ -104,6 +165,23 @@ static void remove_execution(FusionCall * call,
 static void free_execution(FusionDev * dev,
                            FusionCallExecution * execution);
 static void free_all_executions(FusionCall * call);
+static FusionCallExecution *lookup_execution(FusionCall * call,
+                                             unsigned int serial);
+static FusionCallExecution *lookup_serial(FusionCall * call,
+                                          unsigned int serial);
+static void complete_async(FusionDev * dev, FusionCall * call,
+                           FusionCallExecution * execution);
+static void fail_execution(FusionDev * dev, FusionCall * call,
+                           FusionCallExecution * execution, int error);
+static void call_arena_deinit(FusionDev * dev);
+static int lookup_block(FusionDev * dev, Fusionee * fusionee,
+                        FusionCallExecute3 * execute, FusionCallBlock ** ret_block);
+static void free_block(FusionDev * dev, FusionCallBlock * block);
+static void release_block(FusionDev * dev, FusionCallBlock * block);
+static Fusionee *route_execution(FusionCall * call,
+                                 FusionCallExecution * execution,
+                                 void **ret_handler, void **ret_ctx);
+static void free_worker(FusionDev * dev, CallWorker * worker);
 
 /******************************************************************************/
 
@@ -121,6 +199,8 @@ fusion_call_construct(FusionEntry * entry, void *ctx, void *create_ctx)
 
      fusion_hash_create( FHT_PTR, FHT_PTR, 5, &call->quotas );
 
+     fusionee_own_by( (FusionDev *) ctx, cc->fusionee, FUSIONEE_OWNED_CALLS, &call->owner, entry );
+
      cc->call_new->call_id = entry->id;
 
      return 0;
@@ -133,9 +213,17 @@ static bool fusion_call_quota_hash_iterator( FusionHash *hash,
 {
      CallQuota  *quota = value;
      FusionCall *call  = ctx;
+     FusionLink *l;
 
      fusionee_remove_message_callbacks( call->fusionee, quota );
 
+     fusion_list_foreach (l, call->workers) {
+          CallWorker *worker = (CallWorker *) l;
+
+          if (worker->fusionee)
+               fusionee_remove_message_callbacks( worker->fusionee, quota );
+     }
+
      //if (quota->count >= quota->limit/4)
      //     printk( KERN_WARNING "fusion: call quota with count >= limit / 4 during destruction! call_id = %d, fusion_id = %lu, "
      //                          "count = %u/%u\n", call->entry.id, quota->fusion_id, quota->count, quota->limit );
@@ -151,10 +239,15 @@ static void fusion_call_destruct(FusionEntry * entry, void *ctx)
 {
      FusionCall *call = (FusionCall *) entry;
 
+     fusionee_disown( (FusionDev *) ctx, &call->owner );
+
      free_all_executions(call);
 
      fusion_hash_iterate( call->quotas, fusion_call_quota_hash_iterator, call );
      fusion_hash_destroy( call->quotas );
+
+     while (call->workers)
+          free_worker( (FusionDev *) ctx, (CallWorker *) call->workers );
 }
 
 __attribute__((unused))
@@ -221,6 +314,13 @@ fusion_call_print(FusionEntry * entry, void *ctx, struct seq_file *p)
      seq_printf(p, "(%d calls) %s [%s]",
                 call->count, idle ? "idle" : "executing", quota_dump.string);
 
+     fusion_list_foreach(e, call->workers) {
+          CallWorker *worker = (CallWorker *) e;
+
+          seq_printf(p, "  {0x%08lx %u}",
+                     worker->fusionee ? fusionee_id(worker->fusionee) : 0, worker->pending);
+     }
+
      fusion_list_foreach(e, call->executions) {
           FusionCallExecution *exec = (FusionCallExecution *) e;
 
@@ -238,7 +338,16 @@ FUSION_ENTRY_CLASS(FusionCall, call, fusion_call_construct,
 
 int fusion_call_init(FusionDev * dev)
 {
-     fusion_entries_init(&dev->call, &call_class, dev, dev);
+     int ret;
+
+     ret = fusion_cache_register(&execution_cache, "fusion_call_execution",
+                                 sizeof(FusionCallExecution) + CACHE_EXECUTIONS_DATA_LEN);
+     if (ret)
+          return ret;
+
+     ret = fusion_entries_init(&dev->call, &call_class, dev, dev);
+     if (ret)
+          return ret;
 
      fusion_entries_create_proc_entry(dev, "calls", &dev->call);
 
@@ -250,6 +359,30 @@ void fusion_call_deinit(FusionDev * dev)
      fusion_entries_destroy_proc_entry(dev, "calls");
 
      fusion_entries_deinit(&dev->call);
+
+     fusion_call_shrink(dev, dev->execution_free_list_num);
+
+     call_arena_deinit(dev);
+}
+
+int fusion_call_shrink(FusionDev * dev, int nr)
+{
+     int freed = 0;
+
+     while (freed < nr && dev->execution_free_list) {
+          FusionCallExecution *execution = (FusionCallExecution *) dev->execution_free_list;
+
+          direct_list_remove( &dev->execution_free_list, &execution->link );
+
+          dev->execution_free_list_num--;
+          atomic_dec( &dev->pooled );
+
+          fusion_core_cache_free( fusion_core, execution_cache, execution );
+
+          freed++;
+     }
+
+     return freed;
 }
 
 /******************************************************************************/
@@ -278,6 +411,7 @@ fusion_call_execute(FusionDev * dev, Fusionee * fusionee,
      FusionCallMessage message;
      unsigned int serial;
      bool flush = true;
+     Fusionee *callee = NULL;
 
      FUSION_DEBUG( "%s( dev %p, fusionee %p, execute %p, call id %d, serial %u )\n", __FUNCTION__, dev, fusionee, execute,
                    execute->call_id, execute->serial );
@@ -291,12 +425,7 @@ restart:
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
      if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
-          /* Search for execution, starting with oldest. */
-          direct_list_foreach (execution, call->executions) {
-               if (execution->serial == execute->serial)
-                    break;
-          }
-
+          execution = lookup_serial( call, execute->serial );
           if (!execution) {
                printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
                direct_list_foreach (execution, call->executions) {
@@ -315,14 +444,14 @@ restart:
                if (quota) {
                     if (quota->count >= quota->limit) {
 #ifdef FUSION_CALL_INTERRUPTIBLE
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, true );
+                         fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, true );
 
                          if (signal_pending(current)) {
                               FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
                               return -EINTR;
                          }
 #else
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, false );
+                         fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, false );
 #endif
 
                          goto restart;
@@ -345,9 +474,8 @@ restart:
           else if (execute->flags & FCEF_QUEUE)
                flush = false;
 
-          /* Fill call message. */
-          message.handler = call->handler;
-          message.ctx = call->ctx;
+          /* Pick the callee and fill call message with its handler. */
+          callee = route_execution(call, execution, &message.handler, &message.ctx);
 
           message.caller = fusionee ? fusionee_id(fusionee) : 0;
 
@@ -364,7 +492,7 @@ restart:
           }
 
           /* Put message into queue of callee. */
-          ret = fusionee_send_message2(dev, fusionee, call->fusionee, FMT_CALL,
+          ret = fusionee_send_message2(dev, fusionee, callee, FMT_CALL,
                                        call->entry.id, 0, sizeof(message),
                                        &message, callback, quota, 1, NULL, 0,
                                        flush);
@@ -388,7 +516,7 @@ restart:
 
           /* Transfer held skirmishs (locks). */
           if (fusionee && (!(execute->flags & FCEF_RESUMABLE) || execute->serial == 0))
-               fusion_skirmish_transfer_all(dev, call->fusionee->id,
+               fusion_skirmish_transfer_all(dev, callee->id,
                                             fusionee_id(fusionee),
                                             fusion_core_pid( fusion_core ),
                                             execution->serial);
@@ -399,7 +527,7 @@ restart:
                FUSION_DEBUG( "  -> skirmishs transferred, sleeping on call...\n" );
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true );
 
                if (signal_pending(current)) {
                     FUSION_DEBUG( "  -> woke up, SIGNAL PENDING!\n" );
@@ -419,7 +547,7 @@ restart:
                     return -EINTR;
                }
 #else
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, false );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, false );
 #endif
           }
 
@@ -455,6 +583,7 @@ fusion_call_execute2(FusionDev * dev, Fusionee * fusionee,
      FusionCallMessage message;
      unsigned int serial;
      bool flush = true;
+     Fusionee *callee = NULL;
 
      FUSION_DEBUG( "%s( dev %p, fusionee %p, execute %p, call id %d, serial %u )\n", __FUNCTION__, dev, fusionee, execute,
                    execute->call_id, execute->serial );
@@ -468,12 +597,7 @@ restart:
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
      if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
-          /* Search for execution, starting with oldest. */
-          direct_list_foreach (execution, call->executions) {
-               if (execution->serial == execute->serial)
-                    break;
-          }
-
+          execution = lookup_serial( call, execute->serial );
           if (!execution) {
                printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
                direct_list_foreach (execution, call->executions) {
@@ -492,14 +616,14 @@ restart:
                if (quota) {
                     if (quota->count >= quota->limit) {
 #ifdef FUSION_CALL_INTERRUPTIBLE
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, true );
+                         fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, true );
 
                          if (signal_pending(current)) {
                               FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
                               return -EINTR;
                          }
 #else
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, false );
+                         fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, false );
 #endif
 
                          goto restart;
@@ -522,9 +646,8 @@ restart:
           else if (execute->flags & FCEF_QUEUE)
                flush = false;
 
-          /* Fill call message. */
-          message.handler = call->handler;
-          message.ctx = call->ctx;
+          /* Pick the callee and fill call message with its handler. */
+          callee = route_execution(call, execution, &message.handler, &message.ctx);
 
           message.caller = fusionee ? fusionee_id(fusionee) : 0;
 
@@ -541,7 +664,7 @@ restart:
           }
 
           /* Put message into queue of callee. */
-          ret = fusionee_send_message2(dev, fusionee, call->fusionee, FMT_CALL,
+          ret = fusionee_send_message2(dev, fusionee, callee, FMT_CALL,
                                        call->entry.id, 0, sizeof(FusionCallMessage),
                                        &message, callback, quota, 1, execute->ptr, execute->length,
                                        flush);
@@ -565,7 +688,7 @@ restart:
 
           /* Transfer held skirmishs (locks). */
           if (fusionee && (!(execute->flags & FCEF_RESUMABLE) || execute->serial == 0))
-               fusion_skirmish_transfer_all(dev, call->fusionee->id,
+               fusion_skirmish_transfer_all(dev, callee->id,
                                             fusionee_id(fusionee),
                                             fusion_core_pid( fusion_core ),
                                             execution->serial);
@@ -576,7 +699,7 @@ restart:
                FUSION_DEBUG( "  -> skirmishs transferred, sleeping on call...\n" );
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true );
 
                if (signal_pending(current)) {
                     FUSION_DEBUG( "  -> woke up, SIGNAL PENDING!\n" );
@@ -596,7 +719,7 @@ restart:
                     return -EINTR;
                }
 #else
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, false );
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, false );
 #endif
           }
 
@@ -641,15 +764,8 @@ fusion_call_return(FusionDev * dev, int fusion_id, FusionCallReturn * call_ret)
 
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
-     /* Search for execution, starting with oldest. */
-     direct_list_foreach (execution, call->executions) {
-          if ((execution->executed)
-              || (execution->call_id != call_ret->call_id)
-              || ((dev->api.major >= 4)
-                  && (execution->serial != call_ret->serial))) {
-               continue;
-          }
-
+     execution = lookup_execution(call, (dev->api.major >= 4) ? call_ret->serial : 0);
+     if (execution) {
           /*
            * Check if caller received a signal while waiting for the result.
            *
@@ -670,11 +786,20 @@ fusion_call_return(FusionDev * dev, int fusion_id, FusionCallReturn * call_ret)
           /* FIXME: Caller might still have received a signal since check above. */
           FUSION_ASSERT(!execution->signalled);
 
+          /* No skirmishs have been transferred for asynchronous executions. */
+          if (execution->async) {
+               complete_async(dev, call, execution);
+               return 0;
+          }
+
           /* Return skirmishs. */
           fusion_skirmish_return_all(dev, fusion_id, execution->caller_pid, execution->serial);
 
-          /* Wake up caller. */
-          fusion_core_wq_wake( fusion_core, &execution->wait);
+          /* Wake up caller, the callee goes back to receiving. */
+          if (execution->handoff)
+               fusion_core_wq_wake_sync( fusion_core, &execution->wait );
+          else
+               fusion_core_wq_wake( fusion_core, &execution->wait);
 
           return 0;
      }
@@ -686,19 +811,24 @@ fusion_call_return(FusionDev * dev, int fusion_id, FusionCallReturn * call_ret)
      return -ENOMSG;
 }
 
-int
-fusion_call_execute3(FusionDev * dev, Fusionee * fusionee,
-                     FusionCallExecute3 * execute)
+/*
+ * Sends the message of a new execution of FUSION_CALL_EXECUTE3, waiting for the quota first.
+ * Unless FCEF_ONEWAY is set, an execution is added to receive the result.
+ * With a block of the call arena, the data is passed by offset instead of being copied.
+ */
+static int
+send_execute3(FusionDev * dev, Fusionee * fusionee, FusionCallExecute3 * execute, FusionCallBlock * block,
+              FusionCall ** ret_call, FusionCallExecution ** ret_execution, Fusionee ** ret_callee)
 {
      int ret;
      FusionCall *call;
      FusionCallExecution *execution = NULL;
+     Fusionee *callee;
      FusionCallMessage3 message;
      unsigned int serial;
      bool flush = true;
-
-     FUSION_DEBUG( "%s( dev %p, fusionee %p, execute %p, call id %d, serial %u )\n", __FUNCTION__, dev, fusionee, execute,
-                   execute->call_id, execute->serial );
+     CallQuota *quota;
+     FusionMessageCallback callback = FMC_NONE;
 
 restart:
      /* Lookup and lock call. */
@@ -708,103 +838,170 @@ restart:
 
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
-     if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
-          /* Search for execution, starting with oldest. */
-          direct_list_foreach (execution, call->executions) {
-               if (execution->serial == execute->serial)
-                    break;
-          }
-
-          if (!execution) {
-               printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
-               direct_list_foreach (execution, call->executions) {
-                    printk( KERN_ERR "%s:   having serial %u\n", __FUNCTION__, execution->serial );
-               }
-               return -EIDRM;
-          }
-     }
-     else {
-          CallQuota             *quota    = NULL;
-          FusionMessageCallback  callback = FMC_NONE;
+     quota = NULL;
 
-          if (call->quotas->nnodes) {
-               // TODO: optimise by keeping last quota lookup which is most likely the one we want
-               quota = fusion_hash_lookup( call->quotas, (void*)(long) fusionee->id );
-               if (quota) {
-                    if (quota->count >= quota->limit) {
-                         fusionee->wait_on_call_quota = execute->call_id;
+     if (call->quotas->nnodes) {
+          // TODO: optimise by keeping last quota lookup which is most likely the one we want
+          quota = fusion_hash_lookup( call->quotas, (void*)(long) fusionee->id );
+          if (quota) {
+               if (quota->count >= quota->limit) {
+                    fusionee->wait_on_call_quota = execute->call_id;
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, true );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, true );
 
-                         if (signal_pending(current)) {
-                              FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
-                              fusionee->wait_on_call_quota = 0;
-                              return -EINTR;
-                         }
+                    if (signal_pending(current)) {
+                         FUSION_DEBUG( "  -> woke up waiting for quota, SIGNAL PENDING!\n" );
+                         fusionee->wait_on_call_quota = 0;
+                         return -EINTR;
+                    }
 #else
-                         fusion_core_wq_wait( fusion_core, &quota->wait, 0, false );
+                    fusion_core_wq_wait( fusion_core, &quota->wait, &dev->lock, 0, false );
 #endif
-                         fusionee->wait_on_call_quota = 0;
+                    fusionee->wait_on_call_quota = 0;
 
-                         goto restart;
-                    }
+                    goto restart;
                }
           }
+     }
 
-          do {
-               serial = ++call->serial;
-          } while (!serial);
+     do {
+          serial = ++call->serial;
+     } while (!serial);
 
-          /* Add execution to receive the result. */
-          if (!(execute->flags & FCEF_ONEWAY)) {
-               execution = add_execution(call, fusionee, serial, execute->ret_length);
-               if (!execution)
-                    return -ENOMEM;
+     /* Add execution to receive the result. */
+     if (!(execute->flags & FCEF_ONEWAY)) {
+          execution = add_execution(call, fusionee, serial, block ? 0 : execute->ret_length);
+          if (!execution)
+               return -ENOMEM;
 
-               FUSION_DEBUG( "  -> execution %p, serial %u\n", execution, execution->serial );
+          FUSION_DEBUG( "  -> execution %p, serial %u\n", execution, execution->serial );
+
+          /* The block is released along with the execution. */
+          if (block) {
+               execution->block = block;
+               block->busy      = true;
           }
-          else if (execute->flags & FCEF_QUEUE)
-               flush = false;
+     }
+     else if (execute->flags & FCEF_QUEUE)
+          flush = false;
 
-          /* Fill call message. */
-          message.handler = call->handler;
-          message.ctx = call->ctx;
+     /* Pick the callee and fill call message with its handler. */
+     callee = route_execution(call, execution, &message.handler, &message.ctx);
 
-          message.caller = fusionee ? fusionee_id(fusionee) : 0;
+     message.caller = fusionee ? fusionee_id(fusionee) : 0;
 
-          message.call_arg    = execute->call_arg;
-          message.call_ptr    = NULL;
-          message.call_length = execute->length;
-          message.ret_length  = execute->ret_length;
+     message.call_arg    = execute->call_arg;
+     message.call_ptr    = block ? (void*)(unsigned long) block->offset : NULL;
+     message.call_length = execute->length;
+     message.ret_length  = execute->ret_length;
 
-          message.serial = execution ? serial : 0;
+     message.serial = execution ? serial : 0;
 
-          FUSION_DEBUG( "  -> sending call message, caller %u, ptr %p, length %u\n", message.caller, execute->ptr, execute->length );
+     FUSION_DEBUG( "  -> sending call message, caller %u, ptr %p, length %u\n", message.caller, execute->ptr, execute->length );
 
-          if (quota/* && ++quota->count % (quota->limit/4+1) == 0*/) {
-               ++quota->count;
-               callback = FMC_CALL_QUOTA;
-               //flush    = true;
+     if (quota/* && ++quota->count % (quota->limit/4+1) == 0*/) {
+          ++quota->count;
+          callback = FMC_CALL_QUOTA;
+          //flush    = true;
+     }
+
+     /* Put message into queue of callee. */
+     ret = fusionee_send_message2(dev, fusionee, callee, block ? FMT_CALL3_ARENA : FMT_CALL3,
+                                  call->entry.id, 0, sizeof(FusionCallMessage3),
+                                  &message, callback, quota, 1, block ? NULL : execute->ptr,
+                                  block ? 0 : execute->length, flush);
+     if (ret) {
+          FUSION_DEBUG( "  -> MESSAGE SENDING FAILED! (ret %u)\n", ret );
+          if (quota)
+               quota->count--;
+          if (execution) {
+               remove_execution(call, execution);
+               free_execution(dev, execution);
           }
+          return ret;
+     }
 
-          /* Put message into queue of callee. */
-          ret = fusionee_send_message2(dev, fusionee, call->fusionee, FMT_CALL3,
-                                       call->entry.id, 0, sizeof(FusionCallMessage3),
-                                       &message, callback, quota, 1, execute->ptr, execute->length,
-                                       flush);
-          if (ret) {
-               FUSION_DEBUG( "  -> MESSAGE SENDING FAILED! (ret %u)\n", ret );
-               if (quota)
-                    quota->count--;
-               if (execution) {
-                    remove_execution(call, execution);
-                    free_execution(dev, execution);
-               }
+     call->count++;
+
+     *ret_call      = call;
+     *ret_execution = execution;
+     *ret_callee    = callee;
+
+     return 0;
+}
+
+int
+fusion_call_execute3(FusionDev * dev, Fusionee * fusionee,
+                     FusionCallExecute3 * execute)
+{
+     int ret;
+     FusionCall *call;
+     FusionCallExecution *execution = NULL;
+     FusionCallBlock *block = NULL;
+     struct task_struct *handoff = NULL;
+     Fusionee *callee = NULL;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, execute %p, call id %d, serial %u )\n", __FUNCTION__, dev, fusionee, execute,
+                   execute->call_id, execute->serial );
+
+     /* The serial returns the handle, there's nothing to resume. */
+     if (execute->flags & FCEF_ASYNC && (!fusionee || execute->flags & FCEF_RESUMABLE))
+          return -EINVAL;
+
+     /* The block of the call arena is held by the execution until it returns. */
+     if (execute->flags & FCEF_ARENA && (!fusionee || execute->flags & (FCEF_ONEWAY | FCEF_ASYNC)))
+          return -EINVAL;
+
+     if (execute->flags & FCEF_RESUMABLE && execute->serial != 0) {
+          /* Lookup and lock call. */
+          ret = fusion_call_lookup(&dev->call, execute->call_id, &call);
+          if (ret)
                return ret;
+
+          FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
+
+          execution = lookup_serial( call, execute->serial );
+          if (!execution) {
+               printk( KERN_ERR "%s: resumable execution with serial %u not found!\n", __FUNCTION__, execute->serial );
+               direct_list_foreach (execution, call->executions) {
+                    printk( KERN_ERR "%s:   having serial %u\n", __FUNCTION__, execution->serial );
+               }
+               return -EIDRM;
           }
 
-          call->count++;
+          callee = execution->worker ? execution->worker->fusionee : call->fusionee;
+     }
+     else {
+          if (execute->flags & FCEF_ARENA) {
+               ret = lookup_block(dev, fusionee, execute, &block);
+               if (ret)
+                    return ret;
+          }
+
+          ret = send_execute3(dev, fusionee, execute, block, &call, &execution, &callee);
+          if (ret)
+               return ret;
+
+          /* Don't wait, the result is collected via fusion_call_wait_async(). */
+          if (execute->flags & FCEF_ASYNC) {
+               execute->serial = 0;
+
+               if (execution) {
+                    do {
+                         execution->handle = ++fusionee->call_handle;
+                    } while (!execution->handle);
+
+                    execution->async   = true;
+                    execution->ret_ptr = execute->ret_ptr;
+
+                    direct_list_append( &fusionee->call_async, &execution->async_link );
+
+                    execute->serial = execution->handle;
+               }
+
+               return 0;
+          }
      }
 
      /* When waiting for a result... */
@@ -813,18 +1010,34 @@ restart:
 
           /* Transfer held skirmishs (locks). */
           if (fusionee && (!(execute->flags & FCEF_RESUMABLE) || execute->serial == 0))
-               fusion_skirmish_transfer_all(dev, call->fusionee->id,
+               fusion_skirmish_transfer_all(dev, callee->id,
                                             fusionee_id(fusionee),
                                             fusion_core_pid( fusion_core ),
                                             execution->serial);
 
+          /* Hand the CPU over to the dispatcher of the callee if it's waiting for the message. */
+          if (execute->flags & FCEF_HANDOFF && !execution->executed) {
+               execution->handoff = true;
+
+               handoff = callee ? callee->waiter : NULL;
+               if (handoff)
+                    get_task_struct( handoff );
+          }
+
           while (!execution->executed) {
                /* Unlock call and wait for execution result. TODO: add timeout? */
 
                FUSION_DEBUG( "  -> skirmishs transferred, sleeping on call...\n" );
 
 #ifdef FUSION_CALL_INTERRUPTIBLE
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true );
+               if (handoff) {
+                    fusion_core_wq_wait_handoff( fusion_core, &execution->wait, &dev->lock, handoff, true );
+
+                    put_task_struct( handoff );
+                    handoff = NULL;
+               }
+               else
+                    fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true );
 
                if (signal_pending(current)) {
                     FUSION_DEBUG( "  -> woke up, SIGNAL PENDING!\n" );
@@ -844,12 +1057,21 @@ restart:
                     return -EINTR;
                }
 #else
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, false );
+               if (handoff) {
+                    fusion_core_wq_wait_handoff( fusion_core, &execution->wait, &dev->lock, handoff, false );
+
+                    put_task_struct( handoff );
+                    handoff = NULL;
+               }
+               else
+                    fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, false );
 #endif
           }
 
-          /* Return result to calling process. */
-          if (execution->ret_length) {
+          /* Return result to calling process, unless it's in the call arena already. */
+          if (!execution->ret_length)
+               ret = -ENODATA;
+          else if (!execution->block) {
                FUSION_DEBUG( "  -> ret_length %u, ret_size %u, ret_ptr %p\n", execution->ret_length, execution->ret_size, execute->ret_ptr );
 
                FUSION_ASSERT( execution->ret_length <= execution->ret_size );
@@ -859,8 +1081,6 @@ restart:
                     ret = -EFAULT;
                }
           }
-          else
-               ret = -ENODATA;
 
           execute->ret_length = execution->ret_length;
 
@@ -902,15 +1122,8 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
 
      FUSION_DEBUG( "  -> call %u '%s'\n", call->entry.id, call->entry.name );
 
-     /* Search for execution, starting with oldest. */
-     direct_list_foreach (execution, call->executions) {
-          if ((execution->executed)
-              || (execution->call_id != call_ret->call_id)
-              || ((dev->api.major >= 4)
-                  && (execution->serial != call_ret->serial))) {
-               continue;
-          }
-
+     execution = lookup_execution(call, (dev->api.major >= 4) ? call_ret->serial : 0);
+     if (execution) {
           /*
            * Check if caller received a signal while waiting for the result.
            *
@@ -924,18 +1137,14 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
                return -EIDRM;
           }
 
-          if (execution->ret_size < call_ret->length) {
-               /* Remove and free execution. */
-               remove_execution(call, execution);
-               free_execution(dev, execution);
+          if ((execution->block ? execution->block->size : execution->ret_size) < call_ret->length) {
+               fail_execution(dev, call, execution, -E2BIG);
                return -E2BIG;
           }
 
-          /* Write result to execution. */
-          if (copy_from_user( execution + 1, call_ret->ptr, call_ret->length )) {
-               /* Remove and free execution. */
-               remove_execution(call, execution);
-               free_execution(dev, execution);
+          /* Write result to execution, unless it's in the call arena already. */
+          if (!execution->block && copy_from_user( execution + 1, call_ret->ptr, call_ret->length )) {
+               fail_execution(dev, call, execution, -EFAULT);
                return -EFAULT;
           }
 
@@ -945,11 +1154,20 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
           /* FIXME: Caller might still have received a signal since check above. */
           FUSION_ASSERT(!execution->signalled);
 
+          /* No skirmishs have been transferred for asynchronous executions. */
+          if (execution->async) {
+               complete_async(dev, call, execution);
+               return 0;
+          }
+
           /* Return skirmishs. */
           fusion_skirmish_return_all(dev, fusion_id, execution->caller_pid, execution->serial);
 
-          /* Wake up caller. */
-          fusion_core_wq_wake( fusion_core, &execution->wait);
+          /* Wake up caller, the callee goes back to receiving. */
+          if (execution->handoff)
+               fusion_core_wq_wake_sync( fusion_core, &execution->wait );
+          else
+               fusion_core_wq_wake( fusion_core, &execution->wait);
 
           return 0;
      }
@@ -963,16 +1181,21 @@ fusion_call_return3(FusionDev * dev, int fusion_id, FusionCallReturn3 * call_ret
 
 int fusion_call_get_owner(FusionDev * dev, int call_id, FusionID *ret_fusion_id)
 {
-     int         ret;
      FusionCall *call;
 
-     /* Lookup and lock call. */
-     ret = fusion_call_lookup(&dev->call, call_id, &call);
-     if (ret)
-          return ret;
+     /* The creator never changes, no locking needed. */
+     rcu_read_lock();
+
+     call = fusion_call_lookup_rcu(&dev->call, call_id);
+     if (!call) {
+          rcu_read_unlock();
+          return -EINVAL;
+     }
 
      *ret_fusion_id = call->entry.creator;
 
+     rcu_read_unlock();
+
      return 0;
 }
 
@@ -1031,7 +1254,7 @@ int fusion_call_destroy(FusionDev * dev, Fusionee *fusionee, int call_id)
           execution = (FusionCallExecution *) call->executions;
           if (execution) {
                /* Unlock call and wait for execution. TODO: add timeout? */
-               fusion_core_wq_wait( fusion_core, &execution->wait, 0, true);
+               fusion_core_wq_wait( fusion_core, &execution->wait, &dev->lock, 0, true);
 
                if (signal_pending(current))
                     return -EINTR;
@@ -1045,82 +1268,819 @@ int fusion_call_destroy(FusionDev * dev, Fusionee *fusionee, int call_id)
 
 void fusion_call_destroy_all(FusionDev * dev, Fusionee *fusionee)
 {
-     FusionLink *l;
+     FusionLink *l, *n;
 
      FUSION_DEBUG( "%s( dev %p, fusion_id %lu )\n", __FUNCTION__, dev, fusionee->id );
 
-     l = dev->call.list;
-
-     while (l) {
-          FusionLink *next = l->next;
-          FusionCall *call = (FusionCall *) l;
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_CALLS)) {
+          FusionCall          *call = (FusionCall *) ((FusioneeOwnedLink *) l)->entry;
+          FusionCallExecution *execution;
 
-          if (call->fusionee == fusionee) {
-               FusionCallExecution *execution;
-
-               /* If an execution is pending... */
-               direct_list_foreach (execution, call->executions) {
-                    // FIMXE: indicate to caller that fusionee did quit
+          FUSION_ASSERT( call->fusionee == fusionee );
 
-                    /* Wake up uninterruptibly(!) waiting caller! */
-                    fusion_core_wq_wake( fusion_core, &execution->wait );
-               }
+          /* If an execution is pending... */
+          direct_list_foreach (execution, call->executions) {
+               // FIMXE: indicate to caller that fusionee did quit
 
-               fusion_entry_destroy_locked(call->entry.entries,
-                                           &call->entry);
+               /* Wake up uninterruptibly(!) waiting caller! */
+               fusion_core_wq_wake( fusion_core, &execution->wait );
           }
 
-          l = next;
+          fusion_entry_destroy_locked(call->entry.entries,
+                                      &call->entry);
      }
-}
 
-/******************************************************************************/
+     /* Fail executions sent to the fusionee as a worker, skirmishs have been returned already. */
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_CALL_WORKERS)) {
+          CallWorker          *worker = container_of( l, CallWorker, owned.link );
+          FusionCall          *call   = worker->call;
+          FusionCallExecution *execution, *next;
 
-static FusionCallExecution *add_execution(FusionCall * call,
-                                          Fusionee * caller,
-                                          unsigned int serial,
-                                          unsigned int ret_size)
-{
-     FusionCallExecution *execution;
+          fusionee_disown( dev, &worker->owned );
 
-     FUSION_DEBUG( "%s( call %p [%u], caller %p [%lu], serial %i )\n", __FUNCTION__, call, call->entry.id, caller, caller ? caller->id : 0, serial );
+          worker->fusionee = NULL;
 
-     /* Allocate execution. */
+          /* Not to be freed by removing its executions below. */
+          worker->pending++;
 
-     if (ret_size < 20 && call->entry.entries->dev->execution_free_list_num > 0) {
-          execution = (FusionCallExecution *)call->entry.entries->dev->execution_free_list;
-          direct_list_remove( &call->entry.entries->dev->execution_free_list, &execution->link );
-          call->entry.entries->dev->execution_free_list_num--;
-     }
-     else {
-          execution = fusion_core_malloc( fusion_core, sizeof(FusionCallExecution) + (ret_size > CACHE_EXECUTIONS_DATA_LEN ? ret_size : CACHE_EXECUTIONS_DATA_LEN) );
-     }
-     if (!execution)
-          return NULL;
+          direct_list_foreach_safe (execution, next, call->executions) {
+               if (execution->worker != worker || execution->executed)
+                    continue;
 
-     /* Initialize execution. */
-     memset(execution, 0, sizeof(FusionCallExecution));
+               execution->executed = true;
 
-     execution->caller = caller;
-     execution->caller_pid = fusion_core_pid( fusion_core );
-     execution->call_id = call->entry.id;
-     execution->serial = serial;
-     execution->ret_size = ret_size;
+               if (execution->signalled) {
+                    remove_execution( call, execution );
+                    free_execution( dev, execution );
+               }
+               else if (execution->async) {
+                    execution->error = -EIDRM;
 
-     fusion_core_wq_init( fusion_core, &execution->wait);
+                    complete_async( dev, call, execution );
+               }
+               else
+                    fusion_core_wq_wake( fusion_core, &execution->wait );
+          }
 
-     /* Add execution. */
-     direct_list_append(&call->executions, &execution->link);
+          /* Executions being collected by their callers still refer to it. */
+          worker->removed = true;
 
-     return execution;
-}
+          if (!--worker->pending)
+               free_worker( dev, worker );
+     }
 
-static void remove_execution( FusionCall * call, FusionCallExecution * execution )
+     /* Orphan asynchronous executions of the fusionee, they're freed when returned. */
+     fusion_list_foreach_safe(l, n, fusionee->call_async) {
+          FusionCallExecution *execution = container_of( l, FusionCallExecution, async_link );
+
+          fusion_list_remove( &fusionee->call_async, l );
+
+          if (execution->executed)
+               free_execution( dev, execution );
+          else
+               execution->caller = NULL;
+     }
+
+     /* Blocks of the call arena in use are freed along with the execution. */
+     fusion_list_foreach_safe(l, n, fusionee->call_blocks) {
+          FusionCallBlock *block = (FusionCallBlock *) l;
+
+          fusion_list_remove( &fusionee->call_blocks, l );
+
+          if (block->busy)
+               block->owner = NULL;
+          else
+               free_block( dev, block );
+     }
+}
+
+/******************************************************************************/
+
+static inline FusionCallSubmission *
+call_ring_sq( Fusionee *fusionee )
+{
+     return (FusionCallSubmission *)((char*) fusionee->call_ring + PAGE_SIZE);
+}
+
+static inline FusionCallCompletion *
+call_ring_cq( Fusionee *fusionee )
+{
+     return (FusionCallCompletion *)(call_ring_sq( fusionee ) + fusionee->call_ring_entries);
+}
+
+/*
+ * Returns true if the completion of another call fits into the completion queue.
+ */
+static inline bool
+call_ring_has_room( Fusionee *fusionee )
+{
+     unsigned int used = fusionee->call_ring_cq_tail - READ_ONCE( fusionee->call_ring->cq_head );
+
+     /* Also catches a bogus head written by user space. */
+     return used <= fusionee->call_ring_entries &&
+            fusionee->call_ring_pending < fusionee->call_ring_entries - used;
+}
+
+static void
+call_ring_complete( Fusionee *fusionee, unsigned long user_data, int result, unsigned int ret_length )
+{
+     FusionCallCompletion *completion;
+
+     completion = &call_ring_cq( fusionee )[fusionee->call_ring_cq_tail & (fusionee->call_ring_entries - 1)];
+
+     completion->user_data  = user_data;
+     completion->result     = result;
+     completion->ret_length = ret_length;
+
+     fusionee->call_ring_cq_tail++;
+
+     /* Publish the completion after its contents. */
+     smp_store_release( &fusionee->call_ring->cq_tail, fusionee->call_ring_cq_tail );
+}
+
+/*
+ * Copies the return data of an asynchronous execution that has been returned and frees it.
+ * Returns the result of the execution.
+ */
+static int
+collect_async( FusionDev *dev, Fusionee *fusionee, FusionCallExecution *execution, unsigned int *ret_length )
+{
+     int result = execution->error;
+
+     FUSION_ASSERT( execution->executed );
+
+     if (!result) {
+          if (!execution->ret_length)
+               result = -ENODATA;
+          else if (copy_to_user( execution->ret_ptr, execution + 1, execution->ret_length ))
+               result = -EFAULT;
+     }
+
+     *ret_length = execution->ret_length;
+
+     fusion_list_remove( &fusionee->call_async, &execution->async_link );
+
+     free_execution( dev, execution );
+
+     return result;
+}
+
+/*
+ * Adds completions for all asynchronous executions of the ring that have been returned.
+ */
+static void
+call_ring_reap( FusionDev *dev, Fusionee *fusionee )
+{
+     FusionLink *l, *n;
+
+     fusion_list_foreach_safe(l, n, fusionee->call_async) {
+          FusionCallExecution *execution = container_of( l, FusionCallExecution, async_link );
+          unsigned long        user_data = execution->user_data;
+          unsigned int         ret_length;
+          int                  result;
+
+          if (!execution->executed || execution->handle)
+               continue;
+
+          result = collect_async( dev, fusionee, execution, &ret_length );
+
+          call_ring_complete( fusionee, user_data, result, ret_length );
+
+          fusionee->call_ring_pending--;
+     }
+}
+
+int
+fusion_call_ring_mmap(FusionDev * dev, Fusionee * fusionee, struct vm_area_struct *vma)
+{
+     unsigned long size = vma->vm_end - vma->vm_start;
+     unsigned int  entries;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     if (size > FUSION_CALL_RING_SIZE_MAX ||
+         size < PAGE_SIZE + sizeof(FusionCallSubmission) + sizeof(FusionCallCompletion))
+          return -EINVAL;
+
+     entries = rounddown_pow_of_two( (size - PAGE_SIZE) / (sizeof(FusionCallSubmission) + sizeof(FusionCallCompletion)) );
+
+     if (fusionee->call_ring) {
+          if (entries != fusionee->call_ring_entries)
+               return -EBUSY;
+     }
+     else {
+          fusionee->call_ring = vmalloc_user( size );
+          if (!fusionee->call_ring)
+               return -ENOMEM;
+
+          fusionee->call_ring_entries = entries;
+          fusionee->call_ring_sq_head = 0;
+          fusionee->call_ring_cq_tail = 0;
+
+          fusionee->call_ring->entries   = entries;
+          fusionee->call_ring->sq_offset = PAGE_SIZE;
+          fusionee->call_ring->cq_offset = PAGE_SIZE + entries * sizeof(FusionCallSubmission);
+     }
+
+     return remap_vmalloc_range( vma, fusionee->call_ring, 0 );
+}
+
+int
+fusion_call_ring_enter(FusionDev * dev, Fusionee * fusionee, FusionCallRingEnter * enter)
+{
+     int          ret = 0;
+     unsigned int tail;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, to_submit %u, min_complete %u )\n", __FUNCTION__, dev, fusionee,
+                   enter->to_submit, enter->min_complete );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     if (!fusionee->call_ring)
+          return -EINVAL;
+
+     enter->submitted = 0;
+
+     tail = smp_load_acquire( &fusionee->call_ring->sq_tail );
+
+     while (enter->submitted < enter->to_submit && fusionee->call_ring_sq_head != tail && call_ring_has_room( fusionee )) {
+          FusionCallSubmission  submission;
+          FusionCall           *call;
+          FusionCallExecution  *execution = NULL;
+          Fusionee             *callee;
+
+          /* Take a copy, user space may still write to it. */
+          submission = call_ring_sq( fusionee )[fusionee->call_ring_sq_head & (fusionee->call_ring_entries - 1)];
+
+          submission.execute.flags &= FCEF_ONEWAY | FCEF_QUEUE;
+
+          /* FUSION_CALL_RING_ENTER itself is not subject to permissions, each call is. */
+          if (dev->secure && fusionee_id( fusionee ) != FUSION_ID_MASTER)
+               ret = fusion_entry_check_permissions( &dev->call, submission.execute.call_id, fusionee_id( fusionee ),
+                                                     _IOC_NR(FUSION_CALL_EXECUTE3) );
+
+          if (!ret)
+               ret = send_execute3( dev, fusionee, &submission.execute, NULL, &call, &execution, &callee );
+
+          /* Interrupted while waiting for the quota, the submission is left in the queue. */
+          if (ret == -EINTR)
+               break;
+
+          fusionee->call_ring_sq_head++;
+
+          enter->submitted++;
+
+          if (ret)
+               call_ring_complete( fusionee, submission.user_data, ret, 0 );
+          else if (execution) {
+               execution->async     = true;
+               execution->ret_ptr   = submission.execute.ret_ptr;
+               execution->user_data = submission.user_data;
+
+               direct_list_append( &fusionee->call_async, &execution->async_link );
+
+               fusionee->call_ring_pending++;
+          }
+
+          ret = 0;
+     }
+
+     smp_store_release( &fusionee->call_ring->sq_head, fusionee->call_ring_sq_head );
+
+     if (ret)
+          return ret;
+
+     while (true) {
+          call_ring_reap( dev, fusionee );
+
+          /* Done when enough completions are available, or no more will come. */
+          if (fusionee->call_ring_cq_tail - READ_ONCE( fusionee->call_ring->cq_head ) >= enter->min_complete ||
+              !fusionee->call_ring_pending)
+               break;
+
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_call, &dev->lock, 0, true );
+
+          if (signal_pending(current))
+               return -EINTR;
+     }
+
+     return 0;
+}
+
+/******************************************************************************/
+
+/*
+ * Looks up an execution started with FCEF_ASYNC. Only a few are expected to be pending at a time.
+ */
+static FusionCallExecution *
+lookup_async( Fusionee *fusionee, unsigned int handle )
+{
+     FusionLink *l;
+
+     /* Executions of the ring have no handle. */
+     if (!handle)
+          return NULL;
+
+     fusion_list_foreach (l, fusionee->call_async) {
+          FusionCallExecution *execution = container_of( l, FusionCallExecution, async_link );
+
+          if (execution->handle == handle)
+               return execution;
+     }
+
+     return NULL;
+}
+
+int
+fusion_call_wait_async(FusionDev * dev, Fusionee * fusionee, FusionCallWait * wait)
+{
+     unsigned int i;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, num_handles %u, min_complete %u )\n", __FUNCTION__, dev, fusionee,
+                   wait->num_handles, wait->min_complete );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     /* The handles are looked up again after each wakeup, with the world locked. */
+     if (wait->num_handles > FUSION_CALL_WAIT_MAX || wait->min_complete > wait->num_handles)
+          return -EINVAL;
+
+     /* Count first, handles are only released once enough of them completed. */
+     while (true) {
+          unsigned int completed = 0;
+
+          for (i = 0; i < wait->num_handles; i++) {
+               FusionCallExecution *execution;
+               unsigned int         handle;
+
+               if (get_user( handle, &wait->handles[i].handle ))
+                    return -EFAULT;
+
+               execution = lookup_async( fusionee, handle );
+
+               /* Unknown handles complete with an error. */
+               if (!execution || execution->executed)
+                    completed++;
+          }
+
+          if (completed >= wait->min_complete)
+               break;
+
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_call, &dev->lock, 0, true );
+
+          if (signal_pending(current))
+               return -EINTR;
+     }
+
+     wait->completed = 0;
+
+     for (i = 0; i < wait->num_handles; i++) {
+          FusionCallHandle     handle;
+          FusionCallExecution *execution;
+
+          if (copy_from_user( &handle, &wait->handles[i], sizeof(handle) ))
+               return -EFAULT;
+
+          execution = lookup_async( fusionee, handle.handle );
+          if (!execution) {
+               handle.result     = -EINVAL;
+               handle.ret_length = 0;
+          }
+          else if (execution->executed)
+               handle.result = collect_async( dev, fusionee, execution, &handle.ret_length );
+          else {
+               handle.result     = -EAGAIN;
+               handle.ret_length = 0;
+          }
+
+          if (handle.result != -EAGAIN)
+               wait->completed++;
+
+          if (copy_to_user( &wait->handles[i], &handle, sizeof(handle) ))
+               return -EFAULT;
+     }
+
+     return 0;
+}
+
+/******************************************************************************/
+
+/*
+ * Creates the call arena of the world on first use.
+ */
+static int
+call_arena_init( FusionDev *dev )
+{
+     int ret;
+
+     if (dev->call_arena.area)
+          return 0;
+
+     /* Sharing call data between all fusionees would bypass permissions. */
+     if (!fusion_call_arena_size || dev->secure)
+          return -EOPNOTSUPP;
+
+     dev->call_arena.pages = PAGE_ALIGN( fusion_call_arena_size ) >> PAGE_SHIFT;
+
+     ret = fusion_hash_create( FHT_INT, FHT_PTR, 17, &dev->call_arena.blocks );
+     if (ret)
+          return ret;
+
+     dev->call_arena.map  = fusion_core_malloc( fusion_core, BITS_TO_LONGS( dev->call_arena.pages ) * sizeof(unsigned long) );
+     dev->call_arena.area = vmalloc_user( dev->call_arena.pages << PAGE_SHIFT );
+
+     if (!dev->call_arena.map || !dev->call_arena.area) {
+          if (dev->call_arena.area)
+               vfree( dev->call_arena.area );
+
+          if (dev->call_arena.map)
+               fusion_core_free( fusion_core, dev->call_arena.map );
+
+          fusion_hash_destroy( dev->call_arena.blocks );
+
+          memset( &dev->call_arena, 0, sizeof(dev->call_arena) );
+
+          return -ENOMEM;
+     }
+
+     return 0;
+}
+
+static void
+call_arena_deinit( FusionDev *dev )
+{
+     FusionCallBlock    *block;
+     FusionHashIterator  it;
+
+     if (!dev->call_arena.area)
+          return;
+
+     fusion_hash_foreach (block, it, dev->call_arena.blocks)
+          fusion_core_free( fusion_core, block );
+
+     fusion_hash_destroy( dev->call_arena.blocks );
+
+     fusion_core_free( fusion_core, dev->call_arena.map );
+
+     vfree( dev->call_arena.area );
+
+     memset( &dev->call_arena, 0, sizeof(dev->call_arena) );
+}
+
+static void
+free_block( FusionDev *dev, FusionCallBlock *block )
+{
+     bitmap_clear( dev->call_arena.map, block->offset >> PAGE_SHIFT, block->size >> PAGE_SHIFT );
+
+     fusion_hash_remove( dev->call_arena.blocks, (void*)(long) block->offset, NULL, NULL );
+
+     fusion_core_free( fusion_core, block );
+}
+
+/*
+ * Called when the execution holding the block is freed.
+ */
+static void
+release_block( FusionDev *dev, FusionCallBlock *block )
+{
+     FUSION_ASSERT( block->busy );
+
+     block->busy = false;
+
+     if (!block->owner)
+          free_block( dev, block );
+}
+
+/*
+ * Looks up the block passed by the caller with FCEF_ARENA, which has to be available.
+ */
+static int
+lookup_block( FusionDev *dev, Fusionee *fusionee, FusionCallExecute3 *execute, FusionCallBlock **ret_block )
+{
+     FusionCallBlock *block = NULL;
+
+     if (dev->call_arena.area)
+          block = fusion_hash_lookup( dev->call_arena.blocks, (void*)(long) execute->ptr );
+
+     if (!block || block->owner != fusionee)
+          return -EINVAL;
+
+     if (block->busy)
+          return -EBUSY;
+
+     if (execute->length > block->size || execute->ret_length > block->size)
+          return -EMSGSIZE;
+
+     *ret_block = block;
+
+     return 0;
+}
+
+int
+fusion_call_arena_alloc(FusionDev * dev, Fusionee * fusionee, FusionCallArenaAlloc * alloc)
+{
+     int              ret;
+     unsigned int     pages;
+     unsigned long    index;
+     FusionCallBlock *block;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, size %u )\n", __FUNCTION__, dev, fusionee, alloc->size );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     ret = call_arena_init( dev );
+     if (ret)
+          return ret;
+
+     pages = PAGE_ALIGN( (unsigned long) alloc->size ) >> PAGE_SHIFT;
+     if (!pages || pages > dev->call_arena.pages)
+          return -EINVAL;
+
+     index = bitmap_find_next_zero_area( dev->call_arena.map, dev->call_arena.pages, 0, pages, 0 );
+     if (index >= dev->call_arena.pages)
+          return -ENOSPC;
+
+     block = fusion_core_malloc( fusion_core, sizeof(FusionCallBlock) );
+     if (!block)
+          return -ENOMEM;
+
+     block->offset = index << PAGE_SHIFT;
+     block->size   = pages << PAGE_SHIFT;
+     block->owner  = fusionee;
+
+     ret = fusion_hash_insert( dev->call_arena.blocks, (void*)(long) block->offset, block );
+     if (ret) {
+          fusion_core_free( fusion_core, block );
+          return ret;
+     }
+
+     bitmap_set( dev->call_arena.map, index, pages );
+
+     direct_list_prepend( &fusionee->call_blocks, &block->link );
+
+     alloc->offset = block->offset;
+
+     return 0;
+}
+
+int
+fusion_call_arena_free(FusionDev * dev, Fusionee * fusionee, unsigned int offset)
+{
+     FusionCallBlock *block = NULL;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, offset %u )\n", __FUNCTION__, dev, fusionee, offset );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     if (dev->call_arena.area)
+          block = fusion_hash_lookup( dev->call_arena.blocks, (void*)(long) offset );
+
+     if (!block || block->owner != fusionee)
+          return -EINVAL;
+
+     if (block->busy)
+          return -EBUSY;
+
+     fusion_list_remove( &fusionee->call_blocks, &block->link );
+
+     free_block( dev, block );
+
+     return 0;
+}
+
+int
+fusion_call_arena_mmap(FusionDev * dev, Fusionee * fusionee, struct vm_area_struct *vma)
+{
+     int ret;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     ret = call_arena_init( dev );
+     if (ret)
+          return ret;
+
+     if (vma->vm_end - vma->vm_start > (unsigned long) dev->call_arena.pages << PAGE_SHIFT)
+          return -EINVAL;
+
+     return remap_vmalloc_range( vma, dev->call_arena.area, 0 );
+}
+
+/******************************************************************************/
+
+static CallWorker *
+lookup_worker( FusionCall *call, Fusionee *fusionee )
+{
+     FusionLink *l;
+
+     fusion_list_foreach (l, call->workers) {
+          CallWorker *worker = (CallWorker *) l;
+
+          if (worker->fusionee == fusionee)
+               return worker;
+     }
+
+     return NULL;
+}
+
+static void
+free_worker( FusionDev *dev, CallWorker *worker )
+{
+     fusion_list_remove( &worker->call->workers, &worker->link );
+
+     fusionee_disown( dev, &worker->owned );
+
+     fusion_core_free( fusion_core, worker );
+}
+
+/*
+ * Picks the callee with the fewest executions pending and packets queued, preferring the owner,
+ * and accounts the execution (if any) to it. Returns the handler and context of the callee.
+ */
+static Fusionee *
+route_execution( FusionCall *call, FusionCallExecution *execution, void **ret_handler, void **ret_ctx )
+{
+     FusionLink   *l;
+     CallWorker   *target = NULL;
+     unsigned int  load   = call->pending + call->fusionee->packets.count;
+
+     fusion_list_foreach (l, call->workers) {
+          CallWorker *worker = (CallWorker *) l;
+
+          if (worker->removed)
+               continue;
+
+          if (worker->pending + worker->fusionee->packets.count < load) {
+               target = worker;
+               load   = worker->pending + worker->fusionee->packets.count;
+          }
+     }
+
+     if (!target) {
+          if (execution)
+               call->pending++;
+
+          *ret_handler = call->handler;
+          *ret_ctx     = call->ctx;
+
+          return call->fusionee;
+     }
+
+     if (execution) {
+          execution->worker = target;
+          target->pending++;
+     }
+
+     *ret_handler = target->handler;
+     *ret_ctx     = target->ctx;
+
+     return target->fusionee;
+}
+
+int
+fusion_call_add_worker(FusionDev * dev, Fusionee * fusionee, FusionCallAddWorker * add_worker)
+{
+     int         ret;
+     FusionCall *call;
+     CallWorker *worker;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, call_id %d )\n", __FUNCTION__, dev, fusionee, add_worker->call_id );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     ret = fusion_call_lookup(&dev->call, add_worker->call_id, &call);
+     if (ret)
+          return ret;
+
+     /* Objects of fusionees that did not enter are shared, see fusionee_owned(). */
+     if (!fusionee->id || call->fusionee == fusionee)
+          return -EINVAL;
+
+     worker = lookup_worker( call, fusionee );
+     if (worker) {
+          if (!worker->removed)
+               return -EEXIST;
+
+          worker->removed = false;
+          worker->handler = add_worker->handler;
+          worker->ctx     = add_worker->ctx;
+
+          return 0;
+     }
+
+     worker = fusion_core_malloc( fusion_core, sizeof(CallWorker) );
+     if (!worker)
+          return -ENOMEM;
+
+     memset( worker, 0, sizeof(CallWorker) );
+
+     worker->call     = call;
+     worker->fusionee = fusionee;
+     worker->handler  = add_worker->handler;
+     worker->ctx      = add_worker->ctx;
+
+     direct_list_append( &call->workers, &worker->link );
+
+     fusionee_own_by( dev, fusionee, FUSIONEE_OWNED_CALL_WORKERS, &worker->owned, &call->entry );
+
+     return 0;
+}
+
+int
+fusion_call_remove_worker(FusionDev * dev, Fusionee * fusionee, int call_id)
+{
+     int         ret;
+     FusionCall *call;
+     CallWorker *worker;
+
+     FUSION_DEBUG( "%s( dev %p, fusionee %p, call_id %d )\n", __FUNCTION__, dev, fusionee, call_id );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     ret = fusion_call_lookup(&dev->call, call_id, &call);
+     if (ret)
+          return ret;
+
+     worker = lookup_worker( call, fusionee );
+     if (!worker || worker->removed)
+          return -EINVAL;
+
+     /*
+      * Executions sent already are still to be returned by the worker. Keep it until it leaves
+      * or the call is destroyed, its queued one-way calls refer to the quotas of the call.
+      */
+     worker->removed = true;
+
+     return 0;
+}
+
+/******************************************************************************/
+
+static FusionCallExecution *add_execution(FusionCall * call,
+                                          Fusionee * caller,
+                                          unsigned int serial,
+                                          unsigned int ret_size)
+{
+     FusionCallExecution *execution;
+
+     FUSION_DEBUG( "%s( call %p [%u], caller %p [%lu], serial %i )\n", __FUNCTION__, call, call->entry.id, caller, caller ? caller->id : 0, serial );
+
+     /* Allocate execution. */
+
+     if (ret_size < 20 && call->entry.entries->dev->execution_free_list_num > 0) {
+          execution = (FusionCallExecution *)call->entry.entries->dev->execution_free_list;
+          direct_list_remove( &call->entry.entries->dev->execution_free_list, &execution->link );
+          call->entry.entries->dev->execution_free_list_num--;
+          atomic_dec( &call->entry.entries->dev->pooled );
+     }
+     else if (ret_size <= CACHE_EXECUTIONS_DATA_LEN) {
+          execution = fusion_core_cache_alloc( fusion_core, execution_cache );
+     }
+     else {
+          execution = fusion_core_malloc( fusion_core, sizeof(FusionCallExecution) + ret_size );
+     }
+     if (!execution)
+          return NULL;
+
+     /* Initialize execution. */
+     memset(execution, 0, sizeof(FusionCallExecution));
+
+     execution->caller = caller;
+     execution->caller_pid = fusion_core_pid( fusion_core );
+     execution->call_id = call->entry.id;
+     execution->serial = serial;
+     execution->ret_size = ret_size;
+
+     fusion_core_wq_init( fusion_core, &execution->wait);
+
+     /* Add execution. */
+     direct_list_append(&call->executions, &execution->link);
+     direct_list_append(&call->serials[serial & (CALL_SERIAL_BUCKETS - 1)], &execution->serial_link);
+
+     return execution;
+}
+
+static void remove_execution( FusionCall * call, FusionCallExecution * execution )
 {
      FUSION_DEBUG( "%s( call %p [%u], execution %p )\n", __FUNCTION__, call, call->entry.id, execution );
 
      fusion_list_remove( &call->executions, &execution->link );
 
+     fusion_list_remove( &call->serials[execution->serial & (CALL_SERIAL_BUCKETS - 1)], &execution->serial_link );
+
+     /* No longer counts as load of the callee. */
+     if (execution->worker) {
+          CallWorker *worker = execution->worker;
+
+          FUSION_ASSERT( worker->pending > 0 );
+
+          if (!--worker->pending && worker->removed && !worker->fusionee)
+               free_worker( call->entry.entries->dev, worker );
+
+          execution->worker = NULL;
+     }
+     else if (call->pending)
+          call->pending--;
+
      fusion_core_wq_wake( fusion_core, &execution->wait );
 }
 
@@ -1128,11 +2088,17 @@ static void free_execution( FusionDev * dev, FusionCallExecution * execution )
 {
      FUSION_DEBUG( "%s( execution %p )\n", __FUNCTION__, execution );
 
+     if (execution->block)
+          release_block( dev, execution->block );
+
      if (execution->ret_size <= CACHE_EXECUTIONS_DATA_LEN && dev->execution_free_list_num < CACHE_EXECUTIONS_NUM) {
           direct_list_append( &dev->execution_free_list, &execution->link );
 
           dev->execution_free_list_num++;
+          atomic_inc( &dev->pooled );
      }
+     else if (execution->ret_size <= CACHE_EXECUTIONS_DATA_LEN)
+          fusion_core_cache_free( fusion_core, execution_cache, execution );
      else
           fusion_core_free( fusion_core, execution );
 }
@@ -1148,7 +2114,93 @@ static void free_all_executions(FusionCall * call)
 
           if (!execution->caller)
                free_execution( call->entry.entries->dev,  execution );
+          else if (execution->async) {
+               /* Complete without result, freeing is up to the caller. */
+               execution->error    = -EIDRM;
+               execution->executed = true;
+
+               fusion_core_wq_wake( fusion_core, &execution->caller->wait_call );
+          }
+     }
+}
+
+/*
+ * Looks up a pending execution, no matter if it has been returned already.
+ */
+static FusionCallExecution *lookup_serial(FusionCall * call,
+                                          unsigned int serial)
+{
+     FusionLink *l;
+
+     fusion_list_foreach (l, call->serials[serial & (CALL_SERIAL_BUCKETS - 1)]) {
+          FusionCallExecution *execution = container_of( l, FusionCallExecution, serial_link );
+
+          if (execution->serial == serial)
+               return execution;
+     }
+
+     return NULL;
+}
+
+/*
+ * Finds the pending execution to return to. Callers of API 3.x and older
+ * do not pass a serial (0), in which case the oldest pending execution is
+ * taken.
+ */
+static FusionCallExecution *lookup_execution(FusionCall * call,
+                                             unsigned int serial)
+{
+     FusionCallExecution *execution;
+
+     if (!serial) {
+          direct_list_foreach (execution, call->executions) {
+               if (!execution->executed)
+                    return execution;
+          }
+
+          return NULL;
+     }
+
+     execution = lookup_serial( call, serial );
+     if (execution && execution->executed)
+          return NULL;
+
+     return execution;
+}
+
+/*
+ * Hands an asynchronous execution that has been returned to the caller, which collects
+ * the result via fusion_call_ring_enter(), or frees it if the caller is gone.
+ */
+static void complete_async(FusionDev * dev, FusionCall * call,
+                           FusionCallExecution * execution)
+{
+     remove_execution( call, execution );
+
+     if (execution->caller)
+          fusion_core_wq_wake( fusion_core, &execution->caller->wait_call );
+     else
+          free_execution( dev, execution );
+}
+
+/*
+ * Ends an execution that could not be returned. Asynchronous ones are completed with the error,
+ * they are still linked to their caller and hold a ring slot until collected.
+ */
+static void fail_execution(FusionDev * dev, FusionCall * call,
+                           FusionCallExecution * execution, int error)
+{
+     if (execution->async) {
+          execution->error    = error;
+          execution->executed = true;
+
+          complete_async( dev, call, execution );
+          return;
      }
+
+     /* Remove and free execution. */
+     remove_execution( call, execution );
+     free_execution( dev, execution );
 }
 
 void
@@ -49,10 +49,29 @@ int fusion_call_set_quota(FusionDev * dev, FusionCallSetQuota *set_quota);
 
 int fusion_call_destroy(FusionDev * dev, Fusionee *fusionee, int call_id);
 
+int fusion_call_ring_enter(FusionDev * dev, Fusionee *fusionee, FusionCallRingEnter * enter);
+
+int fusion_call_wait_async(FusionDev * dev, Fusionee *fusionee, FusionCallWait * wait);
+
+int fusion_call_arena_alloc(FusionDev * dev, Fusionee *fusionee, FusionCallArenaAlloc * alloc);
+
+int fusion_call_arena_free(FusionDev * dev, Fusionee *fusionee, unsigned int offset);
+
+int fusion_call_add_worker(FusionDev * dev, Fusionee *fusionee, FusionCallAddWorker * add_worker);
+
+int fusion_call_remove_worker(FusionDev * dev, Fusionee *fusionee, int call_id);
+
 /* internal functions */
 
 void fusion_call_destroy_all(FusionDev * dev, Fusionee *fusionee);
 
+int fusion_call_ring_mmap(FusionDev * dev, Fusionee *fusionee, struct vm_area_struct *vma);
+
+int fusion_call_arena_mmap(FusionDev * dev, Fusionee *fusionee, struct vm_area_struct *vma);
+
+
+/* frees up to 'nr' pooled executions, returns the number freed */
+int fusion_call_shrink(FusionDev * dev, int nr);
 
 void fusion_call_quota_message_callback(FusionDev * dev, int id, void *ctx, int arg);
 
@@ -33,17 +33,88 @@
 #include "fusiondev.h"
 #include "fusionee.h"
 #include "entries.h"
-#include "hash.h"
+#include "cache.h"
 
 
 static FusionEntryClass *entry_classes[NUM_MINORS][NUM_CLASSES];
 
-void
+static inline FusionEntry **
+hash_bucket( FusionEntries *entries, int id )
+{
+     return &entries->hash[id & (FUSION_ENTRIES_HASH_SIZE - 1)];
+}
+
+static void
+hash_insert( FusionEntries *entries, FusionEntry *entry )
+{
+     FusionEntry **bucket = hash_bucket( entries, entry->id );
+
+     entry->hash_next = *bucket;
+
+     /* Publish the initialized entry to lockless readers. */
+     rcu_assign_pointer( *bucket, entry );
+}
+
+static void
+hash_remove( FusionEntries *entries, FusionEntry *entry )
+{
+     FusionEntry **next = hash_bucket( entries, entry->id );
+
+     while (*next != entry)
+          next = &(*next)->hash_next;
+
+     /* Readers still looking at the entry continue with its successor. */
+     rcu_assign_pointer( *next, entry->hash_next );
+}
+
+static FusionEntry *
+hash_lookup( FusionEntries *entries, int id )
+{
+     FusionEntry *entry;
+
+     /* Raw, because this is used with the world being locked, too. */
+     entry = rcu_dereference_raw( *hash_bucket( entries, id ) );
+
+     while (entry && entry->id != id)
+          entry = rcu_dereference_raw( entry->hash_next );
+
+     return entry;
+}
+
+static void
+fusion_entry_free( struct rcu_head *head )
+{
+     FusionEntry                *entry = container_of( head, FusionEntry, rcu );
+     FusionEntryPermissionsItem *item, *next;
+
+     direct_list_foreach_safe (item, next, entry->permissions)
+          fusion_core_free( fusion_core, item );
+
+     if (entry->waiters_list)
+          fusion_core_free( fusion_core, entry->waiters_list );
+
+     fusion_core_lock_deinit( fusion_core, &entry->lock );
+
+     fusion_core_cache_free( fusion_core, entry->cache, entry );
+}
+
+static void
+fusion_entry_put( FusionEntry *entry )
+{
+     if (!atomic_dec_and_test( &entry->refs ))
+          return;
+
+     /* Lockless readers may still be looking at the entry. */
+     call_rcu( &entry->rcu, fusion_entry_free );
+}
+
+int
 fusion_entries_init( FusionEntries    *entries,
                      FusionEntryClass *class,
                      void             *ctx,
                      FusionDev        *dev )
 {
+     int ret;
 
      FUSION_DEBUG( "%s( entries %p, class %p, ctx %p, dev %p )\n",
                    __FUNCTION__, entries, class, ctx, dev );
@@ -54,6 +125,10 @@ fusion_entries_init( FusionEntries    *entries,
      FUSION_ASSERT(class != NULL);
      FUSION_ASSERT(class->object_size >= sizeof(FusionEntry));
 
+     ret = fusion_cache_register(class->cache, class->cache_name, class->object_size);
+     if (ret)
+          return ret;
+
      if (!dev->refs) {
           memset(entries, 0, sizeof(FusionEntries));
 
@@ -62,9 +137,19 @@ fusion_entries_init( FusionEntries    *entries,
           entries->dev = dev;
      }
 
+     fusion_core_lock( fusion_core );
+
      entry_classes[dev->index][entries->class_index] = class;
 
-     fusion_hash_create( FHT_INT, FHT_PTR, 17, &entries->hash );
+     fusion_core_unlock( fusion_core );
+
+     entries->hash = fusion_core_malloc( fusion_core, sizeof(FusionEntry*) * FUSION_ENTRIES_HASH_SIZE );
+     if (!entries->hash)
+          return -ENOMEM;
+
+     memset( entries->hash, 0, sizeof(FusionEntry*) * FUSION_ENTRIES_HASH_SIZE );
+
+     return 0;
 }
 
 void fusion_entries_deinit(FusionEntries * entries)
@@ -82,11 +167,11 @@ void fusion_entries_deinit(FusionEntries * entries)
                if (class->Destroy)
                     class->Destroy(entry, entries->ctx);
 
-               fusion_core_free( fusion_core, entry);
+               fusion_entry_put( entry );
           }
      }
 
-     fusion_hash_destroy( entries->hash );
+     fusion_core_free( fusion_core, entries->hash );
 }
 
 /* reading PROC entries */
@@ -101,7 +186,8 @@ static void *fusion_entries_seq_start(struct seq_file *f, loff_t * pos)
 
      entries = f->private;
 
-     fusion_core_lock( fusion_core );
+     /* Released in fusion_entries_seq_stop(), which is called even if we return NULL. */
+     fusion_dev_lock( entries->dev );
 
      if (!entries->dev->shutdown) {
           entry = (void *)(entries->list);
@@ -113,18 +199,14 @@ static void *fusion_entries_seq_start(struct seq_file *f, loff_t * pos)
           FUSION_ASSERT(entries != NULL);
 
           class = entry_classes[entries->dev->index][entries->class_index];
-          if (!class->Print) {
-               fusion_core_unlock( fusion_core );
+          if (!class->Print)
                return NULL;
-          }
 
           do_gettimeofday(&entries->now);
 
           return entry;
      }
 
-     fusion_core_unlock( fusion_core );
-
      return NULL;
 }
 
@@ -143,7 +225,7 @@ static void fusion_entries_seq_stop(struct seq_file *f, void *v)
      entries = f->private;
      (void)v;
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( entries->dev );
 }
 
 int fusion_entries_show(struct seq_file *p, void *v)
@@ -223,11 +305,11 @@ void fusion_entries_create_proc_entry(FusionDev * dev, const char *name,
 
 void fusion_entries_destroy_proc_entry(FusionDev * dev, const char *name)
 {
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      remove_proc_entry(name, fusion_proc_dir[dev->index]);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 }
 
 int fusion_entry_create(FusionEntries * entries, int *ret_id, void *create_ctx, FusionID fusion_id)
@@ -241,30 +323,33 @@ int fusion_entry_create(FusionEntries * entries, int *ret_id, void *create_ctx,
 
      class = entry_classes[entries->dev->index][entries->class_index];
 
-     entry = fusion_core_malloc( fusion_core, class->object_size );
+     entry = fusion_core_cache_alloc( fusion_core, *class->cache );
      if (!entry)
           return -ENOMEM;
 
-     memset(entry, 0, class->object_size);
-
      entry->entries = entries;
+     entry->cache   = *class->cache;
      entry->id = ++entries->ids;
      entry->pid = fusion_core_pid( fusion_core );
      entry->creator = fusion_id;
 
+     atomic_set( &entry->refs, 1 );
+
+     fusion_core_lock_init( fusion_core, &entry->lock );
+
      fusion_core_wq_init( fusion_core, &entry->wait);
 
      if (class->Init) {
           ret = class->Init(entry, entries->ctx, create_ctx);
           if (ret) {
-               fusion_core_free( fusion_core, entry);
+               fusion_entry_put( entry );
                return ret;
           }
      }
 
      fusion_list_prepend(&entries->list, &entry->link);
 
-     fusion_hash_insert( entries->hash, (void*)(long) entry->id, entry );
+     hash_insert( entries, entry );
 
      *ret_id = entry->id;
 
@@ -281,7 +366,7 @@ int fusion_entry_destroy(FusionEntries * entries, int id)
      class = entry_classes[entries->dev->index][entries->class_index];
 
      /* Lookup the entry. */
-     entry = fusion_hash_lookup( entries->hash, (void*)(long) id );
+     entry = hash_lookup( entries, id );
      if (!entry)
           return -EINVAL;
 
@@ -294,19 +379,15 @@ int fusion_entry_destroy(FusionEntries * entries, int id)
 void fusion_entry_destroy_locked(FusionEntries * entries, FusionEntry * entry)
 {
      FusionEntryClass *class;
-     FusionEntryPermissionsItem *item, *next;
 
      FUSION_ASSERT(entries != NULL);
 
      class = entry_classes[entries->dev->index][entries->class_index];
 
-     direct_list_foreach_safe (item, next, entry->permissions)
-          fusion_core_free( fusion_core, item );
-
      /* Remove the entry from the list. */
      fusion_list_remove(&entries->list, &entry->link);
 
-     fusion_hash_remove( entries->hash, (void*)(long) entry->id, NULL, NULL );
+     hash_remove( entries, entry );
 
      /* Wake up any waiting process. */
      fusion_core_wq_wake( fusion_core, &entry->wait);
@@ -315,11 +396,8 @@ void fusion_entry_destroy_locked(FusionEntries * entries, FusionEntry * entry)
      if (class->Destroy)
           class->Destroy(entry, entries->ctx);
 
-     /* Deallocate the entry. */
-     if (entry->waiters_list)
-          fusion_core_free( fusion_core, entry->waiters_list );
-
-     fusion_core_free( fusion_core, entry );
+     /* Deallocate the entry unless there are still waiters to wake up. */
+     fusion_entry_put( entry );
 }
 
 int fusion_entry_set_info(FusionEntries * entries, const FusionEntryInfo * info)
@@ -336,23 +414,30 @@ int fusion_entry_set_info(FusionEntries * entries, const FusionEntryInfo * info)
 
      snprintf(entry->name, FUSION_ENTRY_INFO_NAME_LENGTH, "%s", info->name);
 
+     fusion_entry_unlock(entry);
+
      return 0;
 }
 
 int fusion_entry_get_info(FusionEntries * entries, FusionEntryInfo * info)
 {
-     int ret;
      FusionEntry *entry;
 
      FUSION_ASSERT(entries != NULL);
      FUSION_ASSERT(info != NULL);
 
-     ret = fusion_entry_lookup(entries, info->id, &entry);
-     if (ret)
-          return ret;
+     rcu_read_lock();
+
+     entry = fusion_entry_lookup_rcu(entries, info->id);
+     if (!entry) {
+          rcu_read_unlock();
+          return -EINVAL;
+     }
 
      snprintf(info->name, FUSION_ENTRY_INFO_NAME_LENGTH, "%s", entry->name);
 
+     rcu_read_unlock();
+
      return 0;
 }
 
@@ -372,26 +457,36 @@ fusion_entry_add_permissions( FusionEntries                *entries,
      if (ret)
           return ret;
 
-     if (fusionee_id( fusionee ) != FUSION_ID_MASTER && fusionee_id( fusionee ) != entry->creator)
-          return -EPERM;
+     if (fusionee_id( fusionee ) != FUSION_ID_MASTER && fusionee_id( fusionee ) != entry->creator) {
+          ret = -EPERM;
+          goto out;
+     }
 
      direct_list_foreach (item, entry->permissions) {
           if (item->fusion_id == permissions->fusion_id) {
                item->permissions |= permissions->permissions;
-               return 0;
+               goto out;
           }
      }
 
      item = fusion_core_malloc( fusion_core, sizeof(FusionEntryPermissionsItem) );
-     if (!item)
-          return -ENOMEM;
+     if (!item) {
+          ret = -ENOMEM;
+          goto out;
+     }
 
      item->fusion_id   = permissions->fusion_id;
      item->permissions = permissions->permissions;
 
+     /* Lockless readers in fusion_entry_check_permissions() must see the item initialized. */
+     smp_wmb();
+
      direct_list_append( &entry->permissions, &item->link );
 
-     return 0;
+out:
+     fusion_entry_unlock( entry );
+
+     return ret;
 }
 
 int
@@ -400,27 +495,36 @@ fusion_entry_check_permissions( FusionEntries *entries,
                                 FusionID       fusion_id,
                                 unsigned int   nr )
 {
-     int                         ret;
+     int                         ret = 0;
      FusionEntry                *entry;
      FusionEntryPermissionsItem *item;
 
      FUSION_ASSERT( entries != NULL );
 
-     ret = fusion_entry_lookup( entries, entry_id, &entry );
-     if (ret)
-          return ret;
+     rcu_read_lock();
 
-     if (entry->creator == fusion_id)
-          return 0;
+     entry = fusion_entry_lookup_rcu( entries, entry_id );
+     if (!entry) {
+          rcu_read_unlock();
+          return -EINVAL;
+     }
 
-     direct_list_foreach (item, entry->permissions) {
-          if (!item->fusion_id || item->fusion_id == fusion_id) {
-               if (item->permissions & (1 << nr))
-                    return 0;
+     if (entry->creator != fusion_id) {
+          ret = -EPERM;
+
+          direct_list_foreach (item, entry->permissions) {
+               if (!item->fusion_id || item->fusion_id == fusion_id) {
+                    if (item->permissions & (1 << nr)) {
+                         ret = 0;
+                         break;
+                    }
+               }
           }
      }
 
-     return -EPERM;
+     rcu_read_unlock();
+
+     return ret;
 }
 
 
@@ -437,10 +541,14 @@ fusion_entry_lookup(FusionEntries * entries,
      FUSION_ASSERT(ret_entry != NULL);
 
      /* Lookup the entry. */
-     entry = fusion_hash_lookup( entries->hash, (void*)(long) id );
+     entry = hash_lookup( entries, id );
      if (!entry)
           return -EINVAL;
 
+     /* With the world being locked shared, lock the entry itself. */
+     if (!fusion_dev_exclusive( entries->dev ))
+          fusion_core_lock_acquire( fusion_core, &entry->lock );
+
      /* Move the entry to the front of all entries. */
 //     fusion_list_move_to_front(&entries->list, &entry->link);
 
@@ -462,27 +570,47 @@ fusion_entry_lookup(FusionEntries * entries,
      return 0;
 }
 
+FusionEntry *
+fusion_entry_lookup_rcu( FusionEntries *entries, int id )
+{
+     FUSION_ASSERT(entries != NULL);
+
+     return hash_lookup( entries, id );
+}
+
+void
+fusion_entry_unlock( FusionEntry *entry )
+{
+     FUSION_ASSERT(entry != NULL);
+
+     if (!fusion_dev_exclusive( entry->entries->dev ))
+          fusion_core_lock_release( fusion_core, &entry->lock );
+}
+
 int fusion_entry_wait(FusionEntry * entry, int *timeout)
 {
-     int ret;
+     int ret = 0;
      int id;
      int i;
      FusionEntries *entries;
-     FusionEntry *entry2;
+     FusionDev *dev;
 
      FUSION_ASSERT(entry != NULL);
      FUSION_ASSERT(entry->entries != NULL);
 
      id = entry->id;
      entries = entry->entries;
+     dev = entries->dev;
 
 
      /* Reallocate waiters array if needed */
      if (entry->waiters_list_max == entry->waiters) {
           int *new_waiters = fusion_core_malloc( fusion_core, sizeof(int) * (entry->waiters_list_max + 10) );
 
-          if (!new_waiters)
+          if (!new_waiters) {
+               fusion_entry_unlock( entry );
                return -ENOMEM;
+          }
 
           entry->waiters_list_max += 10;
 
@@ -499,7 +627,13 @@ int fusion_entry_wait(FusionEntry * entry, int *timeout)
 
      entry->waiters++;
 
-     fusion_core_wq_wait( fusion_core, &entry->wait, timeout, true );
+     /* Keep the entry while waiting, it may get destroyed meanwhile. */
+     atomic_inc( &entry->refs );
+
+     if (fusion_dev_exclusive( dev ))
+          fusion_core_wq_wait( fusion_core, &entry->wait, &dev->lock, timeout, true );
+     else
+          fusion_core_wq_wait_nested( fusion_core, &entry->wait, &dev->lock, &entry->lock, timeout, true );
 
      for (i=0; i<entry->waiters-1; i++) {
           if (entry->waiters_list[i] == fusion_core_pid( fusion_core ))
@@ -513,20 +647,16 @@ int fusion_entry_wait(FusionEntry * entry, int *timeout)
 
 
      if (signal_pending(current))
-          return -EINTR;
+          ret = -EINTR;
+     else if (timeout && !*timeout)
+          ret = -ETIMEDOUT;
+     else if (hash_lookup( entries, id ) != entry)
+          ret = -EIDRM;
 
-     if (timeout && !*timeout)
-          return -ETIMEDOUT;
-
-     ret = fusion_entry_lookup(entries, id, &entry2);
-     switch (ret) {
-          case -EINVAL:
-               return -EIDRM;
+     if (ret)
+          fusion_entry_unlock( entry );
 
-          case 0:
-               if (entry != entry2)
-                    BUG();
-     }
+     fusion_entry_put( entry );
 
      return ret;
 }
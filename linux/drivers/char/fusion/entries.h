@@ -16,6 +16,7 @@
 #define __FUSION__ENTRIES_H__
 
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/seq_file.h>
 
 #include "types.h"
@@ -26,9 +27,15 @@
 
 typedef struct __FD_FusionEntry FusionEntry;
 
+/* Entry ids are sequential, so a power of two spreads them evenly. */
+#define FUSION_ENTRIES_HASH_SIZE  256
+
 typedef const struct {
      int object_size;
 
+     const char   *cache_name;  /* name of the object cache */
+     FusionCache **cache;       /* object cache, shared by all worlds */
+
      int (*Init)     (FusionEntry * entry, void *ctx, void *create_ctx);
      void (*Destroy) (FusionEntry * entry, void *ctx);
      void (*Print)   (FusionEntry * entry, void *ctx, struct seq_file * p);
@@ -45,7 +52,7 @@ typedef struct {
 
      struct timeval now; /* temporary for /proc code (seq start/show) */
 
-     FusionHash *hash;
+     FusionEntry **hash;      /* buckets chained via hash_next, readable under RCU */
 } FusionEntries;
 
 typedef struct {
@@ -58,11 +65,18 @@ typedef struct {
 struct __FD_FusionEntry {
      FusionLink link;
 
+     FusionEntry    *hash_next;
+     struct rcu_head rcu;
+
      FusionEntries *entries;
+     FusionCache   *cache;
 
      int id;
      pid_t pid;
 
+     FusionLock lock;    /* only used if the world is locked shared */
+     atomic_t   refs;    /* one for the table plus one per waiter */
+
      FusionWaitQueue wait;
      int waiters;
      int *waiters_list;
@@ -79,7 +93,7 @@ struct __FD_FusionEntry {
 
 /* Entries Init & DeInit */
 
-void fusion_entries_init( FusionEntries    *entries,
+int  fusion_entries_init( FusionEntries    *entries,
                           FusionEntryClass *class,
                           void             *ctx,
                           FusionDev        *dev );
@@ -121,8 +135,24 @@ int fusion_entry_check_permissions( FusionEntries                *entries,
 
 /* Lookup */
 
+/*
+ * Lookup the entry by id.
+ *
+ * If the world is only locked shared, the entry is returned locked
+ * and has to be unlocked via fusion_entry_unlock().
+ */
 int fusion_entry_lookup(FusionEntries * entries, int id, FusionEntry ** ret_entry);
 
+void fusion_entry_unlock(FusionEntry * entry);
+
+/*
+ * Lookup the entry without any locking.
+ *
+ * The caller has to be in an RCU read side critical section and may only read from the entry.
+ * Entries (including their permissions) are freed after a grace period.
+ */
+FusionEntry *fusion_entry_lookup_rcu(FusionEntries * entries, int id);
+
 /** Wait & Notify **/
 
 /*
@@ -150,8 +180,12 @@ void fusion_entry_notify(FusionEntry * entry);
 
 #define FUSION_ENTRY_CLASS( Type, name, init_func, destroy_func, print_func )   \
                                                                                 \
+     static FusionCache *name##_cache;                                          \
+                                                                                \
      static FusionEntryClass name##_class = {                                   \
           .object_size = sizeof(Type),                                          \
+          .cache_name  = "fusion_" #name,                                       \
+          .cache       = &name##_cache,                                         \
           .Init        = init_func,                                             \
           .Destroy     = destroy_func,                                          \
           .Print       = print_func                                             \
@@ -172,6 +206,17 @@ void fusion_entry_notify(FusionEntry * entry);
           return ret;                                                           \
      }                                                                          \
                                                                                 \
+     static inline Type *fusion_##name##_lookup_rcu( FusionEntries *entries,    \
+                                                     int            id )        \
+     {                                                                          \
+          return (Type *) fusion_entry_lookup_rcu( entries, id );               \
+     }                                                                          \
+                                                                                \
+     static inline void fusion_##name##_unlock( Type *name )                    \
+     {                                                                          \
+          fusion_entry_unlock( (FusionEntry*) name );                           \
+     }                                                                          \
+                                                                                \
      static inline int fusion_##name##_wait( Type *name, int *timeout )         \
      {                                                                          \
           return fusion_entry_wait( (FusionEntry*) name, timeout );             \
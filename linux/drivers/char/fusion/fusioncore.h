@@ -27,6 +27,8 @@ typedef enum {
 
 typedef struct __Fusion_FusionCore FusionCore;
 
+struct task_struct;
+
 
 FusionCoreResult  fusion_core_enter    ( int              cpu_index,
                                          FusionCore     **ret_core );
@@ -50,23 +52,126 @@ void             *fusion_core_get_pointer( FusionCore      *core,
                                            unsigned int     index );
 
 
+/*
+ * Caches for objects of a fixed size, allocated zeroed like fusion_core_malloc().
+ */
+FusionCoreResult  fusion_core_cache_create ( FusionCore      *core,
+                                             const char      *name,
+                                             size_t           size,
+                                             FusionCache    **ret_cache );
+
+void              fusion_core_cache_destroy( FusionCore      *core,
+                                             FusionCache     *cache );
+
+void             *fusion_core_cache_alloc  ( FusionCore      *core,
+                                             FusionCache     *cache );
+
+void              fusion_core_cache_free   ( FusionCore      *core,
+                                             FusionCache     *cache,
+                                             void            *ptr );
+
+
+/*
+ * The core lock only protects state that is shared between all worlds,
+ * each world (FusionDev) is protected by its own FusionLock.
+ */
 void              fusion_core_lock     ( FusionCore      *core );
 void              fusion_core_unlock   ( FusionCore      *core );
 
 
+FusionCoreResult  fusion_core_lock_init   ( FusionCore      *core,
+                                            FusionLock      *lock );
+
+void              fusion_core_lock_deinit ( FusionCore      *core,
+                                            FusionLock      *lock );
+
+void              fusion_core_lock_acquire( FusionCore      *core,
+                                            FusionLock      *lock );
+
+/*
+ * Acquires the lock exclusively if that's possible without waiting.
+ */
+bool              fusion_core_lock_tryacquire( FusionCore      *core,
+                                               FusionLock      *lock );
+
+/*
+ * Shared holders may run concurrently, but never together with an exclusive holder.
+ */
+void              fusion_core_lock_acquire_shared( FusionCore      *core,
+                                                   FusionLock      *lock );
+
+/*
+ * Releases the lock in the mode it has been acquired.
+ */
+void              fusion_core_lock_release( FusionCore      *core,
+                                            FusionLock      *lock );
+
+/*
+ * Returns true if the calling task holds the lock exclusively.
+ */
+bool              fusion_core_lock_exclusive( FusionCore      *core,
+                                              FusionLock      *lock );
+
+
 FusionCoreResult  fusion_core_wq_init  ( FusionCore      *core,
                                          FusionWaitQueue *queue );
 
 void              fusion_core_wq_deinit( FusionCore      *core,
                                          FusionWaitQueue *queue );
 
+/*
+ * Releases the lock while waiting and acquires it again (in the same mode) before returning.
+ */
 void              fusion_core_wq_wait  ( FusionCore      *core,
                                          FusionWaitQueue *queue,
+                                         FusionLock      *lock,
                                          int             *timeout_ms,
                                          bool             interruptible );
 
+/*
+ * Same as fusion_core_wq_wait(), but releases two locks, acquiring the outer one first again.
+ */
+void              fusion_core_wq_wait_nested( FusionCore      *core,
+                                              FusionWaitQueue *queue,
+                                              FusionLock      *outer,
+                                              FusionLock      *inner,
+                                              int             *timeout_ms,
+                                              bool             interruptible );
+
+/*
+ * Same as fusion_core_wq_wait(), but fusion_core_wq_wake_one() wakes up only one of the exclusive waiters.
+ */
+void              fusion_core_wq_wait_exclusive( FusionCore      *core,
+                                                 FusionWaitQueue *queue,
+                                                 FusionLock      *lock,
+                                                 int             *timeout_ms,
+                                                 bool             interruptible );
+
+/*
+ * Same as fusion_core_wq_wait(), but yields to the task after releasing the lock,
+ * e.g. to the one that is going to wake up the caller.
+ */
+void              fusion_core_wq_wait_handoff( FusionCore         *core,
+                                               FusionWaitQueue    *queue,
+                                               FusionLock         *lock,
+                                               struct task_struct *task,
+                                               bool                interruptible );
+
 void              fusion_core_wq_wake  ( FusionCore      *core,
                                          FusionWaitQueue *queue );
 
+/*
+ * Wakes up all waiters except for the exclusive ones, of which only the first is woken up.
+ */
+void              fusion_core_wq_wake_one( FusionCore      *core,
+                                           FusionWaitQueue *queue );
+
+/*
+ * Same as fusion_core_wq_wake(), but hints that the caller is going to sleep soon,
+ * so the woken up tasks may run on the current CPU instead of migrating.
+ */
+void              fusion_core_wq_wake_sync( FusionCore      *core,
+                                            FusionWaitQueue *queue );
+
 
 #endif
@@ -43,6 +43,7 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/init.h>
 #include <asm/io.h>
@@ -54,6 +55,7 @@
 
 #include <linux/fusion.h>
 
+#include "cache.h"
 #include "call.h"
 #include "fusiondev.h"
 #include "fusionee.h"
@@ -62,6 +64,7 @@
 #include "ref.h"
 #include "skirmish.h"
 #include "shmpool.h"
+#include "slots.h"
 
 #ifndef FUSION_MAJOR
 #define FUSION_MAJOR 250
@@ -79,6 +82,21 @@ MODULE_PARM_DESC( fusion_shm_base, "Shared memory address space base" );
 module_param( fusion_shm_size, ulong, 0 );
 MODULE_PARM_DESC( fusion_shm_size, "Shared memory address space size" );
 
+int fusion_entry_locking = 0;
+
+module_param( fusion_entry_locking, int, 0 );
+MODULE_PARM_DESC( fusion_entry_locking, "Lock skirmishs, properties and refs individually" );
+
+unsigned int fusion_busy_poll_max = 50;
+
+module_param( fusion_busy_poll_max, uint, 0 );
+MODULE_PARM_DESC( fusion_busy_poll_max, "Maximum busy poll time of a blocking read in microseconds (0 disables)" );
+
+unsigned int fusion_call_arena_size = 0x400000;
+
+module_param( fusion_call_arena_size, uint, 0 );
+MODULE_PARM_DESC( fusion_call_arena_size, "Size of the call arena of each world (0 disables)" );
+
 
 
 struct proc_dir_entry *proc_fusion_dir;
@@ -107,11 +125,11 @@ static struct class_simple *fusion_class;
 ({                                      \
      int ret;                           \
                                         \
-     /*fusion_core_unlock( fusion_core );*/ \
+     /*fusion_dev_unlock( dev );*/   \
                                         \
      ret = copy_from_user( a, b, c );   \
                                         \
-     /*fusion_core_lock( fusion_core );*/   \
+     /*fusion_dev_lock( dev );*/     \
                                         \
      ret;                               \
 })
@@ -121,11 +139,11 @@ static struct class_simple *fusion_class;
 ({                                      \
      int ret;                           \
                                         \
-     /*fusion_core_unlock( fusion_core );*/ \
+     /*fusion_dev_unlock( dev );*/   \
                                         \
      ret = copy_to_user( a, b, c );     \
                                         \
-     /*fusion_core_lock( fusion_core );*/   \
+     /*fusion_dev_lock( dev );*/     \
                                         \
      ret;                               \
 })
@@ -144,7 +162,7 @@ fusiondev_stat_proc_show(struct seq_file *m, void *v)
 {
      FusionDev *dev = m->private;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->shutdown) {
           if ((dev->api.major != 0) || (dev->api.minor != 0))
@@ -156,18 +174,18 @@ fusiondev_stat_proc_show(struct seq_file *m, void *v)
 
           seq_printf(m,
                                    "%10d %10d  %10d %10d %10d  %10d %10d  %10d %10d\n",
-                                   dev->stat.property_lease_purchase,
-                                   dev->stat.property_cede,
-                                   dev->stat.reactor_attach,
-                                   dev->stat.reactor_detach,
-                                   dev->stat.reactor_dispatch,
-                                   dev->stat.ref_up,
-                                   dev->stat.ref_down,
-                                   dev->stat.skirmish_prevail_swoop,
-                                   dev->stat.skirmish_dismiss);
+                                   atomic_read( &dev->stat.property_lease_purchase ),
+                                   atomic_read( &dev->stat.property_cede ),
+                                   atomic_read( &dev->stat.reactor_attach ),
+                                   atomic_read( &dev->stat.reactor_detach ),
+                                   atomic_read( &dev->stat.reactor_dispatch ),
+                                   atomic_read( &dev->stat.ref_up ),
+                                   atomic_read( &dev->stat.ref_down ),
+                                   atomic_read( &dev->stat.skirmish_prevail_swoop ),
+                                   atomic_read( &dev->stat.skirmish_dismiss ));
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return 0;
 }
@@ -260,11 +278,11 @@ error_fusionee:
 
 static void fusiondev_deinit(FusionDev * dev)
 {
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      remove_proc_entry("stat", fusion_proc_dir[dev->index]);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      fusion_call_deinit(dev);
      fusion_shmpool_deinit(dev);
@@ -282,6 +300,9 @@ static void fusiondev_deinit(FusionDev * dev)
           free_page(dev->shared_area);
 #endif
      }
+
+     if (!dev->refs)
+          fusion_slots_deinit(dev);
 }
 
 /******************************************************************************/
@@ -298,19 +319,20 @@ static int fusion_open(struct inode *inode, struct file *file)
 
      snprintf(buf, 4, "%d", minor);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      FUSION_DEBUG("  -> refs: %d\n", dev->refs);
 
      if (!dev->refs) {
-          memset( dev, 0, sizeof(FusionDev) );
+          /* Reset everything but the lock we're holding. */
+          memset( dev, 0, offsetof(FusionDev, lock) );
 
           dev->index = minor;
      }
      else {
           if (file->f_flags & O_EXCL) {
                if (dev->fusionee.last_id) {
-                    fusion_core_unlock( fusion_core );
+                    fusion_dev_unlock( dev );
                     return -EBUSY;
                }
           }
@@ -323,7 +345,7 @@ static int fusion_open(struct inode *inode, struct file *file)
           ret = fusiondev_init( dev );
           if (ret) {
                remove_proc_entry(buf, proc_fusion_dir);
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return ret;
           }
      }
@@ -333,11 +355,11 @@ static int fusion_open(struct inode *inode, struct file *file)
           if (!fusion_local_refs[dev->index]) {
                fusiondev_deinit( dev );
 
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                remove_proc_entry( buf, proc_fusion_dir );
           }
           else
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
 
           return ret;
      }
@@ -346,7 +368,7 @@ static int fusion_open(struct inode *inode, struct file *file)
 
      dev->refs++;
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
 	file->f_mode &= ~(FMODE_LSEEK | FMODE_PREAD | FMODE_PWRITE);
 
@@ -367,7 +389,7 @@ static int fusion_release(struct inode *inode, struct file *file)
 
      snprintf(buf, 4, "%d", minor);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      fusionee_destroy( dev, fusionee );
 
@@ -380,16 +402,16 @@ static int fusion_release(struct inode *inode, struct file *file)
 
           fusiondev_deinit( dev );
 
-          fusion_core_unlock( fusion_core );
+          fusion_dev_unlock( dev );
 
           remove_proc_entry( buf, proc_fusion_dir );
 
-          fusion_core_lock( fusion_core );
+          fusion_dev_lock( dev );
 
           dev->shutdown = 0;
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return 0;
 }
@@ -410,11 +432,11 @@ fusion_flush(struct file *file)
                   atomic_long_read(&file->f_count), fusionee_id(fusionee), fusion_core_pid( fusion_core ));
 
      if (current->flags & PF_EXITING) {
-          fusion_core_lock( fusion_core );
+          fusion_dev_lock( dev );
 
           fusion_skirmish_dismiss_all_from_pid(dev, fusion_core_pid( fusion_core ));
 
-          fusion_core_unlock( fusion_core );
+          fusion_dev_unlock( dev );
      }
 
      return 0;
@@ -430,11 +452,11 @@ fusion_read(struct file *file, char *buf, size_t count, loff_t * ppos)
      FUSION_DEBUG("fusion_read( %p, %ld, %zu )\n", file, atomic_long_read(&file->f_count),
                   count);
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      ret = fusionee_get_messages(dev, fusionee, buf, count, !(file->f_flags & O_NONBLOCK));
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
 
      if (ret > 0)
@@ -451,15 +473,17 @@ static unsigned int fusion_poll(struct file *file, poll_table * wait)
 
      FUSION_DEBUG("fusion_poll( %p, %ld )\n", file, atomic_long_read(&file->f_count));
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      ret = fusionee_poll(dev, fusionee, file, wait);
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
 
+static int ioctl_batch( FusionDev *dev, Fusionee *fusionee, FusionBatch *batch_bin );
+
 static int
 lounge_ioctl(FusionDev * dev, Fusionee * fusionee,
              unsigned int cmd, unsigned long arg)
@@ -470,6 +494,7 @@ lounge_ioctl(FusionDev * dev, Fusionee * fusionee,
      FusionEntryInfo info;
      FusionFork fork = { 0};
      FusionEntryPermissions permissions;
+     unsigned int busy_poll;
 
      switch (_IOC_NR(cmd)) {
           case _IOC_NR(FUSION_ENTER):
@@ -652,6 +677,17 @@ lounge_ioctl(FusionDev * dev, Fusionee * fusionee,
 
                return 0;
           }
+
+          case _IOC_NR(FUSION_BATCH):
+               return ioctl_batch( dev, fusionee, (FusionBatch *) arg );
+
+          case _IOC_NR(FUSION_SET_BUSY_POLL):
+               if (get_user(busy_poll, (unsigned int *) arg))
+                    return -EFAULT;
+
+               fusionee->busy_poll = busy_poll;
+
+               return 0;
      }
 
      return -ENOSYS;
@@ -672,8 +708,7 @@ messaging_ioctl(FusionDev * dev, Fusionee * fusionee,
                if (send.msg_size <= 0)
                     return -EINVAL;
 
-               /* message data > 64k should be stored in shared memory */
-               if (send.msg_size > 0x10000)
+               if (send.msg_size > FUSION_MESSAGE_SIZE_MAX)
                     return -EMSGSIZE;
 
                return fusionee_send_message(dev, fusionee, send.fusion_id,
@@ -700,6 +735,11 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
      FusionCallReturn3   call_ret3;
      FusionCallGetOwner  get_owner;
      FusionCallSetQuota  set_quota;
+     FusionCallAddWorker add_worker;
+     FusionCallRingEnter ring_enter;
+     FusionCallWait      call_wait;
+     FusionCallArenaAlloc arena_alloc;
+     unsigned int        offset;
      FusionID            fusion_id = fusionee_id(fusionee);
 
      switch (_IOC_NR(cmd)) {
@@ -749,6 +789,19 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
 
                return fusion_call_destroy(dev, fusionee, id);
 
+          case _IOC_NR(FUSION_CALL_ADD_WORKER):
+               if (unlocked_copy_from_user
+                   (&add_worker, (FusionCallAddWorker *) arg, sizeof(add_worker)))
+                    return -EFAULT;
+
+               return fusion_call_add_worker(dev, fusionee, &add_worker);
+
+          case _IOC_NR(FUSION_CALL_REMOVE_WORKER):
+               if (get_user(id, (int *)arg))
+                    return -EFAULT;
+
+               return fusion_call_remove_worker(dev, fusionee, id);
+
           case _IOC_NR(FUSION_CALL_EXECUTE2):
                if (unlocked_copy_from_user
                    (&execute2, (FusionCallExecute2 *) arg, sizeof(execute2)))
@@ -840,6 +893,50 @@ call_ioctl(FusionDev * dev, Fusionee * fusionee,
                if (ret)
                     return ret;
                return 0;
+
+          case _IOC_NR(FUSION_CALL_RING_ENTER):
+               if (unlocked_copy_from_user(&ring_enter, (FusionCallRingEnter *) arg, sizeof(ring_enter)))
+                    return -EFAULT;
+
+               ret = fusion_call_ring_enter(dev, fusionee, &ring_enter);
+
+               /* Also when interrupted, submissions may have been sent. */
+               if (unlocked_copy_to_user((FusionCallRingEnter *) arg, &ring_enter, sizeof(ring_enter)))
+                    return -EFAULT;
+
+               return ret;
+
+          case _IOC_NR(FUSION_CALL_WAIT):
+               if (unlocked_copy_from_user(&call_wait, (FusionCallWait *) arg, sizeof(call_wait)))
+                    return -EFAULT;
+
+               ret = fusion_call_wait_async(dev, fusionee, &call_wait);
+               if (ret)
+                    return ret;
+
+               if (unlocked_copy_to_user((FusionCallWait *) arg, &call_wait, sizeof(call_wait)))
+                    return -EFAULT;
+
+               return 0;
+
+          case _IOC_NR(FUSION_CALL_ARENA_ALLOC):
+               if (unlocked_copy_from_user(&arena_alloc, (FusionCallArenaAlloc *) arg, sizeof(arena_alloc)))
+                    return -EFAULT;
+
+               ret = fusion_call_arena_alloc(dev, fusionee, &arena_alloc);
+               if (ret)
+                    return ret;
+
+               if (unlocked_copy_to_user((FusionCallArenaAlloc *) arg, &arena_alloc, sizeof(arena_alloc)))
+                    return -EFAULT;
+
+               return 0;
+
+          case _IOC_NR(FUSION_CALL_ARENA_FREE):
+               if (get_user(offset, (unsigned int *) arg))
+                    return -EFAULT;
+
+               return fusion_call_arena_free(dev, fusionee, offset);
      }
 
      return -ENOSYS;
@@ -855,6 +952,7 @@ ref_ioctl(FusionDev * dev, Fusionee * fusionee,
      FusionRefWatch   watch;
      FusionRefInherit inherit;
      FusionRefThrow   throw_;
+     FusionRefShare   share;
      FusionID         fusion_id = fusionee_id(fusionee);
 
      switch (_IOC_NR(cmd)) {
@@ -942,6 +1040,21 @@ ref_ioctl(FusionDev * dev, Fusionee * fusionee,
 
                return fusion_ref_set_sync(dev, id);
 
+          case _IOC_NR(FUSION_REF_SHARE):
+               if (unlocked_copy_from_user
+                   (&share, (FusionRefShare *) arg, sizeof(share)))
+                    return -EFAULT;
+
+               ret = fusion_ref_share(dev, fusionee, share.id, &share.index);
+               if (ret)
+                    return ret;
+
+               if (unlocked_copy_to_user
+                   ((FusionRefShare *) arg, &share, sizeof(share)))
+                    return -EFAULT;
+
+               return 0;
+
           case _IOC_NR(FUSION_REF_DESTROY):
                if (get_user(id, (int *)arg))
                     return -EFAULT;
@@ -973,6 +1086,7 @@ skirmish_ioctl(FusionDev * dev, Fusionee * fusionee,
      int ret;
      int lock_count;
      FusionSkirmishWait wait;
+     FusionSkirmishShare share;
      FusionID fusion_id = fusionee_id(fusionee);
 
      switch (_IOC_NR(cmd)) {
@@ -1039,6 +1153,21 @@ skirmish_ioctl(FusionDev * dev, Fusionee * fusionee,
                     return -EFAULT;
 
                return fusion_skirmish_notify_(dev, id, fusion_id);
+
+          case _IOC_NR(FUSION_SKIRMISH_SHARE):
+               if (unlocked_copy_from_user
+                   (&share, (FusionSkirmishShare *) arg, sizeof(share)))
+                    return -EFAULT;
+
+               ret = fusion_skirmish_share(dev, share.id, &share.index);
+               if (ret)
+                    return ret;
+
+               if (unlocked_copy_to_user
+                   ((FusionSkirmishShare *) arg, &share, sizeof(share)))
+                    return -EFAULT;
+
+               return 0;
      }
 
      return -ENOSYS;
@@ -1050,6 +1179,7 @@ property_ioctl(FusionDev * dev, Fusionee * fusionee,
 {
      int id;
      int ret;
+     FusionPropertyShare share;
      FusionID fusion_id = fusionee_id(fusionee);
 
      switch (_IOC_NR(cmd)) {
@@ -1093,6 +1223,21 @@ property_ioctl(FusionDev * dev, Fusionee * fusionee,
                     return -EFAULT;
 
                return fusion_property_destroy(dev, id);
+
+          case _IOC_NR(FUSION_PROPERTY_SHARE):
+               if (unlocked_copy_from_user
+                   (&share, (FusionPropertyShare *) arg, sizeof(share)))
+                    return -EFAULT;
+
+               ret = fusion_property_share(dev, share.id, &share.index);
+               if (ret)
+                    return ret;
+
+               if (unlocked_copy_to_user
+                   ((FusionPropertyShare *) arg, &share, sizeof(share)))
+                    return -EFAULT;
+
+               return 0;
      }
 
      return -ENOSYS;
@@ -1167,8 +1312,7 @@ reactor_ioctl(FusionDev * dev, Fusionee * fusionee,
                if (dispatch.msg_size <= 0)
                     return -EINVAL;
 
-               /* message data > 64k should be stored in shared memory */
-               if (dispatch.msg_size > 0x10000)
+               if (dispatch.msg_size > FUSION_MESSAGE_SIZE_MAX)
                     return -EMSGSIZE;
 
                if (dev->api.major <= 4)
@@ -1304,24 +1448,85 @@ check_permission( FusionEntries *entries,
      return fusion_entry_check_permissions( entries, entry_id, fusion_id, nr );
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
-static long
-fusion_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-#else
-static int
-fusion_ioctl(struct inode *inode, struct file *file,
-             unsigned int cmd, unsigned long arg)
-#endif
+/*
+ * Read-only commands looking at a single entry, which run without any lock,
+ * unless they return FUSION_RESTART_EXCLUSIVE.
+ */
+static bool
+ioctl_lockless( unsigned int cmd )
 {
-     int        ret      = -ENOSYS;
-     Fusionee  *fusionee = file->private_data;
-     FusionDev *dev      = fusionee->fusion_dev;
+     switch (_IOC_TYPE(cmd)) {
+          case FT_LOUNGE:
+               return _IOC_NR(cmd) == _IOC_NR(FUSION_ENTRY_GET_INFO);
 
-//     FUSION_DEBUG("fusion_ioctl (0x%08x)\n", cmd);
+          case FT_CALL:
+               return _IOC_NR(cmd) == _IOC_NR(FUSION_CALL_GET_OWNER);
 
-     fusion_core_lock( fusion_core );
+          case FT_REF:
+               return _IOC_NR(cmd) == _IOC_NR(FUSION_REF_STAT);
 
-     fusionee_ref( fusionee );
+          case FT_SKIRMISH:
+               return _IOC_NR(cmd) == _IOC_NR(FUSION_SKIRMISH_LOCK_COUNT);
+     }
+
+     return false;
+}
+
+/*
+ * Commands working on a single skirmish, property or ref, which
+ * run with the world locked shared if entry locking is enabled.
+ */
+static bool
+ioctl_shared( unsigned int cmd )
+{
+     if (!fusion_entry_locking)
+          return false;
+
+     switch (_IOC_TYPE(cmd)) {
+          case FT_SKIRMISH:
+               switch (_IOC_NR(cmd)) {
+                    case _IOC_NR(FUSION_SKIRMISH_PREVAIL):
+                    case _IOC_NR(FUSION_SKIRMISH_SWOOP):
+                    case _IOC_NR(FUSION_SKIRMISH_DISMISS):
+                    case _IOC_NR(FUSION_SKIRMISH_WAIT):
+                    case _IOC_NR(FUSION_SKIRMISH_NOTIFY):
+                         return true;
+               }
+               break;
+
+          case FT_PROPERTY:
+               switch (_IOC_NR(cmd)) {
+                    case _IOC_NR(FUSION_PROPERTY_LEASE):
+                    case _IOC_NR(FUSION_PROPERTY_PURCHASE):
+                    case _IOC_NR(FUSION_PROPERTY_CEDE):
+                         return true;
+               }
+               break;
+
+          case FT_REF:
+               switch (_IOC_NR(cmd)) {
+                    case _IOC_NR(FUSION_REF_UP):
+                    case _IOC_NR(FUSION_REF_UP_GLOBAL):
+                    case _IOC_NR(FUSION_REF_DOWN):
+                    case _IOC_NR(FUSION_REF_DOWN_GLOBAL):
+                    case _IOC_NR(FUSION_REF_ZERO_LOCK):
+                    case _IOC_NR(FUSION_REF_ZERO_TRYLOCK):
+                    case _IOC_NR(FUSION_REF_UNLOCK):
+                    case _IOC_NR(FUSION_REF_CATCH):
+                    case _IOC_NR(FUSION_REF_THROW):
+                         return true;
+               }
+               break;
+     }
+
+     return false;
+}
+
+static int
+ioctl_dispatch( FusionDev *dev, Fusionee *fusionee,
+              unsigned int cmd, unsigned long arg )
+{
+     int ret = -ENOSYS;
 
      switch (_IOC_TYPE(cmd)) {
           case FT_LOUNGE:
@@ -1333,7 +1538,8 @@ fusion_ioctl(struct inode *inode, struct file *file,
                break;
 
           case FT_CALL:
-               if (dev->secure) {
+               if (dev->secure && cmd != FUSION_CALL_RING_ENTER && cmd != FUSION_CALL_WAIT &&
+                   cmd != FUSION_CALL_ARENA_ALLOC && cmd != FUSION_CALL_ARENA_FREE) {
                     ret = check_permission( &dev->call, fusionee, cmd, arg );
                     if (ret)
                          break;
@@ -1387,9 +1593,94 @@ fusion_ioctl(struct inode *inode, struct file *file,
                break;
      }
 
+
+     return ret;
+}
+
+/*
+ * Run the ops of a batch one after another without unlocking the world in between.
+ *
+ * Blocking ops like FUSION_SKIRMISH_PREVAIL still release the world while they wait,
+ * so the ops are not atomic as a whole. The number of ops is limited to keep others
+ * from being locked out.
+ */
+static int
+ioctl_batch( FusionDev *dev, Fusionee *fusionee, FusionBatch *batch_bin )
+{
+     int            ret = 0;
+     unsigned int   i;
+     FusionBatch    batch;
+     FusionBatchOp  op;
+
+     if (unlocked_copy_from_user(&batch, batch_bin, sizeof(batch)))
+          return -EFAULT;
+
+     if (batch.num_ops > FUSION_BATCH_MAX)
+          return -EINVAL;
+
+     for (i=0; i<batch.num_ops; i++) {
+          if (unlocked_copy_from_user(&op, &batch.ops[i], sizeof(op)))
+               return -EFAULT;
+
+          if (_IOC_TYPE(op.cmd) == FT_LOUNGE && _IOC_NR(op.cmd) == _IOC_NR(FUSION_BATCH))
+               ret = -EINVAL;
+          else
+               ret = ioctl_dispatch( dev, fusionee, op.cmd, op.arg );
+
+          if (put_user( ret, &batch.ops[i].result ))
+               return -EFAULT;
+
+          if (ret < 0)
+               break;
+     }
+
+     if (put_user( i, &batch_bin->processed ))
+          return -EFAULT;
+
+     return ret < 0 ? ret : 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+static long
+fusion_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+#else
+static int
+fusion_ioctl(struct inode *inode, struct file *file,
+             unsigned int cmd, unsigned long arg)
+#endif
+{
+     int        ret;
+     Fusionee  *fusionee = file->private_data;
+     FusionDev *dev      = fusionee->fusion_dev;
+
+//     FUSION_DEBUG("fusion_ioctl (0x%08x)\n", cmd);
+
+     if (ioctl_lockless( cmd )) {
+          ret = ioctl_dispatch( dev, fusionee, cmd, arg );
+
+          if (ret != FUSION_RESTART_EXCLUSIVE)
+               return ret;
+     }
+     else if (ioctl_shared( cmd )) {
+          fusion_dev_lock_shared( dev );
+
+          ret = ioctl_dispatch( dev, fusionee, cmd, arg );
+
+          fusion_dev_unlock( dev );
+
+          if (ret != FUSION_RESTART_EXCLUSIVE)
+               return ret;
+     }
+
+     fusion_dev_lock( dev );
+
+     fusionee_ref( fusionee );
+
+     ret = ioctl_dispatch( dev, fusionee, cmd, arg );
+
      fusionee_unref( fusionee );
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
@@ -1402,7 +1693,47 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      Fusionee     *fusionee = file->private_data;
      FusionDev    *dev      = fusionee->fusion_dev;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
+
+     if (vma->vm_pgoff == FUSION_SLOTS_OFFSET >> PAGE_SHIFT) {
+          ret = fusion_slots_mmap(dev, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_REF_COUNTERS_OFFSET >> PAGE_SHIFT) {
+          ret = fusion_counters_mmap(&fusionee->ref_counters, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_RECEIVE_RING_OFFSET >> PAGE_SHIFT) {
+          ret = fusionee_ring_mmap(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_CALL_RING_OFFSET >> PAGE_SHIFT) {
+          ret = fusion_call_ring_mmap(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_CALL_ARENA_OFFSET >> PAGE_SHIFT) {
+          ret = fusion_call_arena_mmap(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
 
      // FIXME: compile switch!
      vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
@@ -1413,19 +1744,19 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      else {
           size = vma->vm_end - vma->vm_start;
           if (!size || size > PAGE_SIZE) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return -EINVAL;
           }
 
           if (!dev->shared_area) {
                if (fusionee_id(fusionee) != FUSION_ID_MASTER) {
-                    fusion_core_unlock( fusion_core );
+                    fusion_dev_unlock( dev );
                     return -EPERM;
                }
 
                dev->shared_area = fusion_core_malloc( fusion_core, PAGE_SIZE );
                if (!dev->shared_area) {
-                    fusion_core_unlock( fusion_core );
+                    fusion_dev_unlock( dev );
                     return -ENOMEM;
                }
           }
@@ -1442,7 +1773,7 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
 #endif
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
@@ -1454,6 +1785,56 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      FusionDev *dev      = fusionee->fusion_dev;
      unsigned int size;
 
+     if (vma->vm_pgoff == FUSION_SLOTS_OFFSET >> PAGE_SHIFT) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_slots_mmap(dev, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_REF_COUNTERS_OFFSET >> PAGE_SHIFT) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_counters_mmap(&fusionee->ref_counters, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_RECEIVE_RING_OFFSET >> PAGE_SHIFT) {
+          fusion_dev_lock( dev );
+
+          ret = fusionee_ring_mmap(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_CALL_RING_OFFSET >> PAGE_SHIFT) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_call_ring_mmap(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
+     if (vma->vm_pgoff == FUSION_CALL_ARENA_OFFSET >> PAGE_SHIFT) {
+          fusion_dev_lock( dev );
+
+          ret = fusion_call_arena_mmap(dev, fusionee, vma);
+
+          fusion_dev_unlock( dev );
+
+          return ret;
+     }
+
      if (vma->vm_pgoff != 0)
           return -EINVAL;
 
@@ -1464,17 +1845,17 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
      if (fusionee_id(fusionee) != FUSION_ID_MASTER && (vma->vm_flags & VM_WRITE))
           return -EPERM;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->shared_area) {
           if (fusionee_id(fusionee) != FUSION_ID_MASTER) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return -EPERM;
           }
 
           dev->shared_area = get_zeroed_page(GFP_ATOMIC);
           if (!dev->shared_area) {
-               fusion_core_unlock( fusion_core );
+               fusion_dev_unlock( dev );
                return -ENOMEM;
           }
 
@@ -1491,7 +1872,7 @@ static int fusion_mmap(struct file *file, struct vm_area_struct *vma)
                                PAGE_SIZE, vma->vm_page_prot);
 #endif
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return ret;
 }
@@ -1607,8 +1988,88 @@ ulong cpu;
 module_param( cpu, ulong, 0 );
 MODULE_PARM_DESC( cpu, "CPU index");
 
+/******************************************************************************/
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0)
+/*
+ * Releases pooled packets and executions under memory pressure,
+ * worlds being locked are skipped to never block in reclaim.
+ */
+static unsigned long
+fusion_shrink_devs( unsigned long nr )
+{
+     int           i;
+     unsigned long freed = 0;
+
+     for (i = 0; i < NUM_MINORS && freed < nr; i++) {
+          FusionDev *dev = &shared->devs[i];
+
+          if (!atomic_read( &dev->pooled ) || !fusion_dev_trylock( dev ))
+               continue;
+
+          if (dev->refs) {
+               freed += fusionee_shrink( dev, nr - freed );
+               freed += fusion_call_shrink( dev, nr - freed );
+          }
+
+          fusion_dev_unlock( dev );
+     }
+
+     return freed;
+}
+
+static unsigned long
+fusion_count_pooled( void )
+{
+     int           i;
+     unsigned long count = 0;
+
+     for (i = 0; i < NUM_MINORS; i++)
+          count += atomic_read( &shared->devs[i].pooled );
+
+     return count;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
+static unsigned long
+fusion_shrinker_count( struct shrinker *shrinker, struct shrink_control *sc )
+{
+     return fusion_count_pooled();
+}
+
+static unsigned long
+fusion_shrinker_scan( struct shrinker *shrinker, struct shrink_control *sc )
+{
+     unsigned long freed = fusion_shrink_devs( sc->nr_to_scan );
+
+     return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker fusion_shrinker = {
+     .count_objects = fusion_shrinker_count,
+     .scan_objects  = fusion_shrinker_scan,
+     .seeks         = DEFAULT_SEEKS,
+};
+#else
+static int
+fusion_shrinker_shrink( struct shrinker *shrinker, struct shrink_control *sc )
+{
+     if (sc->nr_to_scan)
+          fusion_shrink_devs( sc->nr_to_scan );
+
+     return fusion_count_pooled();
+}
+
+static struct shrinker fusion_shrinker = {
+     .shrink = fusion_shrinker_shrink,
+     .seeks  = DEFAULT_SEEKS,
+};
+#endif
+#endif
+
 int __init fusion_init(void)
 {
+     int i;
      int ret;
 
      printk( KERN_INFO "Starting fusion driver v%d.%d.%d\n",
@@ -1636,6 +2097,9 @@ int __init fusion_init(void)
           shared->addr_base = (void*) fusion_shm_base + 0x80000;
 #endif
 
+          for (i = 0; i < NUM_MINORS; i++)
+               fusion_core_lock_init( fusion_core, &shared->devs[i].lock );
+
           fusion_core_set_pointer( fusion_core, 0, shared );
      }
 
@@ -1645,6 +2109,10 @@ int __init fusion_init(void)
 
      proc_fusion_dir = proc_mkdir("fusion", NULL);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0)
+     register_shrinker( &fusion_shrinker );
+#endif
+
      return 0;
 }
 
@@ -1699,11 +2167,27 @@ static void __exit deregister_devices(void)
 
 void __exit fusion_exit(void)
 {
+     int i;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 0, 0)
+     unregister_shrinker( &fusion_shrinker );
+#endif
+
      deregister_devices();
 
      remove_proc_entry("fusion", NULL);
 
-     fusion_core_free( fusion_core, shared );
+     /* Wait for entries still being freed after a grace period. */
+     rcu_barrier();
+
+     fusion_caches_destroy();
+
+     if (!cpu) {
+          for (i = 0; i < NUM_MINORS; i++)
+               fusion_core_lock_deinit( fusion_core, &shared->devs[i].lock );
+
+          fusion_core_free( fusion_core, shared );
+     }
 
      fusion_core_exit( fusion_core );
 }
@@ -17,22 +17,55 @@
 
 #include <linux/version.h>
 #include <linux/proc_fs.h>
+#include <asm/atomic.h>
 
 #include "debug.h"
 #include "entries.h"
 #include "list.h"
 #include "shmpool.h"
+#include "slots.h"
 
 #define D_ARRAY_SIZE(array)        ((int)(sizeof(array) / sizeof((array)[0])))
 
 #define NUM_MINORS  32
 #define NUM_CLASSES 8
 
+/*
+ * Returned by operations in shared locking mode that need the world lock held exclusively,
+ * the ioctl is restarted then with the world being locked exclusively.
+ */
+#define FUSION_RESTART_EXCLUSIVE  (-1024)
+
 #define CACHE_EXECUTIONS_NUM      10
 #define CACHE_EXECUTIONS_DATA_LEN 20
 
+#define SKIRMISH_HOLDER_BUCKETS   64
+
 typedef struct __Fusion_FusionShared FusionShared;
 
+/*
+ * Objects a fusionee attached to, holds or owns, see fusionee_own().
+ */
+typedef enum {
+     FUSIONEE_OWNED_CALLS,
+     FUSIONEE_OWNED_LOCAL_REFS,
+     FUSIONEE_OWNED_LOCKED_REFS,
+     FUSIONEE_OWNED_PROPERTIES,
+     FUSIONEE_OWNED_REACTOR_NODES,
+     FUSIONEE_OWNED_SHMPOOL_NODES,
+     FUSIONEE_OWNED_CALL_WORKERS,
+
+     FUSIONEE_OWNED_NUM
+} FusioneeOwnedType;
+
+typedef struct {
+     FusionLink    link;
+
+     FusionLink  **list;      /* NULL if not linked */
+     FusionID      fusion_id;
+     FusionEntry  *entry;     /* entry the object belongs to */
+} FusioneeOwnedLink;
+
 struct __Fusion_FusionDev {
      FusionShared *shared;
 
@@ -55,32 +88,36 @@ struct __Fusion_FusionDev {
 #endif
 
      struct {
-          int property_lease_purchase;
-          int property_cede;
+          atomic_t property_lease_purchase;
+          atomic_t property_cede;
 
-          int reactor_attach;
-          int reactor_detach;
-          int reactor_dispatch;
+          atomic_t reactor_attach;
+          atomic_t reactor_detach;
+          atomic_t reactor_dispatch;
 
-          int ref_up;
-          int ref_down;
+          atomic_t ref_up;
+          atomic_t ref_down;
 
-          int ref_catch;
-          int ref_throw;
+          atomic_t ref_catch;
+          atomic_t ref_throw;
 
-          int skirmish_prevail_swoop;
-          int skirmish_dismiss;
-          int skirmish_wait;
-          int skirmish_notify;
+          atomic_t skirmish_prevail_swoop;
+          atomic_t skirmish_dismiss;
+          atomic_t skirmish_wait;
+          atomic_t skirmish_notify;
 
-          int shmpool_attach;
-          int shmpool_detach;
+          atomic_t shmpool_attach;
+          atomic_t shmpool_detach;
      } stat;
 
      struct {
           int last_id;
           FusionLink *list;
+          FusionHash *ids;    /* FusionID -> Fusionee, for entered fusionees */
           FusionWaitQueue wait;
+
+          FusionLink *unowned[FUSIONEE_OWNED_NUM];      /* objects of fusionees not entered */
+          FusionLock  owned_lock;                       /* for ownership lists in shared locking mode */
      } fusionee;
 
      FusionEntries call;
@@ -90,9 +127,26 @@ struct __Fusion_FusionDev {
      FusionEntries shmpool;
      FusionEntries skirmish;
 
+     struct {
+          FusionLink *holders[SKIRMISH_HOLDER_BUCKETS];   /* skirmishs held or transferred, by pid */
+          FusionLink *shared;                              /* skirmishs having a slot */
+          FusionLock  lock;                                /* for updates in shared locking mode */
+     } skirmish_index;
+
+     FusionLink   *shared_properties;    /* properties having a slot */
+
      FusionLink   *execution_free_list;
      unsigned int  execution_free_list_num;
 
+     struct {
+          void          *area;      /* mapped at FUSION_CALL_ARENA_OFFSET, NULL until used */
+          unsigned int   pages;
+          unsigned long *map;       /* allocated pages */
+          FusionHash    *blocks;    /* offset -> block */
+     } call_arena;
+
+     atomic_t      pooled;          /* pooled executions and packets, reclaimable by the shrinker */
+
      unsigned int  next_class_index;
 
 #if FUSION_SHM_PER_WORLD_SPACE
@@ -102,7 +156,12 @@ struct __Fusion_FusionDev {
 
      unsigned long shm_base;
 
+     FusionSlots   slots;
+
      int           shutdown;
+
+     /* Protects everything above, must stay last as it survives the reset in fusion_open() */
+     FusionLock    lock;
 };
 
 struct __Fusion_FusionShared {
@@ -121,4 +180,45 @@ extern struct proc_dir_entry *fusion_proc_dir[NUM_MINORS];
 extern unsigned long fusion_shm_base;
 extern unsigned long fusion_shm_size;
 
+extern int           fusion_entry_locking;
+extern unsigned int  fusion_busy_poll_max;
+extern unsigned int  fusion_call_arena_size;
+
+
+static inline void
+fusion_dev_lock( FusionDev *dev )
+{
+     fusion_core_lock_acquire( fusion_core, &dev->lock );
+}
+
+/*
+ * Returns false instead of blocking, e.g. for memory reclaim.
+ */
+static inline bool
+fusion_dev_trylock( FusionDev *dev )
+{
+     return fusion_core_lock_tryacquire( fusion_core, &dev->lock );
+}
+
+static inline void
+fusion_dev_lock_shared( FusionDev *dev )
+{
+     fusion_core_lock_acquire_shared( fusion_core, &dev->lock );
+}
+
+static inline void
+fusion_dev_unlock( FusionDev *dev )
+{
+     fusion_core_lock_release( fusion_core, &dev->lock );
+}
+
+/*
+ * Returns false if the world is only locked shared, i.e. entries have to be locked individually.
+ */
+static inline bool
+fusion_dev_exclusive( FusionDev *dev )
+{
+     return fusion_core_lock_exclusive( fusion_core, &dev->lock );
+}
+
 #endif
@@ -21,6 +21,7 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE > KERNEL_VERSION(4, 0, 0)
 #include <generated/autoconf.h>
@@ -35,12 +36,15 @@
 
 #include <linux/sched/debug.h>
 #include <linux/sched/task.h>
+#include <linux/sched/clock.h>
 
+#include "cache.h"
 #include "call.h"
 #include "fifo.h"
 #include "list.h"
 #include "fusiondev.h"
 #include "fusionee.h"
+#include "hash.h"
 #include "property.h"
 #include "reactor.h"
 #include "ref.h"
@@ -66,37 +70,68 @@ typedef struct {
 
 #define FUSION_MAX_PACKET_SIZE	16384
 
+/* Packets grow through these buffer sizes while messages are appended. */
+static const size_t packet_class_sizes[] = { 256, 1024, 4096, FUSION_MAX_PACKET_SIZE };
+static const char  *packet_class_names[] = { "fusion_packet_256", "fusion_packet_1k",
+                                             "fusion_packet_4k",  "fusion_packet_16k" };
+
+#define NUM_PACKET_CLASSES  D_ARRAY_SIZE(packet_class_sizes)
+
 typedef struct {
      FusionLink           link;
 
      int                  magic;
 
-     char                 buf[FUSION_MAX_PACKET_SIZE];
+     unsigned int         class_index;
      size_t               size;
      bool                 flush;
 
+     size_t               cont;         /* leading bytes continuing a message of the previous packet */
+     size_t               spill;        /* bytes of the last message continuing in the following packets */
+
      FusionFifo           callbacks;
+
+     char                 buf[];        /* packet_class_sizes[class_index] bytes */
 } Packet;
 
+static FusionCache *packet_caches[NUM_PACKET_CLASSES];
+static FusionCache *callback_cache;
+
+static inline size_t
+Packet_Capacity( const Packet *packet )
+{
+     return packet_class_sizes[packet->class_index];
+}
+
 /******************************************************************************/
 
 static Packet *
-Packet_New( void )
+Packet_New( size_t size )
 {
-     Packet *packet;
+     Packet       *packet;
+     unsigned int  class_index = 0;
 
-     FUSION_DEBUG( "%s()\n", __FUNCTION__ );
+     FUSION_DEBUG( "%s( %zu )\n", __FUNCTION__, size );
 
-     packet = fusion_core_malloc( fusion_core, sizeof(Packet) );
+     FUSION_ASSERT( size <= FUSION_MAX_PACKET_SIZE );
+
+     while (packet_class_sizes[class_index] < size)
+          class_index++;
+
+     packet = fusion_core_cache_alloc( fusion_core, packet_caches[class_index] );
      if (!packet)
           return NULL;
 
+     packet->class_index = class_index;
+
      packet->link.magic = 0;
      packet->link.prev  = NULL;
      packet->link.next  = NULL;
 
      packet->size      = 0;
      packet->flush     = false;
+     packet->cont      = 0;
+     packet->spill     = 0;
 
      fusion_fifo_reset( &packet->callbacks );
 
@@ -122,10 +157,96 @@ Packet_Free( Packet *packet )
      while ((callback = (MessageCallback *) fusion_fifo_get(&packet->callbacks)) != NULL) {
           D_MAGIC_ASSERT( packet, Packet );
 
-          fusion_core_free( fusion_core,  callback );
+          fusion_core_cache_free( fusion_core, callback_cache, callback );
+     }
+
+     fusion_core_cache_free( fusion_core, packet_caches[packet->class_index], packet );
+}
+
+static inline size_t
+Message_Size( int msg_size,
+              int extra_size )
+{
+     return (sizeof(FusionReadMessage) + msg_size + extra_size + 3) & ~3;
+}
+
+/*
+ * Copies 'length' bytes at 'offset' of the message (header, data, extra data and padding) to 'buf'.
+ */
+static int
+Message_Copy( char                    *buf,
+              size_t                   offset,
+              size_t                   length,
+              const FusionReadMessage *header,
+              const void              *msg_data,
+              int                      msg_size,
+              const void              *extra_data,
+              int                      extra_size,
+              bool                     from_user )
+{
+     size_t data_end  = sizeof(FusionReadMessage) + msg_size;
+     size_t extra_end = data_end + (extra_data ? extra_size : 0);
+
+     while (length) {
+          size_t n;
+
+          if (offset < sizeof(FusionReadMessage)) {
+               n = min_t( size_t, length, sizeof(FusionReadMessage) - offset );
+
+               memcpy( buf, (const char*) header + offset, n );
+          }
+          else if (offset < data_end) {
+               const char *src = (const char*) msg_data + offset - sizeof(FusionReadMessage);
+
+               n = min_t( size_t, length, data_end - offset );
+
+               if (from_user) {
+                    if (copy_from_user( buf, src, n ))
+                         return -EFAULT;
+               }
+               else
+                    memcpy( buf, src, n );
+          }
+          else if (offset < extra_end) {
+               n = min_t( size_t, length, extra_end - offset );
+
+               if (copy_from_user( buf, (const char*) extra_data + offset - data_end, n ))
+                    return -EFAULT;
+          }
+          else {
+               n = length;
+
+               memset( buf, 0, n );
+          }
+
+          buf    += n;
+          offset += n;
+          length -= n;
      }
 
-     fusion_core_free( fusion_core,  packet );
+     return 0;
+}
+
+static int
+Message_Write( char       *buf,
+               int         type,
+               int         msg_id,
+               int         channel,
+               const void *msg_data,
+               int         msg_size,
+               const void *extra_data,
+               int         extra_size,
+               bool        from_user )
+{
+     FusionReadMessage header;
+
+     header.msg_type    = type;
+     header.msg_id      = msg_id;
+     header.msg_channel = channel;
+     header.msg_size    = msg_size + extra_size;
+
+     return Message_Copy( buf, 0, Message_Size( msg_size, extra_size ), &header,
+                          msg_data, msg_size, extra_data, extra_size, from_user );
 }
 
 static int
@@ -139,36 +260,20 @@ Packet_Write( Packet     *packet,
               int         extra_size,
               bool        from_user )
 {
-     size_t             total   = sizeof(FusionReadMessage) + msg_size + extra_size;
-     size_t             aligned = (total + 3) & ~3;
-     FusionReadMessage *header  = (FusionReadMessage *)( packet->buf + packet->size );
+     int    ret;
+     size_t aligned = Message_Size( msg_size, extra_size );
 
-     FUSION_DEBUG( "%s( %p, msg_id %d, channel %d, size %d, extra %d, total %zu )\n",
-                   __FUNCTION__, packet, msg_id, channel, msg_size, extra_size, total );
+     FUSION_DEBUG( "%s( %p, msg_id %d, channel %d, size %d, extra %d, aligned %zu )\n",
+                   __FUNCTION__, packet, msg_id, channel, msg_size, extra_size, aligned );
 
      D_MAGIC_ASSERT( packet, Packet );
 
-     FUSION_ASSERT( packet->size + aligned <= FUSION_MAX_PACKET_SIZE );
+     FUSION_ASSERT( packet->size + aligned <= Packet_Capacity( packet ) );
 
-     header->msg_type    = type;
-     header->msg_id      = msg_id;
-     header->msg_channel = channel;
-     header->msg_size    = msg_size + extra_size;
-
-     if (from_user) {
-          if (copy_from_user( header + 1, msg_data, msg_size ))
-               return -EFAULT;
-     }
-     else
-          memcpy( header + 1, msg_data, msg_size );
-
-     if (extra_data && extra_size) {
-          if (copy_from_user( (char*)(header + 1) + msg_size, extra_data, extra_size ))
-               return -EFAULT;
-     }
-
-     while (total < aligned)
-          packet->buf[packet->size + total++] = 0;
+     ret = Message_Write( packet->buf + packet->size, type, msg_id, channel,
+                          msg_data, msg_size, extra_data, extra_size, from_user );
+     if (ret)
+          return ret;
 
      packet->size += aligned;
 
@@ -188,7 +293,7 @@ Packet_AddCallback( Packet                *packet,
 
      D_MAGIC_ASSERT( packet, Packet );
 
-     callback = fusion_core_malloc( fusion_core, sizeof(MessageCallback) );
+     callback = fusion_core_cache_alloc( fusion_core, callback_cache );
      if (!callback)
           return -ENOMEM;
 
@@ -221,7 +326,7 @@ Packet_RunCallbacks( FusionDev *dev,
                fusion_message_callbacks[callback->func_index]( dev, callback->msg_id, callback->ctx, callback->param );
           }
 
-          fusion_core_free( fusion_core,  callback );
+          fusion_core_cache_free( fusion_core, callback_cache, callback );
      }
 
      return 0;
@@ -233,7 +338,7 @@ Packet_Search( Packet              *packet,
                int                  msg_id )
 {
      char   *buf = packet->buf;
-     size_t  pos = 0;
+     size_t  pos = packet->cont;
 
      FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, packet );
 
@@ -253,23 +358,73 @@ Packet_Search( Packet              *packet,
 
 /******************************************************************************/
 
+static void Fusionee_PutPacket( Fusionee *fusionee, Packet *packet );
+
+/*
+ * Moves the contents of the last (pending) packet to one of a larger size class.
+ */
+static int
+Fusionee_GrowPacket( Fusionee  *fusionee,
+                     Packet   **packet,
+                     size_t     size )
+{
+     Packet *old = *packet;
+     Packet *new;
+
+     FUSION_DEBUG( "%s( %p, %zu -> %zu )\n", __FUNCTION__, fusionee, Packet_Capacity( old ), size );
+
+     D_MAGIC_ASSERT( old, Packet );
+
+     new = Packet_New( size );
+     if (!new)
+          return -ENOMEM;
+
+     memcpy( new->buf, old->buf, old->size );
+
+     new->size      = old->size;
+     new->flush     = old->flush;
+     new->cont      = old->cont;
+     new->callbacks = old->callbacks;
+
+     fusion_fifo_reset( &old->callbacks );
+
+     /* It's the last one, so appending the new packet keeps the order. */
+     direct_list_remove( &fusionee->packets.items, &old->link );
+     direct_list_append( &fusionee->packets.items, &new->link );
+
+     Fusionee_PutPacket( fusionee, old );
+
+     *packet = new;
+
+     return 0;
+}
+
 static int
 Fusionee_GetPacket( Fusionee  *fusionee,
                     size_t     size,
                     Packet   **ret_packet )
 {
+     int     ret;
      Packet *packet;
 
      FUSION_DEBUG( "%s( %p )\n", __FUNCTION__, fusionee );
 
-     if (size > FUSION_MAX_PACKET_SIZE)
-          return -E2BIG;
+     /* Messages are written with padding. */
+     size = (size + 3) & ~3;
+
+     FUSION_ASSERT( size <= FUSION_MAX_PACKET_SIZE );
 
      packet = (Packet*) direct_list_last( fusionee->packets.items );
 
      D_MAGIC_ASSERT_IF( packet, Packet );
 
-     if (!packet || packet->size + size > FUSION_MAX_PACKET_SIZE) {
+     if (packet && packet->size + size > Packet_Capacity( packet ) && packet->size + size <= FUSION_MAX_PACKET_SIZE) {
+          ret = Fusionee_GrowPacket( fusionee, &packet, packet->size + size );
+          if (ret)
+               return ret;
+     }
+
+     if (!packet || packet->size + size > Packet_Capacity( packet )) {
           if (packet) {
                packet->flush = true;
 
@@ -277,13 +432,16 @@ Fusionee_GetPacket( Fusionee  *fusionee,
                wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
           }
 
-          if (fusionee->free_packets.count) {
+          /* Only packets of the smallest class are kept for reuse. */
+          if (fusionee->free_packets.count && size <= packet_class_sizes[0]) {
                packet = (Packet*) fusion_fifo_get( &fusionee->free_packets );
 
                D_MAGIC_ASSERT( packet, Packet );
+
+               atomic_dec( &fusionee->fusion_dev->pooled );
           }
           else
-               packet = Packet_New();
+               packet = Packet_New( size );
           if (!packet)
                return -ENOMEM;
 
@@ -300,6 +458,96 @@ Fusionee_GetPacket( Fusionee  *fusionee,
      return 0;
 }
 
+/*
+ * Queues a message larger than a packet as a chain of fragments in new packets,
+ * the last one is returned and gets the callback if any. All fragments are flushed,
+ * so a reader never finds the message incomplete.
+ */
+static int
+Fusionee_WriteFragments( Fusionee              *fusionee,
+                         int                    type,
+                         int                    msg_id,
+                         int                    channel,
+                         const void            *msg_data,
+                         int                    msg_size,
+                         const void            *extra_data,
+                         int                    extra_size,
+                         bool                   from_user,
+                         FusionMessageCallback  callback,
+                         void                  *callback_ctx,
+                         int                    callback_param,
+                         Packet               **ret_packet )
+{
+     int                ret    = 0;
+     size_t             total  = Message_Size( msg_size, extra_size );
+     size_t             offset = 0;
+     Packet            *packet = NULL;
+     Packet            *last;
+     FusionFifo         fragments;
+     FusionReadMessage  header;
+
+     FUSION_DEBUG( "%s( %p, msg_id %d, size %d, extra %d, total %zu )\n",
+                   __FUNCTION__, fusionee, msg_id, msg_size, extra_size, total );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     header.msg_type    = type;
+     header.msg_id      = msg_id;
+     header.msg_channel = channel;
+     header.msg_size    = msg_size + extra_size;
+
+     fusion_fifo_reset( &fragments );
+
+     while (offset < total) {
+          size_t length = min_t( size_t, total - offset, FUSION_MAX_PACKET_SIZE );
+
+          packet = Packet_New( length );
+          if (!packet) {
+               ret = -ENOMEM;
+               break;
+          }
+
+          fusion_fifo_put( &fragments, &packet->link );
+
+          ret = Message_Copy( packet->buf, offset, length, &header,
+                              msg_data, msg_size, extra_data, extra_size, from_user );
+          if (ret)
+               break;
+
+          packet->size  = length;
+          packet->flush = true;
+          packet->cont  = offset ? length : 0;
+          packet->spill = total - offset - length;
+
+          offset += length;
+     }
+
+     if (!ret && callback)
+          ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
+
+     if (ret) {
+          while ((packet = (Packet *) fusion_fifo_get( &fragments )) != NULL)
+               Packet_Free( packet );
+
+          return ret;
+     }
+
+     /* Previous messages can be read now, the fragments can't be appended to. */
+     last = (Packet*) direct_list_last( fusionee->packets.items );
+     if (last && !last->flush) {
+          last->flush = true;
+
+          wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
+     }
+
+     while ((last = (Packet *) fusion_fifo_get( &fragments )) != NULL)
+          fusion_fifo_put( &fusionee->packets, &last->link );
+
+     *ret_packet = packet;
+
+     return 0;
+}
+
 static void
 Fusionee_PutPacket( Fusionee *fusionee,
                     Packet   *packet )
@@ -311,20 +559,128 @@ Fusionee_PutPacket( Fusionee *fusionee,
      D_ASSERT( packet->link.prev == NULL );
      D_ASSERT( packet->link.next == NULL );
 
-     if (fusionee->free_packets.count > 11)
+     if (fusionee->free_packets.count > 11 || packet->class_index)
           Packet_Free( packet );
      else {
           packet->size  = 0;
           packet->flush = false;
+          packet->cont  = 0;
+          packet->spill = 0;
 
           fusion_fifo_reset( &packet->callbacks );
 
           fusion_fifo_put( &fusionee->free_packets, &packet->link );
+
+          atomic_inc( &fusionee->fusion_dev->pooled );
      }
 }
 
 /******************************************************************************/
 
+static inline char *
+Fusionee_RingData( Fusionee *fusionee )
+{
+     return (char*) fusionee->ring + PAGE_SIZE;
+}
+
+/*
+ * Returns true if user space has consumed all messages of the ring (or has none).
+ */
+static inline bool
+Fusionee_RingEmpty( Fusionee *fusionee )
+{
+     return !fusionee->ring || READ_ONCE( fusionee->ring->tail ) == fusionee->ring_head;
+}
+
+/*
+ * Writes the message to the receive ring, returns -ENOSPC if it doesn't fit.
+ */
+static int
+Fusionee_RingWrite( Fusionee   *fusionee,
+                    int         type,
+                    int         msg_id,
+                    int         channel,
+                    const void *msg_data,
+                    int         msg_size,
+                    const void *extra_data,
+                    int         extra_size,
+                    bool        from_user )
+{
+     int          ret;
+     size_t       aligned = Message_Size( msg_size, extra_size );
+     unsigned int size    = fusionee->ring_size;
+     unsigned int head    = fusionee->ring_head;
+     unsigned int used    = head - READ_ONCE( fusionee->ring->tail );
+     unsigned int offset  = head & (size - 1);
+     unsigned int skip    = 0;
+
+     FUSION_DEBUG( "%s( %p, msg_id %d, channel %d, size %d, extra %d, head %u, used %u )\n",
+                   __FUNCTION__, fusionee, msg_id, channel, msg_size, extra_size, head, used );
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     /* Messages are not split, the reader wraps at an FMT_SKIP header or if less than a header remains. */
+     if (offset + aligned > size)
+          skip = size - offset;
+
+     /* Also catches a bogus tail written by user space. */
+     if (used > size || aligned + skip > size - used)
+          return -ENOSPC;
+
+     if (skip >= sizeof(FusionReadMessage)) {
+          FusionReadMessage *header = (FusionReadMessage *)( Fusionee_RingData( fusionee ) + offset );
+
+          header->msg_type    = FMT_SKIP;
+          header->msg_id      = 0;
+          header->msg_channel = 0;
+          header->msg_size    = skip - sizeof(FusionReadMessage);
+     }
+
+     ret = Message_Write( Fusionee_RingData( fusionee ) + ((head + skip) & (size - 1)), type, msg_id, channel,
+                          msg_data, msg_size, extra_data, extra_size, from_user );
+     if (ret)
+          return ret;
+
+     fusionee->ring_head = head + skip + aligned;
+
+     /* Publish the message after its contents. */
+     smp_store_release( &fusionee->ring->head, fusionee->ring_head );
+
+     return 0;
+}
+
+int
+fusionee_ring_mmap( FusionDev             *dev,
+                    Fusionee              *fusionee,
+                    struct vm_area_struct *vma )
+{
+     unsigned long size = vma->vm_end - vma->vm_start;
+
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     if (size <= PAGE_SIZE || size - PAGE_SIZE > FUSION_RECEIVE_RING_SIZE_MAX || !is_power_of_2( size - PAGE_SIZE ))
+          return -EINVAL;
+
+     if (fusionee->ring) {
+          if (size - PAGE_SIZE != fusionee->ring_size)
+               return -EBUSY;
+     }
+     else {
+          fusionee->ring = vmalloc_user( size );
+          if (!fusionee->ring)
+               return -ENOMEM;
+
+          fusionee->ring_size = size - PAGE_SIZE;
+          fusionee->ring_head = 0;
+
+          fusionee->ring->size = fusionee->ring_size;
+     }
+
+     return remap_vmalloc_range( vma, fusionee->ring, 0 );
+}
+
+/******************************************************************************/
+
 static int lookup_fusionee(FusionDev * dev, FusionID id,
                            Fusionee ** ret_fusionee);
 static int lock_fusionee(FusionDev * dev, FusionID id,
@@ -341,7 +697,7 @@ fusionees_proc_show(struct seq_file *m, void *v)
      Fusionee *fusionee;
      FusionDev *dev = m->private;
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->shutdown) {
           direct_list_foreach(fusionee, dev->fusionee.list) {
@@ -355,7 +711,7 @@ fusionees_proc_show(struct seq_file *m, void *v)
           }
      }
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      return 0;
 }
@@ -373,9 +729,30 @@ static const struct file_operations fusionees_proc_fops = {
 
 int fusionee_init(FusionDev * dev)
 {
-     if (!dev->refs)
+     int ret;
+     int i;
+
+     for (i = 0; i < NUM_PACKET_CLASSES; i++) {
+          ret = fusion_cache_register(&packet_caches[i], packet_class_names[i],
+                                      sizeof(Packet) + packet_class_sizes[i]);
+          if (ret)
+               return ret;
+     }
+
+     ret = fusion_cache_register(&callback_cache, "fusion_message_callback", sizeof(MessageCallback));
+     if (ret)
+          return ret;
+
+     if (!dev->refs) {
+          ret = fusion_hash_create(FHT_INT, FHT_PTR, 17, &dev->fusionee.ids);
+          if (ret)
+               return ret;
+
           fusion_core_wq_init( fusion_core, &dev->fusionee.wait);
 
+          fusion_core_lock_init( fusion_core, &dev->fusionee.owned_lock );
+     }
+
      proc_create_data("fusionees", 0, fusion_proc_dir[dev->index],
                        &fusionees_proc_fops, dev);
 
@@ -386,11 +763,11 @@ void fusionee_deinit(FusionDev * dev)
 {
      Fusionee *fusionee, *next;
 
-     fusion_core_unlock( fusion_core );
+     fusion_dev_unlock( dev );
 
      remove_proc_entry( "fusionees", fusion_proc_dir[dev->index] );
 
-     fusion_core_lock( fusion_core );
+     fusion_dev_lock( dev );
 
      if (!dev->refs) {
           direct_list_foreach_safe (fusionee, next, dev->fusionee.list) {
@@ -400,13 +777,51 @@ void fusionee_deinit(FusionDev * dev)
                     Packet_Free( packet );
                }
 
+               free_packets( fusionee, dev, &fusionee->free_packets );
+
+               fusion_counters_deinit( &fusionee->ref_counters );
+
+               if (fusionee->ring)
+                    vfree( fusionee->ring );
+
+               if (fusionee->call_ring)
+                    vfree( fusionee->call_ring );
+
                fusion_core_free( fusion_core, fusionee);
           }
+
+          fusion_hash_destroy( dev->fusionee.ids );
+
+          dev->fusionee.ids = NULL;
+
+          fusion_core_lock_deinit( fusion_core, &dev->fusionee.owned_lock );
      }
 }
 
 
 
+int fusionee_shrink(FusionDev * dev, int nr)
+{
+     int       freed = 0;
+     Fusionee *fusionee;
+
+     direct_list_foreach (fusionee, dev->fusionee.list) {
+          while (freed < nr && fusionee->free_packets.count) {
+               Packet *packet = (Packet *) fusion_fifo_get(&fusionee->free_packets);
+
+               D_MAGIC_ASSERT( packet, Packet );
+
+               atomic_dec( &dev->pooled );
+
+               Packet_Free( packet );
+
+               freed++;
+          }
+     }
+
+     return freed;
+}
+
 /******************************************************************************/
 
 static void
@@ -460,6 +875,7 @@ int fusionee_new(FusionDev * dev, bool force_slave, Fusionee ** ret_fusionee)
 
      fusion_core_wq_init( fusion_core, &fusionee->wait_receive);
      fusion_core_wq_init( fusion_core, &fusionee->wait_process);
+     fusion_core_wq_init( fusion_core, &fusionee->wait_call);
 
      direct_list_prepend(&dev->fusionee.list, &fusionee->link);
 
@@ -479,11 +895,13 @@ int fusionee_new(FusionDev * dev, bool force_slave, Fusionee ** ret_fusionee)
 
 int fusionee_enter(FusionDev * dev, FusionEnter * enter, Fusionee * fusionee)
 {
+     int ret;
+
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
      if (dev->fusionee.last_id || fusionee->force_slave) {
           while (!dev->enter_ok) {
-               fusion_core_wq_wait( fusion_core, &dev->enter_wait, NULL, true );
+               fusion_core_wq_wait( fusion_core, &dev->enter_wait, &dev->lock, NULL, true );
 
                if (signal_pending(current))
                     return -EINTR;
@@ -510,8 +928,17 @@ int fusionee_enter(FusionDev * dev, FusionEnter * enter, Fusionee * fusionee)
                return -ENOPROTOOPT;
      }
 
+     if (fusionee->id)
+          fusion_hash_remove( dev->fusionee.ids, (void*)(long) fusionee->id, NULL, NULL );
+
      fusionee->id = ++dev->fusionee.last_id;
 
+     ret = fusion_hash_insert( dev->fusionee.ids, (void*)(long) fusionee->id, fusionee );
+     if (ret) {
+          fusionee->id = 0;
+          return ret;
+     }
+
      enter->fusion_id = fusionee->id;
 
      return 0;
@@ -519,19 +946,26 @@ int fusionee_enter(FusionDev * dev, FusionEnter * enter, Fusionee * fusionee)
 
 int fusionee_fork(FusionDev * dev, FusionFork * fork, Fusionee * fusionee)
 {
-     int ret;
+     int       ret;
+     Fusionee *from;
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     ret = fusion_shmpool_fork_all(dev, fusionee->id, fork->fusion_id);
+     /* Nothing to inherit from a fusionee that is gone. */
+     if (lookup_fusionee(dev, fork->fusion_id, &from)) {
+          fork->fusion_id = fusionee->id;
+          return 0;
+     }
+
+     ret = fusion_shmpool_fork_all(dev, fusionee, from);
      if (ret)
           return ret;
 
-     ret = fusion_reactor_fork_all(dev, fusionee->id, fork->fusion_id);
+     ret = fusion_reactor_fork_all(dev, fusionee, from);
      if (ret)
           return ret;
 
-     ret = fusion_ref_fork_all_local(dev, fusionee->id, fork->fusion_id);
+     ret = fusion_ref_fork_all_local(dev, fusionee, from);
      if (ret)
           return ret;
 
@@ -557,24 +991,28 @@ fusionee_get_info(FusionDev * dev, FusionGetFusioneeInfo * get_info)
      return 0;
 }
 
-int
-fusionee_send_message(FusionDev * dev,
-                      Fusionee * sender,
-                      FusionID recipient,
-                      FusionMessageType msg_type,
-                      int msg_id,
-                      int msg_channel,
-                      int msg_size,
-                      const void *msg_data,
-                      FusionMessageCallback callback,
-                      void *callback_ctx, int callback_param,
-                      const void *extra_data, unsigned int extra_size )
+static int
+send_message(FusionDev * dev,
+             Fusionee * sender,
+             FusionID recipient,
+             FusionMessageType msg_type,
+             int msg_id,
+             int msg_channel,
+             int msg_size,
+             const void *msg_data,
+             bool from_user,
+             FusionMessageCallback callback,
+             void *callback_ctx, int callback_param,
+             const void *extra_data, unsigned int extra_size )
 {
      int                      ret;
      Packet                  *packet;
      Fusionee                *fusionee;
      size_t                   size;
 
+     if (msg_size + (size_t) extra_size > FUSION_MESSAGE_SIZE_MAX)
+          return -EMSGSIZE;
+
      ret = lookup_fusionee(dev, recipient, &fusionee);
      if (ret)
           return ret;
@@ -587,37 +1025,63 @@ fusionee_send_message(FusionDev * dev,
      while (fusionee->packets.count > 10 && sender && sender->id != FUSION_ID_MASTER &&
             fusion_core_pid(fusion_core) != fusionee->dispatcher_pid && msg_type != FMT_LEAVE)
      {
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, 0, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, 0, true );
 
           if (signal_pending(current))
                return -EINTR;
      }
 
-     ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
-     if (ret)
-          return ret;
+     /* Use the ring unless the message needs a callback or has to queue up behind packets. */
+     if (fusionee->ring && !callback && !fusionee->packets.count) {
+          ret = Fusionee_RingWrite( fusionee, msg_type, msg_id, msg_channel,
+                                    msg_data, msg_size, extra_data, extra_size, from_user );
+          if (ret != -ENOSPC) {
+               if (ret)
+                    return ret;
 
-     D_MAGIC_ASSERT( packet, Packet );
+               atomic_long_inc(&fusionee->rcv_total);
+               if (sender)
+                    atomic_long_inc(&sender->snd_total);
 
+               wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
 
-     /* keep size for error handling, the other way round we'd need to remove the callback :( */
-     size = packet->size;
+               return 0;
+          }
+     }
 
-     ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
-                         msg_data, msg_size, extra_data, extra_size,
-                         msg_type != FMT_CALL && msg_type != FMT_CALL3 && msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE );
-     if (ret)
-          return ret;
+     if (Message_Size( msg_size, extra_size ) > FUSION_MAX_PACKET_SIZE) {
+          ret = Fusionee_WriteFragments( fusionee, msg_type, msg_id, msg_channel,
+                                         msg_data, msg_size, extra_data, extra_size, from_user,
+                                         callback, callback_ctx, callback_param, &packet );
+          if (ret)
+               return ret;
+     }
+     else {
+          ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
+          if (ret)
+               return ret;
 
+          D_MAGIC_ASSERT( packet, Packet );
 
 
-     D_MAGIC_ASSERT( packet, Packet );
+          /* keep size for error handling, the other way round we'd need to remove the callback :( */
+          size = packet->size;
 
-     if (callback) {
-          ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
-          if (ret) {
-               packet->size = size;
+          ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
+                              msg_data, msg_size, extra_data, extra_size, from_user );
+          if (ret)
                return ret;
+
+
+
+          D_MAGIC_ASSERT( packet, Packet );
+
+          if (callback) {
+               ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
+               if (ret) {
+                    packet->size = size;
+                    return ret;
+               }
           }
      }
 
@@ -634,6 +1098,41 @@ fusionee_send_message(FusionDev * dev,
      return 0;
 }
 
+int
+fusionee_send_message(FusionDev * dev,
+                      Fusionee * sender,
+                      FusionID recipient,
+                      FusionMessageType msg_type,
+                      int msg_id,
+                      int msg_channel,
+                      int msg_size,
+                      const void *msg_data,
+                      FusionMessageCallback callback,
+                      void *callback_ctx, int callback_param,
+                      const void *extra_data, unsigned int extra_size )
+{
+     return send_message( dev, sender, recipient, msg_type, msg_id, msg_channel, msg_size, msg_data,
+                          msg_type != FMT_CALL && msg_type != FMT_CALL3 && msg_type != FMT_CALL3_ARENA &&
+                          msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE,
+                          callback, callback_ctx, callback_param, extra_data, extra_size );
+}
+
+int
+fusionee_send_kernel_message(FusionDev * dev,
+                             Fusionee * sender,
+                             FusionID recipient,
+                             FusionMessageType msg_type,
+                             int msg_id,
+                             int msg_channel,
+                             int msg_size,
+                             const void *msg_data,
+                             FusionMessageCallback callback,
+                             void *callback_ctx, int callback_param )
+{
+     return send_message( dev, sender, recipient, msg_type, msg_id, msg_channel, msg_size, msg_data,
+                          false, callback, callback_ctx, callback_param, NULL, 0 );
+}
+
 int
 fusionee_send_message2(FusionDev * dev,
                        Fusionee *sender,
@@ -651,46 +1150,78 @@ fusionee_send_message2(FusionDev * dev,
      int     ret;
      Packet *packet;
      size_t  size;
+     bool    from_user = (msg_type != FMT_CALL && msg_type != FMT_CALL3 && msg_type != FMT_CALL3_ARENA &&
+                          msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE);
 
      FUSION_DEBUG("fusionee_send_message2 (%ld -> %ld, type %d, id %d, size %d, extra %d)\n",
                   sender ? sender->id : 0, fusionee->id, msg_type, msg_id, msg_size, extra_size);
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
+     if (msg_size + (size_t) extra_size > FUSION_MESSAGE_SIZE_MAX)
+          return -EMSGSIZE;
+
      while (fusionee->packets.count > 10 && sender && sender->id != FUSION_ID_MASTER &&
             fusion_core_pid(fusion_core) != fusionee->dispatcher_pid && msg_type != FMT_LEAVE)
      {
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, 0, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, 0, true );
 
           if (signal_pending(current))
                return -EINTR;
      }
 
-     ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
-     if (ret)
-          return ret;
+     /* Use the ring unless the message needs a callback or has to queue up behind packets. */
+     if (fusionee->ring && !callback && !fusionee->packets.count) {
+          ret = Fusionee_RingWrite( fusionee, msg_type, msg_id, msg_channel,
+                                    msg_data, msg_size, extra_data, extra_size, from_user );
+          if (ret != -ENOSPC) {
+               if (ret)
+                    return ret;
 
-     D_MAGIC_ASSERT( packet, Packet );
+               atomic_long_inc(&fusionee->rcv_total);
+               if (sender)
+                    atomic_long_inc(&sender->snd_total);
 
+               if (flush)
+                    wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
 
-     /* keep size for error handling, the other way round we'd need to remove the callback :( */
-     size = packet->size;
+               return 0;
+          }
+     }
 
-     ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
-                         msg_data, msg_size, extra_data, extra_size,
-                         msg_type != FMT_CALL && msg_type != FMT_CALL3 && msg_type != FMT_SHMPOOL && msg_type != FMT_LEAVE );
-     if (ret)
-          return ret;
+     if (Message_Size( msg_size, extra_size ) > FUSION_MAX_PACKET_SIZE) {
+          ret = Fusionee_WriteFragments( fusionee, msg_type, msg_id, msg_channel,
+                                         msg_data, msg_size, extra_data, extra_size, from_user,
+                                         callback, callback_ctx, callback_param, &packet );
+          if (ret)
+               return ret;
+     }
+     else {
+          ret = Fusionee_GetPacket( fusionee, sizeof(FusionReadMessage) + msg_size + extra_size, &packet );
+          if (ret)
+               return ret;
 
+          D_MAGIC_ASSERT( packet, Packet );
 
 
-     D_MAGIC_ASSERT( packet, Packet );
+          /* keep size for error handling, the other way round we'd need to remove the callback :( */
+          size = packet->size;
 
-     if (callback) {
-          ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
-          if (ret) {
-               packet->size = size;
+          ret = Packet_Write( packet, msg_type, msg_id, msg_channel,
+                              msg_data, msg_size, extra_data, extra_size, from_user );
+          if (ret)
                return ret;
+
+
+
+          D_MAGIC_ASSERT( packet, Packet );
+
+          if (callback) {
+               ret = Packet_AddCallback( packet, msg_id, callback, callback_ctx, callback_param );
+               if (ret) {
+                    packet->size = size;
+                    return ret;
+               }
           }
      }
 
@@ -708,12 +1239,47 @@ fusionee_send_message2(FusionDev * dev,
      return 0;
 }
 
+/*
+ * Spins with the world unlocked until another message has been sent to the fusionee.
+ * Returns false if none arrived before the end of the busy poll time.
+ */
+static bool
+Fusionee_BusyPoll( Fusionee  *fusionee,
+                   FusionDev *dev,
+                   u64        end )
+{
+     long rcv_total = atomic_long_read( &fusionee->rcv_total );
+     bool arrived   = true;
+
+     /* Still counts as waiting, e.g. for fusionee_sync(). */
+     fusionee->waiting = true;
+
+     fusion_dev_unlock( dev );
+
+     while (atomic_long_read( &fusionee->rcv_total ) == rcv_total) {
+          if (need_resched() || signal_pending( current ) || local_clock() >= end) {
+               arrived = false;
+               break;
+          }
+
+          cpu_relax();
+     }
+
+     fusion_dev_lock( dev );
+
+     fusionee->waiting = false;
+
+     return arrived;
+}
+
 int
 fusionee_get_messages(FusionDev * dev,
                       Fusionee * fusionee, void *buf, int buf_size, bool block)
 {
      int written = 0;
      FusionFifo prev_packets;
+     u64 busy_poll_end = 0;
+     bool busy_polled = false;
 
      FUSION_DEBUG( "%s()\n", __FUNCTION__ );
 
@@ -727,7 +1293,9 @@ fusionee_get_messages(FusionDev * dev,
 
      fusion_core_wq_wake( fusion_core, &fusionee->wait_process);
 
-     while (!fusionee->packets.count || !((Packet *) fusionee->packets.items)->flush) {
+     while (Fusionee_RingEmpty( fusionee ) &&
+            (!fusionee->packets.count || !((Packet *) fusionee->packets.items)->flush))
+     {
           if (prev_packets.count) {
                flush_packets(fusionee, dev, &prev_packets);
           }
@@ -735,8 +1303,21 @@ fusionee_get_messages(FusionDev * dev,
                if (!block)
                     return -EAGAIN;
 
+               /* Spin for a moment before sleeping, the time counts once per read. */
+               if (fusionee->busy_poll && fusion_busy_poll_max && !busy_polled) {
+                    if (!busy_poll_end)
+                         busy_poll_end = local_clock() + min( fusionee->busy_poll, fusion_busy_poll_max ) * NSEC_PER_USEC;
+
+                    if (Fusionee_BusyPoll( fusionee, dev, busy_poll_end ))
+                         continue;
+
+                    busy_polled = true;
+               }
+
                fusionee->waiting = true;
-               fusion_core_wq_wait( fusion_core, &fusionee->wait_receive, NULL, true );
+               fusionee->waiter  = current;
+               fusion_core_wq_wait( fusion_core, &fusionee->wait_receive, &dev->lock, NULL, true );
+               fusionee->waiter  = NULL;
                fusionee->waiting = false;
 
                if (signal_pending(current))
@@ -744,30 +1325,71 @@ fusionee_get_messages(FusionDev * dev,
           }
      }
 
-     while (fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush) {
+     /* Messages in the ring come first. */
+     if (!Fusionee_RingEmpty( fusionee )) {
+          flush_packets(fusionee, dev, &prev_packets);
+          return 0;
+     }
+
+     while (buf_size && fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush) {
           Packet *packet = (Packet *) fusionee->packets.items;
-          int     bytes  = packet->size;
+          size_t  offset = fusionee->read_offset;
+          size_t  bytes  = packet->size - offset;
 
           D_MAGIC_ASSERT( packet, Packet );
 
-          if (bytes > buf_size) {
-               if (!written) {
-                    flush_packets(fusionee, dev, &prev_packets);
-                    return -EMSGSIZE;
+          if (fusionee->read_remaining) {
+               /* Continue a message that didn't fit into the buffer or spans multiple packets. */
+               bytes = min_t( size_t, bytes, min_t( size_t, fusionee->read_remaining, buf_size ) );
+          }
+          else if (bytes > buf_size || packet->spill) {
+               FusionReadMessage *header = (FusionReadMessage *)( packet->buf + offset );
+               size_t             length = Message_Size( header->msg_size, 0 );
+
+               /* A packet spilling into the following ones holds only the message being continued. */
+               FUSION_ASSERT( !packet->spill || length == packet->size - offset + packet->spill );
+
+               if (length > buf_size) {
+                    if (written)
+                         break;
+
+                    /* Return the message in pieces. */
+                    fusionee->read_remaining = length;
+                    continue;
                }
 
-               break;
+               /* Fits into the buffer, read it completely from all of its packets. */
+               if (packet->spill) {
+                    fusionee->read_remaining = length;
+                    continue;
+               }
+
+               bytes = length;
           }
 
-          if (copy_to_user(buf, packet->buf, packet->size)) {
+          if (copy_to_user(buf, packet->buf + offset, bytes)) {
                flush_packets(fusionee, dev, &prev_packets);
                return -EFAULT;
           }
 
-          written += bytes;
-          buf += bytes;
+          written  += bytes;
+          buf      += bytes;
           buf_size -= bytes;
 
+          if (fusionee->read_remaining)
+               fusionee->read_remaining -= bytes;
+
+          fusionee->read_offset += bytes;
+
+          if (fusionee->read_offset < packet->size)
+               continue;
+
+          /* Packet completely read, the last message may continue in the next one. */
+          if (!fusionee->read_remaining)
+               fusionee->read_remaining = packet->spill;
+
+          fusionee->read_offset = 0;
+
           fusion_fifo_get(&fusionee->packets);
 
           D_MAGIC_ASSERT( packet, Packet );
@@ -813,15 +1435,15 @@ fusionee_wait_processing(FusionDev * dev,
                }
           }
 
-          /* Really no more packet of that type and ID? */
-          if (!packet)
+          /* Really no more packet of that type and ID? The ring is not searched, it has to be empty. */
+          if (!packet && Fusionee_RingEmpty( fusionee ))
                break;
 
           if (fusionee->dispatcher_pid)
                FUSION_ASSUME(fusionee->dispatcher_pid != fusion_core_pid( fusion_core ));
 
           /* Otherwise unlock and wait. */
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, 0, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, 0, true );
 
           if (signal_pending(current))
                return -EINTR;
@@ -848,7 +1470,7 @@ fusionee_remove_message_callbacks(Fusionee  *fusionee,
                     fusion_list_remove( &packet->callbacks.items, &callback->link );
                     packet->callbacks.count--;
 
-                    fusion_core_free( fusion_core, callback );
+                    fusion_core_cache_free( fusion_core, callback_cache, callback );
                }
           }
      }
@@ -862,7 +1484,7 @@ fusionee_remove_message_callbacks(Fusionee  *fusionee,
                     fusion_list_remove( &packet->callbacks.items, &callback->link );
                     packet->callbacks.count--;
 
-                    fusion_core_free( fusion_core, callback );
+                    fusion_core_cache_free( fusion_core, callback_cache, callback );
                }
           }
      }
@@ -883,7 +1505,7 @@ fusionee_poll( FusionDev                *dev,
 
      poll_wait( file, &fusionee->wait_receive.queue, wait );
 
-     if (fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush)
+     if ((fusionee->packets.count && ((Packet *) fusionee->packets.items)->flush) || !Fusionee_RingEmpty( fusionee ))
           mask |= POLLIN | POLLRDNORM;
 
      return mask;
@@ -895,7 +1517,7 @@ fusionee_sync( FusionDev *dev,
 {
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     while (fusionee->packets.count || fusionee->prev_packets.count || !fusionee->waiting) {
+     while (fusionee->packets.count || fusionee->prev_packets.count || !fusionee->waiting || !Fusionee_RingEmpty( fusionee )) {
           if (fusionee->packets.count) {
                Packet *packet = (Packet*) direct_list_last( fusionee->packets.items );
 
@@ -908,8 +1530,12 @@ fusionee_sync( FusionDev *dev,
                     wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
                }
           }
+          else if (fusionee->waiting && !Fusionee_RingEmpty( fusionee )) {
+               /* Queued messages in the ring */
+               wake_up_interruptible_sync_poll( &fusionee->wait_receive.queue, POLLIN | POLLRDNORM );
+          }
 
-          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, NULL, true );
+          fusion_core_wq_wait( fusion_core, &fusionee->wait_process, &dev->lock, NULL, true );
 
           if (signal_pending(current))
                return -EINTR;
@@ -977,12 +1603,12 @@ fusionee_kill(FusionDev * dev,
                          /* fall through */
 
                     default:
-                         fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, &timeout, true );
+                         fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, &dev->lock, &timeout, true );
                          break;
                }
           }
           else
-               fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, NULL, true );
+               fusion_core_wq_wait( fusion_core, &dev->fusionee.wait, &dev->lock, NULL, true );
 
           if (signal_pending(current))
                return -EINTR;
@@ -1008,8 +1634,46 @@ fusionee_unref( Fusionee * fusionee )
 
      FUSION_ASSERT( fusionee->refs > 0 );
 
-     if (!--fusionee->refs)
+     if (!--fusionee->refs) {
+          fusion_counters_deinit( &fusionee->ref_counters );
+
+          if (fusionee->ring)
+               vfree( fusionee->ring );
+
+          if (fusionee->call_ring)
+               vfree( fusionee->call_ring );
+
           fusion_core_free( fusion_core,  fusionee );
+     }
+}
+
+
+/*
+ * Links of a former id, e.g. before entering again, are skipped by the teardown
+ * above. Move them to the unowned lists, their objects outlive the fusionee.
+ */
+static void disown_remaining(FusionDev * dev, Fusionee * fusionee)
+{
+     int  type;
+     bool exclusive = fusion_dev_exclusive( dev );
+
+     if (!exclusive)
+          fusion_core_lock_acquire( fusion_core, &dev->fusionee.owned_lock );
+
+     for (type = 0; type < FUSIONEE_OWNED_NUM; type++) {
+          while (fusionee->owned[type]) {
+               FusioneeOwnedLink *link = (FusioneeOwnedLink *) fusionee->owned[type];
+
+               fusion_list_remove( &fusionee->owned[type], &link->link );
+
+               link->list = &dev->fusionee.unowned[type];
+
+               fusion_list_prepend( link->list, &link->link );
+          }
+     }
+
+     if (!exclusive)
+          fusion_core_lock_release( fusion_core, &dev->fusionee.owned_lock );
 }
 
 
@@ -1026,9 +1690,12 @@ void fusionee_destroy(FusionDev * dev, Fusionee * fusionee)
      prev_packets = fusionee->prev_packets;
      packets      = fusionee->packets;
 
-     /* Remove from list. */
+     /* Remove from list and index. */
      direct_list_remove(&dev->fusionee.list, &fusionee->link);
 
+     if (fusionee->id)
+          fusion_hash_remove( dev->fusionee.ids, (void*)(long) fusionee->id, NULL, NULL );
+
      /* Wake up waiting killer. */
      fusion_core_wq_wake( fusion_core, &dev->fusionee.wait);
 
@@ -1036,15 +1703,19 @@ void fusionee_destroy(FusionDev * dev, Fusionee * fusionee)
      fusion_skirmish_dismiss_all(dev, fusionee->id);
      fusion_skirmish_return_all_from(dev, fusionee->id);
      fusion_call_destroy_all(dev, fusionee);
-     fusion_reactor_detach_all(dev, fusionee->id);
-     fusion_property_cede_all(dev, fusionee->id);
-     fusion_ref_clear_all_local(dev, fusionee->id);
-     fusion_shmpool_detach_all(dev, fusionee->id);
+     fusion_reactor_detach_all(dev, fusionee);
+     fusion_property_cede_all(dev, fusionee);
+     fusion_ref_clear_all_local(dev, fusionee);
+     fusion_shmpool_detach_all(dev, fusionee);
+
+     disown_remaining(dev, fusionee);
 
      /* Free all pending messages. */
      flush_packets(fusionee, dev, &prev_packets);
      flush_packets(fusionee, dev, &packets);
 
+     atomic_sub( fusionee->free_packets.count, &dev->pooled );
+
      free_packets(fusionee, dev, &fusionee->free_packets);
 
      /* Free fusionee data. */
@@ -1065,24 +1736,83 @@ FusionID fusionee_id(const Fusionee * fusionee)
      return fusionee->id;
 }
 
-pid_t fusionee_dispatcher_pid(FusionDev * dev, FusionID fusion_id)
+void fusionee_own(FusionDev * dev, FusionID fusion_id, FusioneeOwnedType type,
+                  FusioneeOwnedLink * link, FusionEntry * entry)
 {
      Fusionee *fusionee;
-     int ret = -EINVAL;
 
-     direct_list_foreach(fusionee, dev->fusionee.list) {
-          D_MAGIC_ASSERT( fusionee, Fusionee );
+     if (!fusion_id || lookup_fusionee(dev, fusion_id, &fusionee))
+          fusionee = NULL;
 
-          if (fusionee->id == fusion_id) {
-               /* FIXME: wait for it? */
-               FUSION_ASSUME(fusionee->dispatcher_pid != 0);
+     fusionee_own_by(dev, fusionee, type, link, entry);
 
-               ret = fusionee->dispatcher_pid;
-               break;
-          }
-     }
+     link->fusion_id = fusion_id;
+}
+
+void fusionee_own_by(FusionDev * dev, Fusionee * fusionee, FusioneeOwnedType type,
+                     FusioneeOwnedLink * link, FusionEntry * entry)
+{
+     bool exclusive = fusion_dev_exclusive( dev );
+
+     FUSION_ASSERT( type < FUSIONEE_OWNED_NUM );
+     FUSION_ASSERT( link->list == NULL );
+
+     link->list      = fusionee ? &fusionee->owned[type] : &dev->fusionee.unowned[type];
+     link->fusion_id = fusionee ? fusionee->id : 0;
+     link->entry     = entry;
 
-     return ret;
+     /* Objects of other fusionees may be linked concurrently in shared locking mode. */
+     if (!exclusive)
+          fusion_core_lock_acquire( fusion_core, &dev->fusionee.owned_lock );
+
+     fusion_list_prepend( link->list, &link->link );
+
+     if (!exclusive)
+          fusion_core_lock_release( fusion_core, &dev->fusionee.owned_lock );
+}
+
+void fusionee_disown(FusionDev * dev, FusioneeOwnedLink * link)
+{
+     bool exclusive = fusion_dev_exclusive( dev );
+
+     if (!link->list)
+          return;
+
+     if (!exclusive)
+          fusion_core_lock_acquire( fusion_core, &dev->fusionee.owned_lock );
+
+     fusion_list_remove( link->list, &link->link );
+
+     if (!exclusive)
+          fusion_core_lock_release( fusion_core, &dev->fusionee.owned_lock );
+
+     link->list = NULL;
+}
+
+FusionLink *fusionee_owned(FusionDev * dev, Fusionee * fusionee, FusioneeOwnedType type)
+{
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     FUSION_ASSERT( fusion_dev_exclusive( dev ) );
+
+     /* Objects created before entering are shared by all fusionees not entered. */
+     if (!fusionee->id && type != FUSIONEE_OWNED_CALLS)
+          return dev->fusionee.unowned[type];
+
+     return fusionee->owned[type];
+}
+
+pid_t fusionee_dispatcher_pid(FusionDev * dev, FusionID fusion_id)
+{
+     Fusionee *fusionee;
+
+     if (lookup_fusionee(dev, fusion_id, &fusionee))
+          return -EINVAL;
+
+     /* FIXME: wait for it? */
+     FUSION_ASSUME(fusionee->dispatcher_pid != 0);
+
+     return fusionee->dispatcher_pid;
 }
 
 /******************************************************************************/
@@ -1092,16 +1822,18 @@ lookup_fusionee(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
 {
      Fusionee *fusionee;
 
-     direct_list_foreach(fusionee, dev->fusionee.list) {
-          D_MAGIC_ASSERT( fusionee, Fusionee );
+     if (!id)
+          return -EINVAL;
 
-          if (fusionee->id == id) {
-               *ret_fusionee = fusionee;
-               return 0;
-          }
-     }
+     fusionee = fusion_hash_lookup( dev->fusionee.ids, (void*)(long) id );
+     if (!fusionee)
+          return -EINVAL;
 
-     return -EINVAL;
+     D_MAGIC_ASSERT( fusionee, Fusionee );
+
+     *ret_fusionee = fusionee;
+
+     return 0;
 }
 
 static int lock_fusionee(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
@@ -1115,8 +1847,6 @@ static int lock_fusionee(FusionDev * dev, FusionID id, Fusionee ** ret_fusionee)
 
      D_MAGIC_ASSERT( fusionee, Fusionee );
 
-     direct_list_move_to_front(&dev->fusionee.list, &fusionee->link);
-
      *ret_fusionee = fusionee;
 
      return 0;
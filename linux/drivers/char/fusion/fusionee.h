@@ -44,6 +44,8 @@ struct __Fusion_Fusionee {
      FusionWaitQueue wait_receive;
      FusionWaitQueue wait_process;
      bool            waiting;
+     struct task_struct *waiter;        /* Task waiting to receive, for direct handoff of calls. */
+     unsigned int    busy_poll;         /* Microseconds to spin before waiting to receive. */
 
      bool force_slave;
 
@@ -56,6 +58,28 @@ struct __Fusion_Fusionee {
      char exe_file[PATH_MAX];
 
      int            wait_on_call_quota;
+
+     FusionCounters ref_counters;       /* Local reference counts shared with user space. */
+
+     size_t             read_offset;    /* Bytes of the first packet already read. */
+     size_t             read_remaining; /* Bytes of a partially read message still to be read. */
+
+     FusionReceiveRing *ring;           /* Receive ring mapped by user space, NULL if not enabled. */
+     unsigned int       ring_size;      /* Size of the data area, kernel copy. */
+     unsigned int       ring_head;      /* Head of the ring, kernel copy. */
+
+     FusionCallRing    *call_ring;      /* Call rings mapped by user space, NULL if not enabled. */
+     unsigned int       call_ring_entries;   /* Number of entries of each queue, kernel copy. */
+     unsigned int       call_ring_sq_head;   /* Head of the submission queue, kernel copy. */
+     unsigned int       call_ring_cq_tail;   /* Tail of the completion queue, kernel copy. */
+     unsigned int       call_ring_pending;   /* Calls sent via the ring, but not completed yet. */
+
+     FusionLink        *call_async;     /* Asynchronous executions of calls, see call.c */
+     unsigned int       call_handle;    /* Last handle of an execution started with FCEF_ASYNC. */
+     FusionLink        *call_blocks;    /* Blocks allocated in the call arena. */
+     FusionWaitQueue    wait_call;      /* Woken up when an asynchronous execution returns. */
+
+     FusionLink        *owned[FUSIONEE_OWNED_NUM];    /* see fusionee_own() */
 };
 
 
@@ -73,6 +97,9 @@ typedef enum {
 int fusionee_init(FusionDev * dev);
 void fusionee_deinit(FusionDev * dev);
 
+/* frees up to 'nr' pooled packets of all fusionees, returns the number freed */
+int fusionee_shrink(FusionDev * dev, int nr);
+
 /* internal functions */
 
 int fusionee_new(FusionDev * dev, bool force_slave, Fusionee ** ret_fusionee);
@@ -98,6 +125,18 @@ int fusionee_send_message(FusionDev * dev,
                           void *callback_ctx, int callback_param,
                           const void *extra_data, unsigned int extra_size);
 
+/* like fusionee_send_message(), but 'msg_data' is always in kernel space */
+int fusionee_send_kernel_message(FusionDev * dev,
+                                 Fusionee * sender,
+                                 FusionID recipient,
+                                 FusionMessageType msg_type,
+                                 int msg_id,
+                                 int msg_channel,
+                                 int msg_size,
+                                 const void *msg_data,
+                                 FusionMessageCallback callback,
+                                 void *callback_ctx, int callback_param);
+
 int fusionee_send_message2(FusionDev * dev,
                            Fusionee * sender,
                            Fusionee * recipient,
@@ -129,6 +168,9 @@ int fusionee_poll(FusionDev * dev,
 int fusionee_sync(FusionDev *dev,
                   Fusionee  *fusionee);
 
+int fusionee_ring_mmap(FusionDev * dev,
+                       Fusionee * fusionee, struct vm_area_struct *vma);
+
 int fusionee_kill(FusionDev * dev,
                   Fusionee * fusionee,
                   FusionID target, int signal, int timeout_ms);
@@ -137,6 +179,22 @@ void fusionee_destroy(FusionDev * dev, Fusionee * fusionee);
 
 FusionID fusionee_id(const Fusionee * fusionee);
 
+/*
+ * Ownership lists let teardown and fork visit only the objects of a fusionee.
+ *
+ * Objects are linked by the fusion id they were created for, calls by their owner.
+ */
+void fusionee_own(FusionDev * dev, FusionID fusion_id, FusioneeOwnedType type,
+                  FusioneeOwnedLink * link, FusionEntry * entry);
+
+void fusionee_own_by(FusionDev * dev, Fusionee * fusionee, FusioneeOwnedType type,
+                     FusioneeOwnedLink * link, FusionEntry * entry);
+
+void fusionee_disown(FusionDev * dev, FusioneeOwnedLink * link);
+
+/* requires the world to be locked exclusively */
+FusionLink *fusionee_owned(FusionDev * dev, Fusionee * fusionee, FusioneeOwnedType type);
+
 pid_t fusionee_dispatcher_pid(FusionDev * dev, FusionID fusion_id);
 
 
@@ -0,0 +1,643 @@
+/*
+   (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+   (c) Copyright 2002-2004  Convergence (integrated media) GmbH
+
+   All rights reserved.
+
+   Written by Denis Oliver Kropp <dok@directfb.org>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version
+   2 of the License, or (at your option) any later version.
+*/
+
+#include <linux/version.h>
+#include <linux/module.h>
+#ifdef HAVE_LINUX_CONFIG_H
+#include <linux/config.h>
+#endif
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4, 0, 0)
+#include <generated/autoconf.h>
+#endif
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+
+#include "debug.h"
+
+#include "fusioncore.h"
+
+
+/*
+ * Small blocks are allocated with the size of their class, which ksize() tells
+ * again when they're freed. While cached, a block links to the next free one.
+ */
+typedef struct __Fusion_FusionCoreBlock FusionCoreBlock;
+
+struct __Fusion_FusionCoreBlock {
+     FusionCoreBlock    *next;
+};
+
+/* cores by index, those without own pointers use the ones of core zero */
+static FusionCore *fusion_cores[FUSION_CORE_MAX_CPUS];
+
+
+static inline unsigned int
+size_class( size_t size )
+{
+     unsigned int i;
+
+     for (i = 0; i < FUSION_CORE_CACHE_CLASSES; i++) {
+          if (size <= (32 << i))
+               return i;
+     }
+
+     return FUSION_CORE_CACHE_CLASSES;
+}
+
+static void
+drain_caches( FusionCore *core )
+{
+     int cpu;
+
+     for_each_possible_cpu (cpu) {
+          unsigned int     i;
+          FusionCoreCache *cache = per_cpu_ptr( core->caches, cpu );
+
+          for (i = 0; i < FUSION_CORE_CACHE_CLASSES; i++) {
+               FusionCoreBlock *block = cache->blocks[i];
+
+               while (block) {
+                    FusionCoreBlock *next = block->next;
+
+                    kfree( block );
+
+                    block = next;
+               }
+
+               cache->blocks[i] = NULL;
+               cache->count[i]  = 0;
+          }
+     }
+}
+
+
+FusionCoreResult
+fusion_core_enter( int          cpu_index,
+                   FusionCore **ret_core )
+{
+     FusionCore *core;
+
+     D_ASSERT( ret_core != NULL );
+
+     if (cpu_index < 0 || cpu_index >= FUSION_CORE_MAX_CPUS)
+          return FC_FAILURE;
+
+     core = kzalloc( sizeof(FusionCore), GFP_KERNEL );
+     if (!core)
+          return FC_FAILURE;
+
+     core->caches = alloc_percpu( FusionCoreCache );
+     if (!core->caches) {
+          kfree( core );
+          return FC_FAILURE;
+     }
+
+     core->cpu_index = cpu_index;
+
+     D_MAGIC_SET( core, FusionCore );
+
+     fusion_core_lock_init( core, &core->lock );
+
+     fusion_cores[cpu_index] = core;
+
+     *ret_core = core;
+
+     return FC_OK;
+}
+
+void
+fusion_core_exit( FusionCore *core )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     fusion_cores[core->cpu_index] = NULL;
+
+     drain_caches( core );
+
+     free_percpu( core->caches );
+
+     fusion_core_lock_deinit( core, &core->lock );
+
+     D_MAGIC_CLEAR( core );
+
+     kfree( core );
+}
+
+/*
+ * The pid is not truncated, PID_MAX_LIMIT leaves enough room for the core index.
+ */
+pid_t
+fusion_core_pid( FusionCore *core )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     return (core->cpu_index << FUSION_CORE_PID_SHIFT) | current->pid;
+}
+
+
+/*
+ * Small blocks are recycled via a cache per CPU, without taking any lock.
+ * Interrupts are disabled while using the cache, because memory may also be freed from RCU callbacks.
+ */
+void *
+fusion_core_malloc( FusionCore *core,
+                    size_t      size )
+{
+     unsigned long    flags;
+     unsigned int     index;
+     FusionCoreBlock *block = NULL;
+
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     index = size_class( size );
+
+     if (index < FUSION_CORE_CACHE_CLASSES) {
+          FusionCoreCache *cache;
+
+          local_irq_save( flags );
+
+          cache = this_cpu_ptr( core->caches );
+
+          block = cache->blocks[index];
+          if (block) {
+               cache->blocks[index] = block->next;
+               cache->count[index]--;
+          }
+
+          local_irq_restore( flags );
+
+          if (!block)
+               block = kmalloc( 32 << index, GFP_KERNEL );
+     }
+     else
+          block = kmalloc( size, GFP_KERNEL );
+
+     if (!block)
+          return NULL;
+
+     memset( block, 0, size );
+
+     return block;
+}
+
+void
+fusion_core_free( FusionCore *core,
+                  void       *ptr )
+{
+     unsigned long    flags;
+     unsigned int     index;
+     FusionCoreBlock *block = ptr;
+
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     if (!ptr)
+          return;
+
+     index = size_class( ksize( ptr ) );
+
+     if (index < FUSION_CORE_CACHE_CLASSES) {
+          FusionCoreCache *cache;
+
+          local_irq_save( flags );
+
+          cache = this_cpu_ptr( core->caches );
+
+          if (cache->count[index] < FUSION_CORE_CACHE_DEPTH) {
+               block->next = cache->blocks[index];
+
+               cache->blocks[index] = block;
+               cache->count[index]++;
+
+               block = NULL;
+          }
+
+          local_irq_restore( flags );
+     }
+
+     kfree( block );
+}
+
+
+void
+fusion_core_set_pointer( FusionCore      *core,
+                         unsigned int     index,
+                         void            *ptr )
+{
+     FUSION_DEBUG( "%s( %p, index %d, ptr %p )\n", __FUNCTION__, core, index, ptr );
+
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     D_ASSERT( index < FUSION_CORE_POINTERS );
+
+     core->pointers[index] = ptr;
+}
+
+void *
+fusion_core_get_pointer( FusionCore      *core,
+                         unsigned int     index )
+{
+     void *ptr;
+
+     FUSION_DEBUG( "%s( %p, index %d )\n", __FUNCTION__, core, index );
+
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     D_ASSERT( index < FUSION_CORE_POINTERS );
+
+     ptr = core->pointers[index];
+
+     if (!ptr && core->cpu_index && fusion_cores[0])
+          ptr = fusion_cores[0]->pointers[index];
+
+     FUSION_DEBUG( "  -> returning %p\n", ptr );
+
+     return ptr;
+}
+
+
+FusionCoreResult
+fusion_core_cache_create( FusionCore   *core,
+                          const char   *name,
+                          size_t        size,
+                          FusionCache **ret_cache )
+{
+     FusionCache *cache;
+
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_ASSERT( ret_cache != NULL );
+
+     cache = kmalloc( sizeof(FusionCache), GFP_KERNEL );
+     if (!cache)
+          return FC_FAILURE;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 23)
+     cache->slab = kmem_cache_create( name, size, 0, SLAB_HWCACHE_ALIGN, NULL );
+#else
+     cache->slab = kmem_cache_create( name, size, 0, SLAB_HWCACHE_ALIGN, NULL, NULL );
+#endif
+     if (!cache->slab) {
+          kfree( cache );
+          return FC_FAILURE;
+     }
+
+     D_MAGIC_SET( cache, FusionCache );
+
+     *ret_cache = cache;
+
+     return FC_OK;
+}
+
+void
+fusion_core_cache_destroy( FusionCore  *core,
+                           FusionCache *cache )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     kmem_cache_destroy( cache->slab );
+
+     D_MAGIC_CLEAR( cache );
+
+     kfree( cache );
+}
+
+void *
+fusion_core_cache_alloc( FusionCore  *core,
+                         FusionCache *cache )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     return kmem_cache_zalloc( cache->slab, GFP_KERNEL );
+}
+
+void
+fusion_core_cache_free( FusionCore  *core,
+                        FusionCache *cache,
+                        void        *ptr )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     if (ptr)
+          kmem_cache_free( cache->slab, ptr );
+}
+
+
+void
+fusion_core_lock( FusionCore *core )
+{
+     fusion_core_lock_acquire( core, &core->lock );
+}
+
+void
+fusion_core_unlock( FusionCore *core )
+{
+     fusion_core_lock_release( core, &core->lock );
+}
+
+
+FusionCoreResult
+fusion_core_lock_init( FusionCore *core,
+                       FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     memset( lock, 0, sizeof(FusionLock) );
+
+     init_rwsem( &lock->sem );
+
+     D_MAGIC_SET( lock, FusionLock );
+
+     return FC_OK;
+}
+
+void
+fusion_core_lock_deinit( FusionCore *core,
+                         FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     D_MAGIC_CLEAR( lock );
+}
+
+void
+fusion_core_lock_acquire( FusionCore *core,
+                          FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     down_write( &lock->sem );
+
+     lock->owner = current;
+}
+
+bool
+fusion_core_lock_tryacquire( FusionCore *core,
+                             FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     if (!down_write_trylock( &lock->sem ))
+          return false;
+
+     lock->owner = current;
+
+     return true;
+}
+
+void
+fusion_core_lock_acquire_shared( FusionCore *core,
+                                 FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     down_read( &lock->sem );
+}
+
+void
+fusion_core_lock_release( FusionCore *core,
+                          FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     if (lock->owner == current) {
+          lock->owner = NULL;
+
+          up_write( &lock->sem );
+     }
+     else
+          up_read( &lock->sem );
+}
+
+bool
+fusion_core_lock_exclusive( FusionCore *core,
+                            FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     return lock->owner == current;
+}
+
+
+FusionCoreResult
+fusion_core_wq_init( FusionCore      *core,
+                     FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     memset( queue, 0, sizeof(FusionWaitQueue) );
+
+     init_waitqueue_head( &queue->queue );
+
+     D_MAGIC_SET( queue, FusionWaitQueue );
+
+     return FC_OK;
+}
+
+void
+fusion_core_wq_deinit( FusionCore      *core,
+                       FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+     D_MAGIC_CLEAR( queue );
+}
+
+static inline void
+relock( FusionCore *core,
+        FusionLock *lock,
+        bool        exclusive )
+{
+     if (exclusive)
+          fusion_core_lock_acquire( core, lock );
+     else
+          fusion_core_lock_acquire_shared( core, lock );
+}
+
+static void
+wq_wait( FusionCore      *core,
+         FusionWaitQueue *queue,
+         FusionLock      *outer,
+         FusionLock      *inner,
+         int             *timeout_ms,
+         bool             interruptible,
+         bool             exclusive,
+         struct task_struct *handoff )
+{
+     bool outer_exclusive = fusion_core_lock_exclusive( core, outer );
+     bool inner_exclusive = inner && fusion_core_lock_exclusive( core, inner );
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+     DEFINE_WAIT(wait);
+
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+     if (exclusive)
+          prepare_to_wait_exclusive( &queue->queue, &wait, interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE );
+     else
+          prepare_to_wait( &queue->queue, &wait, interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE );
+
+     if (inner)
+          fusion_core_lock_release( core, inner );
+
+     fusion_core_lock_release( core, outer );
+
+     if (timeout_ms)
+          *timeout_ms = schedule_timeout(*timeout_ms);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+     /* Yielding schedules away already, unless the task is running or can't be yielded to. */
+     else if (!handoff || yield_to( handoff, true ) <= 0)
+          schedule();
+#else
+     else
+          schedule();
+#endif
+
+     finish_wait( &queue->queue, &wait );
+
+     relock( core, outer, outer_exclusive );
+
+     if (inner)
+          relock( core, inner, inner_exclusive );
+#else
+     wait_queue_t wait;
+
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+     init_waitqueue_entry(&wait, current);
+
+     current->state = interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE;
+
+     write_lock( &queue->queue.lock);
+     if (exclusive) {
+          wait.flags |= WQ_FLAG_EXCLUSIVE;
+          __add_wait_queue_tail( &queue->queue, &wait);
+     }
+     else
+          __add_wait_queue( &queue->queue, &wait);
+     write_unlock( &queue->queue.lock );
+
+     if (inner)
+          fusion_core_lock_release( core, inner );
+
+     fusion_core_lock_release( core, outer );
+
+     if (timeout_ms)
+          *timeout_ms = schedule_timeout(*timeout_ms);
+     else
+          schedule();
+
+     relock( core, outer, outer_exclusive );
+
+     if (inner)
+          relock( core, inner, inner_exclusive );
+
+     write_lock( &queue->queue.lock );
+     __remove_wait_queue( &queue->queue, &wait );
+     write_unlock( &queue->queue.lock );
+#endif
+}
+
+void
+fusion_core_wq_wait_nested( FusionCore      *core,
+                            FusionWaitQueue *queue,
+                            FusionLock      *outer,
+                            FusionLock      *inner,
+                            int             *timeout_ms,
+                            bool             interruptible )
+{
+     wq_wait( core, queue, outer, inner, timeout_ms, interruptible, false, NULL );
+}
+
+void
+fusion_core_wq_wait( FusionCore      *core,
+                     FusionWaitQueue *queue,
+                     FusionLock      *lock,
+                     int             *timeout_ms,
+                     bool             interruptible )
+{
+     wq_wait( core, queue, lock, NULL, timeout_ms, interruptible, false, NULL );
+}
+
+void
+fusion_core_wq_wait_exclusive( FusionCore      *core,
+                               FusionWaitQueue *queue,
+                               FusionLock      *lock,
+                               int             *timeout_ms,
+                               bool             interruptible )
+{
+     wq_wait( core, queue, lock, NULL, timeout_ms, interruptible, true, NULL );
+}
+
+void
+fusion_core_wq_wait_handoff( FusionCore         *core,
+                             FusionWaitQueue    *queue,
+                             FusionLock         *lock,
+                             struct task_struct *task,
+                             bool                interruptible )
+{
+     wq_wait( core, queue, lock, NULL, NULL, interruptible, false, task );
+}
+
+void
+fusion_core_wq_wake( FusionCore      *core,
+                     FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+     wake_up_all( &queue->queue );
+}
+
+void
+fusion_core_wq_wake_one( FusionCore      *core,
+                         FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+     wake_up( &queue->queue );
+}
+
+void
+fusion_core_wq_wake_sync( FusionCore      *core,
+                          FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+     __wake_up_sync( &queue->queue, TASK_NORMAL );
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+     __wake_up_sync( &queue->queue, TASK_NORMAL, 1 );
+#else
+     wake_up_all( &queue->queue );
+#endif
+}
+
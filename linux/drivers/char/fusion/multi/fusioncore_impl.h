@@ -0,0 +1,85 @@
+/*
+   (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+   (c) Copyright 2002-2004  Convergence (integrated media) GmbH
+
+   All rights reserved.
+
+   Written by Denis Oliver Kropp <dok@directfb.org>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version
+   2 of the License, or (at your option) any later version.
+*/
+
+#ifndef __FUSION__FUSIONCORE_IMPL_H__
+#define __FUSION__FUSIONCORE_IMPL_H__
+
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 26)
+#include <linux/semaphore.h>
+#else
+#include <asm/semaphore.h>
+#endif
+
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+
+
+#define FUSION_CORE_PID_SHIFT        22         /* PID_MAX_LIMIT is 4M */
+#define FUSION_CORE_MAX_CPUS         (1 << (31 - FUSION_CORE_PID_SHIFT))
+
+#define FUSION_CORE_POINTERS         10
+
+#define FUSION_CORE_CACHE_CLASSES    6          /* 32, 64, ... 1024 bytes including the header */
+#define FUSION_CORE_CACHE_DEPTH      64         /* maximum number of free blocks per class and CPU */
+
+
+typedef struct {
+     int                 magic;
+
+     struct rw_semaphore sem;
+     struct task_struct *owner;     /* holder of the exclusive lock */
+} FusionLock;
+
+
+typedef struct {
+     int                 magic;
+
+     struct kmem_cache  *slab;
+} FusionCache;
+
+
+/*
+ * Free blocks of each size class, one per CPU.
+ */
+typedef struct {
+     void               *blocks[FUSION_CORE_CACHE_CLASSES];
+     unsigned int        count[FUSION_CORE_CACHE_CLASSES];
+} FusionCoreCache;
+
+
+struct __Fusion_FusionCore {
+     int                 magic;
+
+     int                 cpu_index;
+
+     FusionLock          lock;
+
+     void               *pointers[FUSION_CORE_POINTERS];
+
+     FusionCoreCache __percpu *caches;
+};
+
+
+typedef struct {
+     int                 magic;
+
+     wait_queue_head_t   queue;
+} FusionWaitQueue;
+
+
+#endif
@@ -34,6 +34,7 @@
 #include "fusionee.h"
 #include "list.h"
 #include "property.h"
+#include "slots.h"
 
 typedef enum {
      FUSION_PROPERTY_AVAILABLE = 0,
@@ -49,6 +50,11 @@ typedef struct {
      unsigned long purchase_stamp;
      int lock_pid;
      int count;          /* lock counter */
+
+     FusionSlot *slot;   /* non-NULL if shared with user space */
+
+     FusioneeOwnedLink holder;     /* in the list of the last fusionee holding it */
+     FusionLink sharing;           /* in the list of properties having a slot */
 } FusionProperty;
 
 static void
@@ -65,15 +71,105 @@ fusion_property_print(FusionEntry * entry, void *ctx, struct seq_file *p)
           return;
      }
 
+     if (property->slot && property->slot->state && !(property->slot->state & FUSION_SLOT_KERNEL)) {
+          seq_printf(p, "leased by 0x%08x (%d) %dx (shared)\n",
+                     FUSION_SLOT_FUSION_ID(property->slot->state),
+                     (int)(property->slot->state & FUSION_SLOT_TID_MASK),
+                     property->slot->count);
+          return;
+     }
+
      seq_printf(p, "\n");
 }
 
-FUSION_ENTRY_CLASS(FusionProperty, property, NULL, NULL, fusion_property_print)
+static void
+fusion_property_destruct(FusionEntry * entry, void *ctx)
+{
+     FusionProperty *property = (FusionProperty *) entry;
+     FusionDev      *dev      = (FusionDev *) ctx;
+
+     fusionee_disown(dev, &property->holder);
+
+     if (property->slot) {
+          fusion_list_remove(&dev->shared_properties, &property->sharing);
+
+          fusion_slot_free(dev, property->slot);
+     }
+}
+
+FUSION_ENTRY_CLASS(FusionProperty, property, NULL, fusion_property_destruct, fusion_property_print)
+
+/******************************************************************************/
+
+/*
+ * Take over a lease of a shared property held in user space by the thread or fusionee.
+ */
+static void
+slot_sync_in(FusionProperty * property, int pid, FusionID fusion_id)
+{
+     int lock_pid;
+     int lock_fid;
+     int count;
+
+     if (fusion_slot_take(property->slot, pid, fusion_id, &lock_pid, &lock_fid, &count)) {
+          property->state     = FUSION_PROPERTY_LEASED;
+          property->fusion_id = lock_fid;
+          property->lock_pid  = lock_pid;
+          property->count     = count;
+     }
+}
+
+/*
+ * Hand the state of a shared property back to user space, unless it's purchased.
+ */
+static void
+slot_sync_out(FusionProperty * property)
+{
+     FusionSlot *slot = property->slot;
+
+     if (!slot || !(slot->state & FUSION_SLOT_KERNEL))
+          return;
+
+     if (property->state == FUSION_PROPERTY_PURCHASED)
+          return;
+
+     if (property->state == FUSION_PROPERTY_LEASED)
+          fusion_slot_give(slot, property->lock_pid, property->fusion_id,
+                           property->count, property->entry.waiters > 0);
+     else
+          fusion_slot_give(slot, 0, 0, 0, false);
+
+     property->state     = FUSION_PROPERTY_AVAILABLE;
+     property->fusion_id = 0;
+     property->lock_pid  = 0;
+     property->count     = 0;
+}
+
+/*
+ * Link a property held in the kernel to the fusionee holding it, see fusion_property_cede_all().
+ *
+ * The link is left in place when the property is ceded, so repeated locking by the same
+ * fusionee doesn't touch the index. Properties having a slot are found via their own list.
+ */
+static void
+property_index(FusionDev * dev, FusionProperty * property)
+{
+     if (property->holder.list && property->holder.fusion_id == property->fusion_id)
+          return;
+
+     fusionee_disown(dev, &property->holder);
+
+     fusionee_own(dev, property->fusion_id, FUSIONEE_OWNED_PROPERTIES, &property->holder, &property->entry);
+}
 
 /******************************************************************************/
 int fusion_property_init(FusionDev * dev)
 {
-     fusion_entries_init(&dev->properties, &property_class, dev, dev);
+     int ret;
+
+     ret = fusion_entries_init(&dev->properties, &property_class, dev, dev);
+     if (ret)
+          return ret;
 
      fusion_entries_create_proc_entry(dev, "properties", &dev->properties);
 
@@ -100,26 +196,45 @@ int fusion_property_lease(FusionDev * dev, int id, int fusion_id)
      FusionProperty *property;
      int timeout = -1;
 
-     dev->stat.property_lease_purchase++;
+     atomic_inc( &dev->stat.property_lease_purchase );
 
      ret = fusion_property_lookup(&dev->properties, id, &property);
      if (ret)
           return ret;
 
+     slot_sync_in( property, fusion_core_pid( fusion_core ), 0 );
+
      while (true) {
           switch (property->state) {
                case FUSION_PROPERTY_AVAILABLE:
+                    if (fusion_slot_held( property->slot, true )) {
+                         ret = fusion_property_wait(property, NULL);
+                         if (ret)
+                              return ret;
+
+                         break;
+                    }
+
+                    if (!fusion_slot_acquire( property->slot ))
+                         break;
+
                     property->state = FUSION_PROPERTY_LEASED;
                     property->fusion_id = fusion_id;
                     property->lock_pid = fusion_core_pid( fusion_core );
                     property->count = 1;
 
+                    property_index( dev, property );
+
+                    slot_sync_out( property );
+                    fusion_property_unlock( property );
                     return 0;
 
                case FUSION_PROPERTY_LEASED:
                     if (property->lock_pid == fusion_core_pid( fusion_core )) {
                          property->count++;
 
+                         slot_sync_out( property );
+                         fusion_property_unlock( property );
                          return 0;
                     }
 
@@ -130,13 +245,17 @@ int fusion_property_lease(FusionDev * dev, int id, int fusion_id)
                     break;
 
                case FUSION_PROPERTY_PURCHASED:
-                    if (property->lock_pid == fusion_core_pid( fusion_core ))
+                    if (property->lock_pid == fusion_core_pid( fusion_core )) {
+                         fusion_property_unlock( property );
                          return -EIO;
+                    }
 
                     if (timeout == -1) {
                          // FIXME: add fusion_core_jiffies()
-                         if (jiffies - property->purchase_stamp > HZ / 10)
+                         if (jiffies - property->purchase_stamp > HZ / 10) {
+                              fusion_property_unlock( property );
                               return -EAGAIN;
+                         }
 
                          timeout = HZ / 10;
                     }
@@ -164,27 +283,46 @@ int fusion_property_purchase(FusionDev * dev, int id, int fusion_id)
      FusionProperty *property;
      int timeout = -1;
 
-     dev->stat.property_lease_purchase++;
+     atomic_inc( &dev->stat.property_lease_purchase );
 
      ret = fusion_property_lookup(&dev->properties, id, &property);
      if (ret)
           return ret;
 
+     slot_sync_in( property, fusion_core_pid( fusion_core ), 0 );
+
      while (true) {
           switch (property->state) {
                case FUSION_PROPERTY_AVAILABLE:
+                    if (fusion_slot_held( property->slot, true )) {
+                         ret = fusion_property_wait(property, NULL);
+                         if (ret)
+                              return ret;
+
+                         break;
+                    }
+
+                    if (!fusion_slot_acquire( property->slot ))
+                         break;
+
                     property->state = FUSION_PROPERTY_PURCHASED;
                     property->fusion_id = fusion_id;
                     property->purchase_stamp = jiffies;
                     property->lock_pid = fusion_core_pid( fusion_core );
                     property->count = 1;
 
+                    property_index( dev, property );
+
                     fusion_property_notify(property);
+                    fusion_property_unlock( property );
                     return 0;
 
                case FUSION_PROPERTY_LEASED:
-                    if (property->lock_pid == fusion_core_pid( fusion_core ))
+                    if (property->lock_pid == fusion_core_pid( fusion_core )) {
+                         slot_sync_out( property );
+                         fusion_property_unlock( property );
                          return -EIO;
+                    }
 
                     ret = fusion_property_wait(property, NULL);
                     if (ret)
@@ -196,12 +334,15 @@ int fusion_property_purchase(FusionDev * dev, int id, int fusion_id)
                     if (property->lock_pid == fusion_core_pid( fusion_core )) {
                          property->count++;
 
+                         fusion_property_unlock( property );
                          return 0;
                     }
 
                     if (timeout == -1) {
-                         if (jiffies - property->purchase_stamp > HZ)
+                         if (jiffies - property->purchase_stamp > HZ) {
+                              fusion_property_unlock( property );
                               return -EAGAIN;
+                         }
 
                          timeout = HZ;
                     }
@@ -229,17 +370,24 @@ int fusion_property_cede(FusionDev * dev, int id, int fusion_id)
      FusionProperty *property;
      bool purchased;
 
-     dev->stat.property_cede++;
+     atomic_inc( &dev->stat.property_cede );
 
      ret = fusion_property_lookup(&dev->properties, id, &property);
      if (ret)
           return ret;
 
-     if (property->lock_pid != fusion_core_pid( fusion_core ))
+     slot_sync_in( property, fusion_core_pid( fusion_core ), 0 );
+
+     if (property->lock_pid != fusion_core_pid( fusion_core )) {
+          fusion_property_unlock( property );
           return -EIO;
+     }
 
-     if (--property->count)
+     if (--property->count) {
+          slot_sync_out( property );
+          fusion_property_unlock( property );
           return 0;
+     }
 
      purchased = (property->state == FUSION_PROPERTY_PURCHASED);
 
@@ -249,6 +397,10 @@ int fusion_property_cede(FusionDev * dev, int id, int fusion_id)
 
      fusion_property_notify(property);
 
+     slot_sync_out( property );
+
+     fusion_property_unlock( property );
+
      return 0;
 }
 
@@ -280,19 +432,73 @@ int fusion_property_destroy(FusionDev * dev, int id)
      return fusion_entry_destroy(&dev->properties, id);
 }
 
-void fusion_property_cede_all(FusionDev * dev, int fusion_id)
+static void
+cede_property(FusionProperty * property, FusionID fusion_id)
 {
-     FusionLink *l;
+     slot_sync_in( property, 0, fusion_id );
 
-     fusion_list_foreach(l, dev->properties.list) {
-          FusionProperty *property = (FusionProperty *) l;
+     if (property->fusion_id == fusion_id) {
+          property->state = FUSION_PROPERTY_AVAILABLE;
+          property->fusion_id = 0;
+          property->lock_pid = 0;
 
-          if (property->fusion_id == fusion_id) {
-               property->state = FUSION_PROPERTY_AVAILABLE;
-               property->fusion_id = 0;
-               property->lock_pid = 0;
+          fusion_core_wq_wake( fusion_core, &property->entry.wait);
+     }
 
-               fusion_core_wq_wake( fusion_core, &property->entry.wait);
+     slot_sync_out( property );
+}
+
+void fusion_property_cede_all(FusionDev * dev, Fusionee * fusionee)
+{
+     FusionLink *l, *n;
+
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_PROPERTIES)) {
+          FusioneeOwnedLink *owned    = (FusioneeOwnedLink *) l;
+          FusionProperty    *property = (FusionProperty *) owned->entry;
+
+          if (owned->fusion_id != fusionee->id)
+               continue;
+
+          fusionee_disown(dev, owned);
+
+          /* Shared ones may be held in user space, they're ceded below. */
+          if (!property->slot)
+               cede_property(property, fusionee->id);
+     }
+
+     fusion_list_foreach(l, dev->shared_properties)
+          cede_property(container_of(l, FusionProperty, sharing), fusionee->id);
+}
+
+int fusion_property_share(FusionDev * dev, int id, unsigned int *ret_index)
+{
+     int             ret;
+     FusionProperty *property;
+
+     /* Slots are writable by all fusionees, see fusion_skirmish_share(). */
+     if (dev->secure)
+          return -EOPNOTSUPP;
+
+     ret = fusion_property_lookup(&dev->properties, id, &property);
+     if (ret)
+          return ret;
+
+     if (!property->slot) {
+          ret = fusion_slot_alloc(dev, id, &property->slot, ret_index);
+          if (ret) {
+               fusion_property_unlock( property );
+               return ret;
           }
+
+          fusion_list_prepend(&dev->shared_properties, &property->sharing);
+
+          /* Hand over the current state unless it's purchased. */
+          slot_sync_out( property );
      }
+     else
+          *ret_index = property->slot - dev->slots.area;
+
+     fusion_property_unlock( property );
+
+     return 0;
 }
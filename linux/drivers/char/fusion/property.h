@@ -37,8 +37,10 @@ int fusion_property_holdup(FusionDev * dev, int id, Fusionee * fusionee);
 
 int fusion_property_destroy(FusionDev * dev, int id);
 
+int fusion_property_share(FusionDev * dev, int id, unsigned int *ret_index);
+
 /* internal functions */
 
-void fusion_property_cede_all(FusionDev * dev, int fusion_id);
+void fusion_property_cede_all(FusionDev * dev, Fusionee * fusionee);
 
 #endif
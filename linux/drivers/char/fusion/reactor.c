@@ -18,6 +18,7 @@
 #include <linux/types.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE > KERNEL_VERSION(4, 0, 0)
 #include <generated/autoconf.h>
@@ -27,24 +28,42 @@
 #endif
 #include <linux/sched.h>
 #include <linux/proc_fs.h>
+#include <asm/uaccess.h>
 #include <linux/fusion.h>
 
+#include "cache.h"
 #include "call.h"
 #include "fusiondev.h"
 #include "fusionee.h"
+#include "hash.h"
 #include "list.h"
 #include "reactor.h"
 #include "shmpool.h"
 
+#define REACTOR_CHANNELS  1024
+
 typedef struct {
      FusionLink link;
 
      int fusion_id;
 
-     int *counts;        /* number of attach calls */
-     int num_counts;
+     unsigned long channels[BITS_TO_LONGS(REACTOR_CHANNELS)];    /* channels being attached to */
+
+     FusioneeOwnedLink owned;     /* in the list of the fusionee */
 } ReactorNode;
 
+typedef struct {
+     FusionLink link;    /* in the list of the channel */
+
+     ReactorNode *node;
+
+     int count;          /* number of attach calls */
+} ReactorAttachment;
+
+typedef struct {
+     FusionLink *attachments;
+} ReactorChannel;
+
 typedef struct {
      int count;          /* number of recipients */
 
@@ -57,6 +76,7 @@ typedef struct {
      FusionEntry entry;
 
      FusionLink *nodes;
+     FusionHash *channels;    /* channel -> ReactorChannel, created on first attach */
 
      int dispatch_count;
 
@@ -66,11 +86,20 @@ typedef struct {
      void *call_ptr;
 } FusionReactor;
 
+/* messages are copied once for dispatching, to the stack or to kmalloc'ed or vmalloc'ed memory */
+#define REACTOR_DISPATCH_STACK_SIZE    256
+#define REACTOR_DISPATCH_KMALLOC_SIZE  16384
+
+static FusionCache *reactor_node_cache;
+static FusionCache *reactor_attachment_cache;
+static FusionCache *reactor_dispatch_cache;
+
 /******************************************************************************/
 
 static int fork_node(FusionReactor * reactor,
-                     FusionID fusion_id, FusionID from_id);
+                     FusionID fusion_id, ReactorNode * node);
 
+static void free_node(FusionReactor * reactor, ReactorNode * node);
 static void free_all_nodes(FusionReactor * reactor);
 
 /******************************************************************************/
@@ -87,6 +116,88 @@ static inline ReactorNode *get_node(FusionReactor * reactor, FusionID fusion_id)
      return NULL;
 }
 
+static inline ReactorChannel *get_channel(FusionReactor * reactor, int channel)
+{
+     if (!reactor->channels)
+          return NULL;
+
+     return fusion_hash_lookup(reactor->channels, (void *)(long) channel);
+}
+
+static ReactorAttachment *get_attachment(ReactorChannel * rchannel, ReactorNode * node)
+{
+     ReactorAttachment *attachment;
+
+     fusion_list_foreach(attachment, rchannel->attachments) {
+          if (attachment->node == node)
+               return attachment;
+     }
+
+     return NULL;
+}
+
+static int
+add_attachment(FusionReactor * reactor, ReactorNode * node, int channel, int count)
+{
+     int ret;
+     ReactorChannel *rchannel;
+     ReactorAttachment *attachment;
+
+     if (!reactor->channels) {
+          ret = fusion_hash_create(FHT_INT, FHT_PTR, 0, &reactor->channels);
+          if (ret)
+               return ret;
+     }
+
+     attachment = fusion_core_cache_alloc( fusion_core, reactor_attachment_cache );
+     if (!attachment)
+          return -ENOMEM;
+
+     rchannel = get_channel(reactor, channel);
+     if (!rchannel) {
+          rchannel = fusion_core_malloc( fusion_core, sizeof(ReactorChannel) );
+          if (!rchannel) {
+               fusion_core_cache_free( fusion_core, reactor_attachment_cache, attachment );
+               return -ENOMEM;
+          }
+
+          rchannel->attachments = NULL;
+
+          ret = fusion_hash_insert(reactor->channels, (void *)(long) channel, rchannel);
+          if (ret) {
+               fusion_core_free( fusion_core, rchannel );
+               fusion_core_cache_free( fusion_core, reactor_attachment_cache, attachment );
+               return ret;
+          }
+     }
+
+     attachment->node  = node;
+     attachment->count = count;
+
+     fusion_list_prepend(&rchannel->attachments, &attachment->link);
+
+     set_bit(channel, node->channels);
+
+     return 0;
+}
+
+static void
+remove_attachment(FusionReactor * reactor, ReactorChannel * rchannel,
+                  ReactorAttachment * attachment, int channel)
+{
+     clear_bit(channel, attachment->node->channels);
+
+     fusion_list_remove(&rchannel->attachments, &attachment->link);
+
+     fusion_core_cache_free( fusion_core, reactor_attachment_cache, attachment );
+
+     if (!rchannel->attachments) {
+          fusion_hash_remove(reactor->channels, (void *)(long) channel, NULL, NULL);
+
+          fusion_core_free( fusion_core, rchannel );
+     }
+}
+
 /******************************************************************************/
 
 static void fusion_reactor_destruct(FusionEntry * entry, void *ctx)
@@ -117,7 +228,23 @@ FUSION_ENTRY_CLASS(FusionReactor, reactor, NULL,
 /******************************************************************************/
 int fusion_reactor_init(FusionDev * dev)
 {
-     fusion_entries_init(&dev->reactor, &reactor_class, dev, dev);
+     int ret;
+
+     ret = fusion_cache_register(&reactor_node_cache, "fusion_reactor_node", sizeof(ReactorNode));
+     if (ret)
+          return ret;
+
+     ret = fusion_cache_register(&reactor_attachment_cache, "fusion_reactor_attachment", sizeof(ReactorAttachment));
+     if (ret)
+          return ret;
+
+     ret = fusion_cache_register(&reactor_dispatch_cache, "fusion_reactor_dispatch", sizeof(ReactorDispatch));
+     if (ret)
+          return ret;
+
+     ret = fusion_entries_init(&dev->reactor, &reactor_class, dev, dev);
+     if (ret)
+          return ret;
 
      fusion_entries_create_proc_entry(dev, "reactors", &dev->reactor);
 
@@ -143,9 +270,10 @@ fusion_reactor_attach(FusionDev * dev, int id, int channel, FusionID fusion_id)
 {
      int ret;
      ReactorNode *node;
+     ReactorChannel *rchannel;
      FusionReactor *reactor;
 
-     if (channel < 0 || channel > 1023)
+     if (channel < 0 || channel >= REACTOR_CHANNELS)
           return -EINVAL;
 
      ret = fusion_reactor_lookup(&dev->reactor, id, &reactor);
@@ -155,52 +283,33 @@ fusion_reactor_attach(FusionDev * dev, int id, int channel, FusionID fusion_id)
      if (reactor->destroyed)
           return -EIDRM;
 
-     dev->stat.reactor_attach++;
+     atomic_inc( &dev->stat.reactor_attach );
 
      node = get_node(reactor, fusion_id);
      if (!node) {
-          int ncount = channel + 4;
-
-          node = fusion_core_malloc( fusion_core, sizeof(ReactorNode) );
+          node = fusion_core_cache_alloc( fusion_core, reactor_node_cache );
           if (!node)
                return -ENOMEM;
 
-          node->counts = fusion_core_malloc( fusion_core, sizeof(int) * ncount );
-          if (!node->counts) {
-               fusion_core_free( fusion_core, node);
-               return -ENOMEM;
-          }
-
-          memset(node->counts, 0, sizeof(int) * ncount);
-
-          node->num_counts = ncount;
           node->fusion_id = fusion_id;
 
-          node->counts[channel] = 1;
+          ret = add_attachment(reactor, node, channel, 1);
+          if (ret) {
+               fusion_core_cache_free( fusion_core, reactor_node_cache, node );
+               return ret;
+          }
 
           fusion_list_prepend(&reactor->nodes, &node->link);
-     }
-     else {
-          if (node->num_counts <= channel) {
-               int ncount = channel + 4;
-               int *counts = fusion_core_malloc( fusion_core, sizeof(int) * ncount );
-
-               if (!counts)
-                    return -ENOMEM;
-
-               memcpy(counts, node->counts,
-                      sizeof(int) * node->num_counts);
-               memset(counts + node->num_counts, 0,
-                      sizeof(int) * (ncount - node->num_counts));
-
-               fusion_core_free( fusion_core, node->counts);
 
-               node->counts = counts;
-               node->num_counts = ncount;
-          }
+          fusionee_own(dev, fusion_id, FUSIONEE_OWNED_REACTOR_NODES, &node->owned, &reactor->entry);
+     }
+     else if (test_bit(channel, node->channels)) {
+          rchannel = get_channel(reactor, channel);
 
-          node->counts[channel]++;
+          get_attachment(rchannel, node)->count++;
      }
+     else
+          return add_attachment(reactor, node, channel, 1);
 
      return 0;
 }
@@ -210,34 +319,31 @@ fusion_reactor_detach(FusionDev * dev, int id, int channel, FusionID fusion_id)
 {
      int ret;
      ReactorNode *node;
+     ReactorChannel *rchannel;
+     ReactorAttachment *attachment;
      FusionReactor *reactor;
 
-     if (channel < 0 || channel > 1023)
+     if (channel < 0 || channel >= REACTOR_CHANNELS)
           return -EINVAL;
 
      ret = fusion_reactor_lookup(&dev->reactor, id, &reactor);
      if (ret)
           return ret;
 
-     dev->stat.reactor_detach++;
+     atomic_inc( &dev->stat.reactor_detach );
 
      node = get_node(reactor, fusion_id);
-     if (!node || node->num_counts <= channel)
+     if (!node || !test_bit(channel, node->channels))
           return -EIO;
 
-     if (!--node->counts[channel]) {
-          int i;
+     rchannel   = get_channel(reactor, channel);
+     attachment = get_attachment(rchannel, node);
 
-          for (i = 0; i < node->num_counts; i++) {
-               if (node->counts[i])
-                    break;
-          }
+     if (!--attachment->count) {
+          remove_attachment(reactor, rchannel, attachment, channel);
 
-          if (i == node->num_counts) {
-               fusion_list_remove(&reactor->nodes, &node->link);
-               fusion_core_free( fusion_core, node->counts);
-               fusion_core_free( fusion_core, node);
-          }
+          if (find_first_bit(node->channels, REACTOR_CHANNELS) >= REACTOR_CHANNELS)
+               free_node(reactor, node);
      }
 
      if (reactor->destroyed && !reactor->nodes)
@@ -268,7 +374,7 @@ fusion_reactor_dispatch_message_callback(FusionDev * dev, int id, void *ctx, int
 
                     fusion_call_execute(dev, NULL, &execute);
 
-                    fusion_core_free( fusion_core, dispatch);
+                    fusion_core_cache_free( fusion_core, reactor_dispatch_cache, dispatch );
                }
 
                break;
@@ -277,7 +383,7 @@ fusion_reactor_dispatch_message_callback(FusionDev * dev, int id, void *ctx, int
 
      if (!reactor) {
           if (!--dispatch->count)
-               fusion_core_free( fusion_core, dispatch);
+               fusion_core_cache_free( fusion_core, reactor_dispatch_cache, dispatch );
      }
 }
 
@@ -286,12 +392,15 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
                         Fusionee * fusionee, int msg_size, const void *msg_data)
 {
      int ret;
-     FusionLink *l;
      FusionReactor *reactor;
+     ReactorChannel *rchannel;
+     ReactorAttachment *attachment;
      ReactorDispatch *dispatch = NULL;
      FusionID fusion_id = fusionee ? fusionee_id(fusionee) : 0;
+     char stack_data[REACTOR_DISPATCH_STACK_SIZE];
+     void *data = stack_data;
 
-     if (channel < 0 || channel > 1023)
+     if (channel < 0 || channel >= REACTOR_CHANNELS)
           return -EINVAL;
 
      ret = fusion_reactor_lookup(&dev->reactor, id, &reactor);
@@ -301,12 +410,31 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
      if (reactor->destroyed)
           return -EIDRM;
 
+     /* Copy the message once for all recipients. */
+     if (msg_size > REACTOR_DISPATCH_KMALLOC_SIZE)
+          data = vmalloc( msg_size );
+     else if (msg_size > REACTOR_DISPATCH_STACK_SIZE)
+          data = fusion_core_malloc( fusion_core, msg_size );
+
+     if (!data)
+          return -ENOMEM;
+
+     if (copy_from_user( data, msg_data, msg_size )) {
+          ret = -EFAULT;
+          goto out;
+     }
+
      if (reactor->call_id) {
-          void *ptr = *(void **)msg_data;
+          void *ptr = NULL;
 
-          dispatch = fusion_core_malloc( fusion_core, sizeof(ReactorDispatch) );
-          if (!dispatch)
-               return -ENOMEM;
+          if (msg_size == sizeof(ptr))
+               ptr = *(void **)data;
+
+          dispatch = fusion_core_cache_alloc( fusion_core, reactor_dispatch_cache );
+          if (!dispatch) {
+               ret = -ENOMEM;
+               goto out;
+          }
 
           dispatch->count = 0;
           dispatch->call_id = reactor->call_id;
@@ -322,33 +450,33 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
 
      reactor->dispatch_count++;
 
-     dev->stat.reactor_dispatch++;
+     atomic_inc( &dev->stat.reactor_dispatch );
 
-     fusion_list_foreach(l, reactor->nodes) {
-          ReactorNode *node = (ReactorNode *) l;
+     rchannel = get_channel(reactor, channel);
+     if (rchannel) {
+          fusion_list_foreach(attachment, rchannel->attachments) {
+               ReactorNode *node = attachment->node;
 
-          if (node->fusion_id == fusion_id || node->num_counts <= channel
-              || !node->counts[channel])
-               continue;
+               if (node->fusion_id == fusion_id)
+                    continue;
 
-          if (dispatch) {
-               dispatch->count++;
+               if (dispatch) {
+                    dispatch->count++;
 
-               ret =
-               fusionee_send_message(dev, fusionee,
-                                     node->fusion_id, FMT_REACTOR,
-                                     reactor->entry.id, channel,
-                                     msg_size, msg_data,
-                                     FMC_DISPATCH, dispatch,
-                                     reactor->entry.id, NULL, 0);
+                    fusionee_send_kernel_message(dev, fusionee,
+                                                 node->fusion_id, FMT_REACTOR,
+                                                 reactor->entry.id, channel,
+                                                 msg_size, data,
+                                                 FMC_DISPATCH, dispatch,
+                                                 reactor->entry.id);
+               }
+               else
+                    fusionee_send_kernel_message(dev, fusionee,
+                                                 node->fusion_id, FMT_REACTOR,
+                                                 reactor->entry.id, channel,
+                                                 msg_size, data, FMC_NONE,
+                                                 NULL, 0);
           }
-          else
-               ret =
-               fusionee_send_message(dev, fusionee,
-                                     node->fusion_id, FMT_REACTOR,
-                                     reactor->entry.id, channel,
-                                     msg_size, msg_data, FMC_NONE,
-                                     NULL, 0, NULL, 0);
      }
 
      if (dispatch && !dispatch->count) {
@@ -361,10 +489,18 @@ fusion_reactor_dispatch(FusionDev * dev, int id, int channel,
 
           fusion_call_execute(dev, NULL, &execute);
 
-          fusion_core_free( fusion_core, dispatch);
+          fusion_core_cache_free( fusion_core, reactor_dispatch_cache, dispatch );
      }
 
-     return 0;
+     ret = 0;
+
+out:
+     if (msg_size > REACTOR_DISPATCH_KMALLOC_SIZE)
+          vfree( data );
+     else if (msg_size > REACTOR_DISPATCH_STACK_SIZE)
+          fusion_core_free( fusion_core, data );
+
+     return ret;
 }
 
 int
@@ -407,23 +543,18 @@ int fusion_reactor_destroy(FusionDev * dev, int id)
      return 0;
 }
 
-void fusion_reactor_detach_all(FusionDev * dev, FusionID fusion_id)
+void fusion_reactor_detach_all(FusionDev * dev, Fusionee * fusionee)
 {
      FusionLink *l, *n;
 
-     fusion_list_foreach_safe(l, n, dev->reactor.list) {
-          ReactorNode *node;
-          FusionReactor *reactor = (FusionReactor *) l;
-
-          fusion_list_foreach(node, reactor->nodes) {
-               if (node->fusion_id == fusion_id) {
-                    fusion_list_remove(&reactor->nodes,
-                                       &node->link);
-                    fusion_core_free( fusion_core, node->counts);
-                    fusion_core_free( fusion_core, node);
-                    break;
-               }
-          }
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_REACTOR_NODES)) {
+          FusioneeOwnedLink *owned   = (FusioneeOwnedLink *) l;
+          FusionReactor     *reactor = (FusionReactor *) owned->entry;
+
+          if (owned->fusion_id != fusionee->id)
+               continue;
+
+          free_node(reactor, container_of(owned, ReactorNode, owned));
 
           if (reactor->destroyed && !reactor->nodes)
                fusion_entry_destroy_locked(&dev->reactor,
@@ -432,15 +563,16 @@ void fusion_reactor_detach_all(FusionDev * dev, FusionID fusion_id)
 }
 
 int
-fusion_reactor_fork_all(FusionDev * dev, FusionID fusion_id, FusionID from_id)
+fusion_reactor_fork_all(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
 {
      FusionLink *l;
      int ret = 0;
 
-     fusion_list_foreach(l, dev->reactor.list) {
-          FusionReactor *reactor = (FusionReactor *) l;
+     fusion_list_foreach(l, fusionee_owned(dev, from, FUSIONEE_OWNED_REACTOR_NODES)) {
+          FusioneeOwnedLink *owned = (FusioneeOwnedLink *) l;
 
-          ret = fork_node(reactor, fusion_id, from_id);
+          ret = fork_node((FusionReactor *) owned->entry, fusionee->id,
+                          container_of(owned, ReactorNode, owned));
           if (ret)
                break;
      }
@@ -451,49 +583,65 @@ fusion_reactor_fork_all(FusionDev * dev, FusionID fusion_id, FusionID from_id)
 /******************************************************************************/
 
 static int
-fork_node(FusionReactor * reactor, FusionID fusion_id, FusionID from_id)
+fork_node(FusionReactor * reactor, FusionID fusion_id, ReactorNode * node)
 {
-     ReactorNode *node;
+     int ret;
+     int channel;
+     ReactorNode *new_node;
 
-     fusion_list_foreach(node, reactor->nodes) {
-          if (node->fusion_id == from_id) {
-               ReactorNode *new_node;
+     new_node = fusion_core_cache_alloc( fusion_core, reactor_node_cache );
+     if (!new_node)
+          return -ENOMEM;
 
-               new_node = fusion_core_malloc( fusion_core, sizeof(ReactorNode) );
-               if (!new_node) {
-                    return -ENOMEM;
-               }
+     new_node->fusion_id = fusion_id;
 
-               new_node->counts = fusion_core_malloc( fusion_core, sizeof(int) * node->num_counts );
-               if (!new_node->counts) {
-                    fusion_core_free( fusion_core, new_node);
-                    return -ENOMEM;
-               }
+     fusion_list_prepend(&reactor->nodes, &new_node->link);
 
-               new_node->fusion_id = fusion_id;
-               new_node->num_counts = node->num_counts;
+     fusionee_own(reactor->entry.entries->dev, fusion_id, FUSIONEE_OWNED_REACTOR_NODES,
+                  &new_node->owned, &reactor->entry);
 
-               memcpy(new_node->counts, node->counts,
-                      sizeof(int) * node->num_counts);
+     for_each_set_bit(channel, node->channels, REACTOR_CHANNELS) {
+          ReactorChannel *rchannel = get_channel(reactor, channel);
 
-               fusion_list_prepend(&reactor->nodes, &new_node->link);
-
-               break;
+          ret = add_attachment(reactor, new_node, channel,
+                               get_attachment(rchannel, node)->count);
+          if (ret) {
+               free_node(reactor, new_node);
+               return ret;
           }
      }
 
      return 0;
 }
 
+static void free_node(FusionReactor * reactor, ReactorNode * node)
+{
+     int channel;
+
+     for_each_set_bit(channel, node->channels, REACTOR_CHANNELS) {
+          ReactorChannel *rchannel = get_channel(reactor, channel);
+
+          remove_attachment(reactor, rchannel, get_attachment(rchannel, node), channel);
+     }
+
+     fusion_list_remove(&reactor->nodes, &node->link);
+
+     fusionee_disown(reactor->entry.entries->dev, &node->owned);
+
+     fusion_core_cache_free( fusion_core, reactor_node_cache, node );
+}
+
 static void free_all_nodes(FusionReactor * reactor)
 {
      FusionLink *n;
      ReactorNode *node;
 
-     fusion_list_foreach_safe(node, n, reactor->nodes) {
-          fusion_core_free( fusion_core, node->counts);
-          fusion_core_free( fusion_core, node);
-     }
+     fusion_list_foreach_safe(node, n, reactor->nodes)
+          free_node(reactor, node);
+
+     if (reactor->channels) {
+          fusion_hash_destroy(reactor->channels);
 
-     reactor->nodes = NULL;
+          reactor->channels = NULL;
+     }
 }
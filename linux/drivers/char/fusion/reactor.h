@@ -46,10 +46,10 @@ int fusion_reactor_set_dispatch_callback(FusionDev * dev,
 
 /* internal functions */
 
-void fusion_reactor_detach_all(FusionDev * dev, FusionID fusion_id);
+void fusion_reactor_detach_all(FusionDev * dev, Fusionee * fusionee);
 
 int fusion_reactor_fork_all(FusionDev * dev,
-                            FusionID fusion_id, FusionID from_id);
+                            Fusionee * fusionee, Fusionee * from);
 
 
 
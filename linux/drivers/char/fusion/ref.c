@@ -32,15 +32,25 @@
 #include "fusiondev.h"
 #include "fusionee.h"
 #include "list.h"
+#include "cache.h"
 #include "call.h"
+#include "hash.h"
 #include "ref.h"
 
 typedef struct __Fusion_FusionRef FusionRef;
 
 typedef struct {
-     FusionLink link;
      FusionID fusion_id;
      int refs;
+
+     int *counter;                  /* count shared with user space, 'refs' is one while positive */
+     FusionCounters *counters;      /* counters of the fusionee */
+
+     FusionRef *ref;
+     FusioneeOwnedLink owned;       /* in the list of the fusionee */
+
+     int thrown;                    /* number of references thrown, but not caught yet */
+     FusionLink *catchable;         /* references thrown to this fusionee, oldest first */
 } LocalRef;
 
 typedef struct {
@@ -50,8 +60,7 @@ typedef struct {
 
 typedef struct {
      FusionLink link;
-     FusionID   fusion_id;
-     FusionID   catcher;
+     FusionID   fusion_id;     /* thrower */
 } Throw;
 
 struct __Fusion_FusionRef {
@@ -61,6 +70,7 @@ struct __Fusion_FusionRef {
      int local;
 
      int locked;         /* non-zero fusion id of lock owner */
+     FusioneeOwnedLink locker;      /* in the list of the lock owner */
 
      bool watched;       /* true if watch has been installed */
      bool syncwatch;     /* true if watch is executed synchronously */
@@ -70,23 +80,28 @@ struct __Fusion_FusionRef {
      FusionRef *inherited;
      FusionLink *inheritors;
 
-     FusionLink *local_refs;
-
-     FusionLink *throws;
+     FusionHash *locals;   /* fusion id -> LocalRef, created on demand */
+     int shared;         /* number of local counts shared with user space */
 };
 
+static FusionCache *local_ref_cache;
+
 /**********************************************************************************************************************/
 
-static int get_local(FusionRef * ref, FusionID fusion_id);
-static int get_throws(FusionRef * ref, FusionID fusion_id);
+static LocalRef *lookup_local(FusionRef * ref, FusionID fusion_id);
+static int get_local(LocalRef * local);
 
-static int add_throw(FusionRef * ref, FusionID fusion_id, FusionID catcher);
+static int add_throw(FusionDev * dev, FusionRef * ref, LocalRef * thrower, FusionID catcher);
 
-static int add_local(FusionRef * ref, FusionID fusion_id, int add);
-static void clear_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id);
-static int fork_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id,
-                      FusionID from_id);
-static void free_all_local(FusionRef * ref);
+static LocalRef *new_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id);
+static int add_local(FusionRef * ref, FusionID fusion_id, int add, int *ret_diff);
+static int add_counter(LocalRef * local, int add, int *ret_diff);
+static void lock_ref(FusionDev * dev, FusionRef * ref, FusionID fusion_id);
+static void unlock_ref(FusionDev * dev, FusionRef * ref);
+static void clear_local(FusionDev * dev, LocalRef * local);
+static void free_catchable(FusionRef * ref, LocalRef * local);
+static void fork_local(FusionDev * dev, LocalRef * local);
+static void free_all_local(FusionDev * dev, FusionRef * ref);
 
 static int propagate_local(FusionDev * dev, FusionRef * ref, int diff, bool async);
 
@@ -96,6 +111,8 @@ static int add_inheritor(FusionRef * ref, FusionRef * from);
 static void remove_inheritor(FusionRef * ref, FusionRef * from);
 static void drop_inheritors(FusionDev * dev, FusionRef * ref);
 
+static bool need_exclusive(FusionDev * dev, FusionRef * ref, int diff);
+
 /**********************************************************************************************************************/
 
 static void fusion_ref_destruct(FusionEntry * entry, void *ctx)
@@ -108,13 +125,16 @@ static void fusion_ref_destruct(FusionEntry * entry, void *ctx)
      if (ref->inherited)
           remove_inheritor(ref, ref->inherited);
 
-     free_all_local(ref);
+     fusionee_disown(dev, &ref->locker);
+
+     free_all_local(dev, ref);
 }
 
 static void fusion_ref_print(FusionEntry * entry, void *ctx, struct seq_file *p)
 {
-     FusionLink *l;
-     FusionRef  *ref = (FusionRef *) entry;
+     FusionRef          *ref = (FusionRef *) entry;
+     LocalRef           *local;
+     FusionHashIterator  it;
 
      if (ref->locked) {
           seq_printf(p, "%2d %2d (locked by %d)\n", ref->global,
@@ -124,11 +144,13 @@ static void fusion_ref_print(FusionEntry * entry, void *ctx, struct seq_file *p)
 
      seq_printf(p, "%2d %2d", ref->global, ref->local);
 
-     fusion_list_foreach(l, ref->local_refs) {
-          LocalRef *local = (LocalRef *) l;
-
-          if (local->refs)
-               seq_printf(p, "  0x%08lx(%d)", local->fusion_id, local->refs);
+     if (ref->locals) {
+          fusion_hash_foreach (local, it, ref->locals) {
+               if (local->counter)
+                    seq_printf(p, "  0x%08lx(%d shared)", local->fusion_id, *local->counter);
+               else if (local->refs)
+                    seq_printf(p, "  0x%08lx(%d)", local->fusion_id, local->refs);
+          }
      }
 
      seq_printf(p, "\n");
@@ -140,7 +162,15 @@ FUSION_ENTRY_CLASS(FusionRef, ref, NULL, fusion_ref_destruct, fusion_ref_print);
 
 int fusion_ref_init(FusionDev * dev)
 {
-     fusion_entries_init(&dev->ref, &ref_class, dev, dev);
+     int ret;
+
+     ret = fusion_cache_register(&local_ref_cache, "fusion_local_ref", sizeof(LocalRef));
+     if (ret)
+          return ret;
+
+     ret = fusion_entries_init(&dev->ref, &ref_class, dev, dev);
+     if (ret)
+          return ret;
 
      fusion_entries_create_proc_entry(dev, "refs", &dev->ref);
 
@@ -164,60 +194,82 @@ int fusion_ref_new(FusionDev * dev, Fusionee *fusionee, int *ret_id)
 int fusion_ref_up(FusionDev * dev, int id, FusionID fusion_id)
 {
      int ret;
+     int diff;
      FusionRef *ref;
 
      ret = fusion_ref_lookup(&dev->ref, id, &ref);
      if (ret)
           return ret;
 
-     dev->stat.ref_up++;
+     if (need_exclusive(dev, ref, 1)) {
+          fusion_ref_unlock(ref);
+          return FUSION_RESTART_EXCLUSIVE;
+     }
+
+     atomic_inc( &dev->stat.ref_up );
 
      if (ref->locked) {
           ret = -EAGAIN;
-          return ret;
+          goto out;
      }
 
      if (fusion_id) {
-          ret = add_local(ref, fusion_id, 1);
+          ret = add_local(ref, fusion_id, 1, &diff);
           if (ret)
-               return ret;
+               goto out;
 
-          ret = propagate_local(dev, ref, 1, false);
+          if (diff)
+               propagate_local(dev, ref, diff, false);
      }
      else
           ref->global ++;
 
-     return 0;
+     ret = 0;
+
+out:
+     fusion_ref_unlock(ref);
+
+     return ret;
 }
 
 int fusion_ref_down(FusionDev * dev, int id, FusionID fusion_id)
 {
      int ret;
+     int diff;
      FusionRef *ref;
 
      ret = fusion_ref_lookup(&dev->ref, id, &ref);
      if (ret)
           return ret;
 
-     dev->stat.ref_down++;
+     if (need_exclusive(dev, ref, -1)) {
+          fusion_ref_unlock(ref);
+          return FUSION_RESTART_EXCLUSIVE;
+     }
+
+     atomic_inc( &dev->stat.ref_down );
 
-     if (ref->locked)
-          return -EAGAIN;
+     if (ref->locked) {
+          ret = -EAGAIN;
+          goto out;
+     }
 
      if (fusion_id) {
           ret = -EIO;
           if (!ref->local)
-               return ret;
+               goto out;
 
-          ret = add_local(ref, fusion_id, -1);
+          ret = add_local(ref, fusion_id, -1, &diff);
           if (ret)
-               return ret;
+               goto out;
 
-          ret = propagate_local(dev, ref, -1, false);
+          if (diff)
+               propagate_local(dev, ref, diff, false);
      }
      else {
+          ret = -EIO;
           if (!ref->global)
-               return -EIO;
+               goto out;
 
           ref->global --;
 
@@ -225,76 +277,100 @@ int fusion_ref_down(FusionDev * dev, int id, FusionID fusion_id)
                notify_ref(dev, ref, false);
      }
 
-     return 0;
+     ret = 0;
+
+out:
+     fusion_ref_unlock(ref);
+
+     return ret;
 }
 
 int fusion_ref_catch(FusionDev * dev, int id, FusionID fusion_id)
 {
      int        ret;
+     int        diff;
      FusionRef *ref;
+     LocalRef  *local;
      Throw     *throw_;
+     FusionID   thrower;
 
      ret = fusion_ref_lookup(&dev->ref, id, &ref);
      if (ret)
           return ret;
 
-     dev->stat.ref_catch++;
+     if (need_exclusive(dev, ref, -1)) {
+          fusion_ref_unlock(ref);
+          return FUSION_RESTART_EXCLUSIVE;
+     }
+
+     atomic_inc( &dev->stat.ref_catch );
 
+     ret = -EAGAIN;
      if (ref->locked)
-          return -EAGAIN;
+          goto out;
 
-     direct_list_foreach( throw_, ref->throws ) {
-          if (throw_->catcher == fusion_id) {
-               FusionID thrower = throw_->fusion_id;
+     ret = -EACCES;
 
-               fusion_list_remove( &ref->throws, &throw_->link );
+     local = lookup_local( ref, fusion_id );
+     if (!local || !local->catchable)
+          goto out;
 
-               fusion_core_free( fusion_core, throw_ );
+     throw_  = (Throw *) local->catchable;
+     thrower = throw_->fusion_id;
 
+     fusion_list_remove( &local->catchable, &throw_->link );
 
-               ret = add_local( ref, thrower, -1 );
-               if (ret)
-                    return ret;
+     fusion_core_free( fusion_core, throw_ );
 
-               propagate_local( dev, ref, -1, false );
+     local = lookup_local( ref, thrower );
+     if (local)
+          local->thrown--;
 
-               return 0;
-          }
-     }
+     ret = add_local( ref, thrower, -1, &diff );
+     if (ret)
+          goto out;
+
+     if (diff)
+          propagate_local( dev, ref, diff, false );
 
-     return -EACCES;
+out:
+     fusion_ref_unlock(ref);
+
+     return ret;
 }
 
 int fusion_ref_throw(FusionDev * dev, int id, FusionID fusion_id, FusionID catcher)
 {
      int        ret;
-     int        local;
-     int        throws;
      FusionRef *ref;
+     LocalRef  *local;
 
      ret = fusion_ref_lookup(&dev->ref, id, &ref);
      if (ret)
           return ret;
 
-     dev->stat.ref_throw++;
+     atomic_inc( &dev->stat.ref_throw );
 
+     ret = -EAGAIN;
      if (ref->locked)
-          return -EAGAIN;
+          goto out;
 
-     local = get_local( ref, fusion_id );
-     if (!local)
-          return -EIO;
+     ret = -EIO;
 
-     throws = get_throws( ref, fusion_id );
-     if (throws == local)
-          return -EIO;
+     local = lookup_local( ref, fusion_id );
+     if (!local || !get_local( local ))
+          goto out;
 
-     // FIXME: cleanup on release() of thrower/catcher, timeout?
-     ret = add_throw(ref, fusion_id, catcher);
-     if (ret)
-          return ret;
+     if (local->thrown == get_local( local ))
+          goto out;
 
-     return 0;
+     // FIXME: timeout?
+     ret = add_throw(dev, ref, local, catcher);
+
+out:
+     fusion_ref_unlock(ref);
+
+     return ret;
 }
 
 int fusion_ref_zero_lock(FusionDev * dev, int id, FusionID fusion_id)
@@ -307,8 +383,11 @@ int fusion_ref_zero_lock(FusionDev * dev, int id, FusionID fusion_id)
           return ret;
 
      while (true) {
-          if (ref->locked)
-               return ref->locked == fusion_id ? -EIO : -EAGAIN;
+          if (ref->locked) {
+               ret = ref->locked == fusion_id ? -EIO : -EAGAIN;
+               fusion_ref_unlock(ref);
+               return ret;
+          }
 
           if (ref->global ||ref->local) {
                ret = fusion_ref_wait(ref, NULL);
@@ -319,7 +398,9 @@ int fusion_ref_zero_lock(FusionDev * dev, int id, FusionID fusion_id)
                break;
      }
 
-     ref->locked = fusion_id;
+     lock_ref(dev, ref, fusion_id);
+
+     fusion_ref_unlock(ref);
 
      return 0;
 }
@@ -334,12 +415,13 @@ int fusion_ref_zero_trylock(FusionDev * dev, int id, FusionID fusion_id)
           return ret;
 
      if (ref->locked)
-          return ref->locked == fusion_id ? -EIO : -EAGAIN;
-
-     if (ref->global ||ref->local)
+          ret = ref->locked == fusion_id ? -EIO : -EAGAIN;
+     else if (ref->global ||ref->local)
           ret = -ETOOMANYREFS;
      else
-          ref->locked = fusion_id;
+          lock_ref(dev, ref, fusion_id);
+
+     fusion_ref_unlock(ref);
 
      return ret;
 }
@@ -354,23 +436,46 @@ int fusion_ref_zero_unlock(FusionDev * dev, int id, FusionID fusion_id)
           return ret;
 
      if (ref->locked != fusion_id)
-          return -EIO;
+          ret = -EIO;
+     else
+          unlock_ref(dev, ref);
 
-     ref->locked = 0;
+     fusion_ref_unlock(ref);
 
-     return 0;
+     return ret;
 }
 
 int fusion_ref_stat(FusionDev * dev, int id, int *refs)
 {
-     int ret;
-     FusionRef *ref;
+     FusionRef          *ref;
+     LocalRef           *local;
+     FusionHashIterator  it;
 
-     ret = fusion_ref_lookup(&dev->ref, id, &ref);
-     if (ret)
-          return ret;
+     /* No locking, just a snapshot. */
+     rcu_read_lock();
+
+     ref = fusion_ref_lookup_rcu(&dev->ref, id);
+     if (!ref) {
+          rcu_read_unlock();
+          return -EINVAL;
+     }
+
+     /* Shared counts need to be summed up with the table being stable. */
+     if (ref->shared) {
+          if (!fusion_dev_exclusive(dev)) {
+               rcu_read_unlock();
+               return FUSION_RESTART_EXCLUSIVE;
+          }
 
-     *refs = ref->global +ref->local;
+          *refs = ref->global;
+
+          fusion_hash_foreach (local, it, ref->locals)
+               *refs += get_local( local );
+     }
+     else
+          *refs = ref->global +ref->local;
+
+     rcu_read_unlock();
 
      return 0;
 }
@@ -449,170 +554,317 @@ int fusion_ref_set_sync(FusionDev * dev, int id)
      return ret;
 }
 
+int fusion_ref_share(FusionDev * dev, Fusionee *fusionee, int id, unsigned int *ret_index)
+{
+     int         ret;
+     int         diff;
+     FusionRef  *ref;
+     LocalRef   *local;
+     FusionID    fusion_id = fusionee_id(fusionee);
+
+     ret = fusion_ref_lookup(&dev->ref, id, &ref);
+     if (ret)
+          return ret;
+
+     local = lookup_local(ref, fusion_id);
+     if (!local) {
+          local = new_local(dev, ref, fusion_id);
+          if (!local) {
+               fusion_ref_unlock(ref);
+               return -ENOMEM;
+          }
+     }
+
+     if (local->counter) {
+          *ret_index = local->counter - local->counters->area;
+
+          fusion_ref_unlock(ref);
+          return 0;
+     }
+
+     ret = fusion_counter_alloc(&fusionee->ref_counters, &local->counter, ret_index);
+     if (ret) {
+          fusion_ref_unlock(ref);
+          return ret;
+     }
+
+     local->counters = &fusionee->ref_counters;
+
+     ref->shared++;
+
+     /* Move the count to user space, keeping one reference while it's positive. */
+     *local->counter = local->refs;
+
+     if (local->refs > 1) {
+          diff = 1 - local->refs;
+
+          local->refs = 1;
+
+          propagate_local(dev, ref, diff, false);
+     }
+
+     fusion_ref_unlock(ref);
+
+     return 0;
+}
+
 int fusion_ref_destroy(FusionDev * dev, int id)
 {
      return fusion_entry_destroy(&dev->ref, id);
 }
 
-void fusion_ref_clear_all_local(FusionDev * dev, FusionID fusion_id)
+void fusion_ref_clear_all_local(FusionDev * dev, Fusionee * fusionee)
 {
-     FusionRef *ref;
+     FusionLink *l, *n;
+
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_LOCKED_REFS)) {
+          FusioneeOwnedLink *owned = (FusioneeOwnedLink *) l;
+
+          if (owned->fusion_id == fusionee->id)
+               unlock_ref(dev, container_of(owned, FusionRef, locker));
+     }
+
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_LOCAL_REFS)) {
+          FusioneeOwnedLink *owned = (FusioneeOwnedLink *) l;
 
-     fusion_list_foreach(ref, dev->ref.list)
-     clear_local(dev, ref, fusion_id);
+          if (owned->fusion_id == fusionee->id)
+               clear_local(dev, container_of(owned, LocalRef, owned));
+     }
 }
 
 int
-fusion_ref_fork_all_local(FusionDev * dev, FusionID fusion_id, FusionID from_id)
+fusion_ref_fork_all_local(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
 {
-     FusionRef *ref;
-     int ret = 0;
+     FusionLink *l;
 
-     fusion_list_foreach(ref, dev->ref.list) {
-          ret = fork_local(dev, ref, fusion_id, from_id);
-          if (ret)
-               break;
+     fusion_list_foreach(l, fusionee_owned(dev, from, FUSIONEE_OWNED_LOCAL_REFS)) {
+          FusioneeOwnedLink *owned = (FusioneeOwnedLink *) l;
+
+          if (owned->fusion_id == from->id)
+               fork_local(dev, container_of(owned, LocalRef, owned));
      }
 
-     return ret;
+     return 0;
 }
 
 /**********************************************************************************************************************/
 
-static int get_local( FusionRef * ref, FusionID fusion_id )
+static LocalRef *lookup_local( FusionRef * ref, FusionID fusion_id )
 {
-     LocalRef *local;
-
-     direct_list_foreach (local, ref->local_refs) {
-          if (local->fusion_id == fusion_id)
-               return local->refs;
-     }
+     if (!ref->locals)
+          return NULL;
 
-     return 0;
+     return fusion_hash_lookup( ref->locals, (void *) fusion_id );
 }
 
-static int get_throws( FusionRef * ref, FusionID fusion_id )
+static int get_local( LocalRef * local )
 {
-     Throw *throw_;
-     int    throws = 0;
-
-     direct_list_foreach (throw_, ref->throws) {
-          if (throw_->fusion_id == fusion_id)
-               throws++;
-     }
-
-     return throws;
+     return local->counter ? *local->counter : local->refs;
 }
 
-static int add_throw(FusionRef * ref, FusionID fusion_id, FusionID catcher)
+static int add_throw(FusionDev * dev, FusionRef * ref, LocalRef * thrower, FusionID catcher)
 {
-     Throw *throw_;
+     Throw    *throw_;
+     LocalRef *local;
+
+     local = lookup_local( ref, catcher );
+     if (!local) {
+          local = new_local( dev, ref, catcher );
+          if (!local)
+               return -ENOMEM;
+     }
 
      throw_ = fusion_core_malloc( fusion_core, sizeof(Throw) );
      if (!throw_)
           return -ENOMEM;
 
-     throw_->fusion_id = fusion_id;
-     throw_->catcher   = catcher;
+     throw_->fusion_id = thrower->fusion_id;
+
+     direct_list_append( &local->catchable, &throw_->link );
 
-     direct_list_append( &ref->throws, &throw_->link );
+     thrower->thrown++;
 
      return 0;
 }
 
-static int add_local(FusionRef * ref, FusionID fusion_id, int add)
+static int add_local(FusionRef * ref, FusionID fusion_id, int add, int *ret_diff)
 {
-     FusionLink *l;
      LocalRef *local;
 
-     fusion_list_foreach(l, ref->local_refs) {
-          local = (LocalRef *) l;
+     local = lookup_local(ref, fusion_id);
+     if (local) {
+          if (local->counter)
+               return add_counter(local, add, ret_diff);
 
-          if (local->fusion_id == fusion_id) {
-               fusion_list_move_to_front(&ref->local_refs, l);
+          if (local->refs + add < 0)
+               return -EIO;
 
-               if (local->refs + add < 0)
-                    return -EIO;
+          local->refs += add;
 
-               local->refs += add;
-               return 0;
-          }
+          *ret_diff = add;
+          return 0;
      }
 
      /* Can only create local node if value is positive. */
      if (add <= 0)
           return -EIO;
 
-     local = fusion_core_malloc( fusion_core, sizeof(LocalRef) );
+     local = new_local(ref->entry.entries->dev, ref, fusion_id);
      if (!local)
           return -ENOMEM;
 
-     local->fusion_id = fusion_id;
      local->refs = add;
 
-     fusion_list_prepend(&ref->local_refs, &local->link);
+     *ret_diff = add;
 
      return 0;
 }
 
-static void clear_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id)
+static LocalRef *new_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id)
 {
-     FusionLink *l;
+     LocalRef *local;
 
-     if (ref->locked == fusion_id) {
-          ref->locked = 0;
-          fusion_core_wq_wake( fusion_core, &ref->entry.wait);
+     if (!ref->locals && fusion_hash_create( FHT_INT, FHT_PTR, FUSION_HASH_MIN_SIZE, &ref->locals ))
+          return NULL;
+
+     local = fusion_core_cache_alloc( fusion_core, local_ref_cache );
+     if (!local)
+          return NULL;
+
+     local->fusion_id = fusion_id;
+     local->ref       = ref;
+
+     if (fusion_hash_insert( ref->locals, (void *) fusion_id, local )) {
+          fusion_core_cache_free( fusion_core, local_ref_cache, local );
+          return NULL;
      }
 
-     fusion_list_foreach(l, ref->local_refs) {
-          LocalRef *local = (LocalRef *) l;
+     fusionee_own(dev, fusion_id, FUSIONEE_OWNED_LOCAL_REFS, &local->owned, &ref->entry);
 
-          if (local->fusion_id == fusion_id) {
-               fusion_list_remove(&ref->local_refs, l);
+     return local;
+}
 
-               if (local->refs)
-                    propagate_local(dev, ref, -local->refs, true);
+/*
+ * Change a count shared with user space, which may change it concurrently as long
+ * as it stays positive. Returns the difference of the count visible to the kernel.
+ */
+static int add_counter(LocalRef * local, int add, int *ret_diff)
+{
+     int old;
+     int val;
 
-               fusion_core_free( fusion_core, l);
-               break;
-          }
+     do {
+          old = *(volatile int *) local->counter;
+          val = old + add;
+
+          if (val < 0)
+               return -EIO;
+     } while (cmpxchg(local->counter, old, val) != old);
+
+     *ret_diff = (val > 0) - (old > 0);
+
+     local->refs += *ret_diff;
+
+     return 0;
+}
+
+static void lock_ref(FusionDev * dev, FusionRef * ref, FusionID fusion_id)
+{
+     ref->locked = fusion_id;
+
+     fusionee_own(dev, fusion_id, FUSIONEE_OWNED_LOCKED_REFS, &ref->locker, &ref->entry);
+}
+
+static void unlock_ref(FusionDev * dev, FusionRef * ref)
+{
+     ref->locked = 0;
+
+     fusionee_disown(dev, &ref->locker);
+
+     fusion_core_wq_wake( fusion_core, &ref->entry.wait);
+}
+
+static void clear_local(FusionDev * dev, LocalRef * local)
+{
+     FusionRef *ref = local->ref;
+
+     fusion_hash_remove(ref->locals, (void *) local->fusion_id, NULL, NULL);
+
+     fusionee_disown(dev, &local->owned);
+
+     free_catchable(ref, local);
+
+     if (local->refs)
+          propagate_local(dev, ref, -local->refs, true);
+
+     if (local->counter) {
+          fusion_counter_free(local->counters, local->counter);
+
+          ref->shared--;
      }
+
+     fusion_core_cache_free( fusion_core, local_ref_cache, local );
 }
 
-static int
-fork_local(FusionDev * dev, FusionRef * ref, FusionID fusion_id,
-           FusionID from_id)
+static void fork_local(FusionDev * dev, LocalRef * local)
 {
-     FusionLink *l;
-     int ret = 0;
+     int diff;
 
-     fusion_list_foreach(l, ref->local_refs) {
-          LocalRef *local = (LocalRef *) l;
+     if (local->counter) {
+          if (*local->counter > 0 && !add_counter(local, 1, &diff) && diff)
+               propagate_local(dev, local->ref, diff, false);
+     }
+     else if (local->refs) {
+          local->refs++;
+     }
+}
 
-          if (local->fusion_id == from_id) {
-               if (local->refs) {
-                    local->refs++;
-               }
-               break;
-          }
+/*
+ * Drop references thrown to a fusionee that is gone, they stay with the throwers.
+ */
+static void free_catchable(FusionRef * ref, LocalRef * local)
+{
+     FusionLink *l, *n;
+
+     fusion_list_foreach_safe(l, n, local->catchable) {
+          Throw    *throw_  = (Throw *) l;
+          LocalRef *thrower = lookup_local(ref, throw_->fusion_id);
+
+          if (thrower)
+               thrower->thrown--;
+
+          fusion_core_free( fusion_core, throw_ );
      }
 
-     return ret;
+     local->catchable = NULL;
 }
 
-static void free_all_local(FusionRef * ref)
+static void free_all_local(FusionDev * dev, FusionRef * ref)
 {
-     FusionLink *l = ref->local_refs;
+     LocalRef           *local;
+     FusionHashIterator  it;
 
-     while (l) {
-          FusionLink *next = l->next;
+     if (!ref->locals)
+          return;
 
-          fusion_core_free( fusion_core, l);
+     fusion_hash_foreach (local, it, ref->locals) {
+          FusionLink *l, *n;
 
-          l = next;
+          fusionee_disown(dev, &local->owned);
+
+          fusion_list_foreach_safe(l, n, local->catchable)
+               fusion_core_free( fusion_core, l );
+
+          if (local->counter)
+               fusion_counter_free(local->counters, local->counter);
+
+          fusion_core_cache_free( fusion_core, local_ref_cache, local );
      }
 
-     ref->local_refs = NULL;
+     fusion_hash_destroy(ref->locals);
+
+     ref->locals = NULL;
+     ref->shared = 0;
 }
 
 static void notify_ref(FusionDev * dev, FusionRef * ref, bool async)
@@ -704,3 +956,18 @@ static void drop_inheritors(FusionDev * dev, FusionRef * ref)
 
      ref->inheritors = NULL;
 }
+
+/*
+ * With only the ref being locked (shared locking mode), changes must not propagate
+ * to inheritors or trigger a watch call, which both need the world locked exclusively.
+ */
+static bool need_exclusive(FusionDev * dev, FusionRef * ref, int diff)
+{
+     if (fusion_dev_exclusive(dev))
+          return false;
+
+     if (ref->inheritors)
+          return true;
+
+     return ref->watched && ref->global + ref->local + diff == 0;
+}
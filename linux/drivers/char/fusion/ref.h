@@ -49,13 +49,15 @@ int fusion_ref_inherit(FusionDev * dev, int id, int from);
 
 int fusion_ref_set_sync(FusionDev * dev, int id);
 
+int fusion_ref_share(FusionDev * dev, Fusionee *fusionee, int id, unsigned int *ret_index);
+
 int fusion_ref_destroy(FusionDev * dev, int id);
 
 /* internal functions */
 
-void fusion_ref_clear_all_local(FusionDev * dev, FusionID fusion_id);
+void fusion_ref_clear_all_local(FusionDev * dev, Fusionee * fusionee);
 
 int fusion_ref_fork_all_local(FusionDev * dev,
-                              FusionID fusion_id, FusionID from_id);
+                              Fusionee * fusionee, Fusionee * from);
 
 #endif
@@ -47,6 +47,8 @@ typedef struct {
      FusionID fusion_id;
 
      int count;          /* number of attach calls */
+
+     FusioneeOwnedLink owned;     /* in the list of the fusionee */
 } SHMPoolNode;
 
 typedef struct {
@@ -72,10 +74,10 @@ typedef struct {
 
 static SHMPoolNode *get_node(FusionSHMPool * shmpool, FusionID fusion_id);
 
-static void remove_node(FusionSHMPool * shmpool, FusionID fusion_id);
+static void free_node(FusionSHMPool * shmpool, SHMPoolNode * node);
 
 static int fork_node(FusionSHMPool * shmpool,
-                     FusionID fusion_id, FusionID from_id);
+                     FusionID fusion_id, SHMPoolNode * node);
 
 static void free_all_nodes(FusionSHMPool * shmpool);
 
@@ -83,8 +85,13 @@ static void free_all_nodes(FusionSHMPool * shmpool);
 
 #if FUSION_SHM_PER_WORLD_SPACE
 #define dev_shared (dev)
+#define dev_shared_lock(dev)     do {} while (0)
+#define dev_shared_unlock(dev)   do {} while (0)
 #else
+/* The address space is shared by all worlds, so it's protected by the core lock. */
 #define dev_shared (dev->shared)
+#define dev_shared_lock(dev)     fusion_core_lock( fusion_core )
+#define dev_shared_unlock(dev)   fusion_core_unlock( fusion_core )
 #endif
 
 /******************************************************************************/
@@ -110,7 +117,10 @@ fusion_shmpool_construct( FusionEntry * entry, void *ctx, void *create_ctx )
      FusionDev        *dev     = (FusionDev *)ctx;
      FusionSHMPoolNew *poolnew = create_ctx;
 
+     dev_shared_lock( dev );
+
      if ((ulong) dev_shared->addr_base + poolnew->max_size >= dev->shm_base + fusion_shm_size) {
+          dev_shared_unlock( dev );
           printk(KERN_WARNING
                  "%s: virtual address space exhausted! (FIXME)\n",
                  __FUNCTION__);
@@ -119,8 +129,10 @@ fusion_shmpool_construct( FusionEntry * entry, void *ctx, void *create_ctx )
 
 #ifdef FUSION_CORE_SHMPOOLS
      shmpool->kernel_base = fusion_core_malloc(fusion_core, poolnew->max_size);
-     if(!shmpool->kernel_base)
+     if(!shmpool->kernel_base) {
+          dev_shared_unlock( dev );
           return -ENOMEM;
+     }
 #endif
 
      shmpool->max_size = poolnew->max_size;
@@ -131,6 +143,8 @@ fusion_shmpool_construct( FusionEntry * entry, void *ctx, void *create_ctx )
 
      shmpool->addr_entry = add_addr_entry( dev, dev_shared->addr_base );
 
+     dev_shared_unlock( dev );
+
      return 0;
 }
 
@@ -143,6 +157,8 @@ fusion_shmpool_destruct( FusionEntry * entry, void *ctx )
 
      free_all_nodes(shmpool);
 
+     dev_shared_lock( dev );
+
      fusion_list_remove( &dev_shared->addr_entries, &shmpool->addr_entry->link );
 
      /*
@@ -158,6 +174,8 @@ fusion_shmpool_destruct( FusionEntry * entry, void *ctx )
           if (addr_entry->next_base > dev_shared->addr_base)
                dev_shared->addr_base = addr_entry->next_base;
      }
+
+     dev_shared_unlock( dev );
 }
 
 static void
@@ -182,7 +200,11 @@ FUSION_ENTRY_CLASS(FusionSHMPool, shmpool, fusion_shmpool_construct,
 /******************************************************************************/
 int fusion_shmpool_init(FusionDev * dev)
 {
-     fusion_entries_init(&dev->shmpool, &shmpool_class, dev, dev);
+     int ret;
+
+     ret = fusion_entries_init(&dev->shmpool, &shmpool_class, dev, dev);
+     if (ret)
+          return ret;
 
      fusion_entries_create_proc_entry(dev, "shmpools", &dev->shmpool);
 
@@ -222,7 +244,7 @@ fusion_shmpool_attach(FusionDev * dev,
      if (ret)
           return ret;
 
-     dev->stat.shmpool_attach++;
+     atomic_inc( &dev->stat.shmpool_attach );
 
      node = get_node(shmpool, fusion_id);
      if (!node) {
@@ -234,6 +256,8 @@ fusion_shmpool_attach(FusionDev * dev,
           node->count = 1;
 
           fusion_list_prepend(&shmpool->nodes, &node->link);
+
+          fusionee_own(dev, fusion_id, FUSIONEE_OWNED_SHMPOOL_NODES, &node->owned, &shmpool->entry);
      }
      else
           node->count++;
@@ -254,16 +278,14 @@ int fusion_shmpool_detach(FusionDev * dev, int id, FusionID fusion_id)
      if (ret)
           return ret;
 
-     dev->stat.shmpool_detach++;
+     atomic_inc( &dev->stat.shmpool_detach );
 
      node = get_node(shmpool, fusion_id);
      if (!node)
           return -EIO;
 
-     if (!--node->count) {
-          fusion_list_remove(&shmpool->nodes, &node->link);
-          fusion_core_free( fusion_core, node);
-     }
+     if (!--node->count)
+          free_node(shmpool, node);
 
      return 0;
 }
@@ -311,27 +333,31 @@ int fusion_shmpool_destroy(FusionDev * dev, int id)
      return fusion_entry_destroy(&dev->shmpool, id);
 }
 
-void fusion_shmpool_detach_all(FusionDev * dev, FusionID fusion_id)
+void fusion_shmpool_detach_all(FusionDev * dev, Fusionee * fusionee)
 {
-     FusionLink *l;
+     FusionLink *l, *n;
+
+     fusion_list_foreach_safe(l, n, fusionee_owned(dev, fusionee, FUSIONEE_OWNED_SHMPOOL_NODES)) {
+          FusioneeOwnedLink *owned = (FusioneeOwnedLink *) l;
 
-     fusion_list_foreach(l, dev->shmpool.list) {
-          FusionSHMPool *shmpool = (FusionSHMPool *) l;
+          if (owned->fusion_id != fusionee->id)
+               continue;
 
-          remove_node(shmpool, fusion_id);
+          free_node((FusionSHMPool *) owned->entry, container_of(owned, SHMPoolNode, owned));
      }
 }
 
 int
-fusion_shmpool_fork_all(FusionDev * dev, FusionID fusion_id, FusionID from_id)
+fusion_shmpool_fork_all(FusionDev * dev, Fusionee * fusionee, Fusionee * from)
 {
      FusionLink *l;
      int ret = 0;
 
-     fusion_list_foreach(l, dev->shmpool.list) {
-          FusionSHMPool *shmpool = (FusionSHMPool *) l;
+     fusion_list_foreach(l, fusionee_owned(dev, from, FUSIONEE_OWNED_SHMPOOL_NODES)) {
+          FusioneeOwnedLink *owned = (FusioneeOwnedLink *) l;
 
-          ret = fork_node(shmpool, fusion_id, from_id);
+          ret = fork_node((FusionSHMPool *) owned->entry, fusionee->id,
+                          container_of(owned, SHMPoolNode, owned));
           if (ret)
                break;
      }
@@ -380,44 +406,33 @@ static SHMPoolNode *get_node(FusionSHMPool * shmpool, FusionID fusion_id)
      return NULL;
 }
 
-static void remove_node(FusionSHMPool * shmpool, FusionID fusion_id)
+static void free_node(FusionSHMPool * shmpool, SHMPoolNode * node)
 {
-     SHMPoolNode *node;
+     fusion_list_remove(&shmpool->nodes, &node->link);
 
-     fusion_list_foreach(node, shmpool->nodes) {
-          if (node->fusion_id == fusion_id) {
-               fusion_list_remove(&shmpool->nodes, &node->link);
-               break;
-          }
-     }
+     fusionee_disown(shmpool->entry.entries->dev, &node->owned);
+
+     fusion_core_free( fusion_core, node);
 }
 
 static int
-fork_node(FusionSHMPool * shmpool, FusionID fusion_id, FusionID from_id)
+fork_node(FusionSHMPool * shmpool, FusionID fusion_id, SHMPoolNode * node)
 {
-     int ret = 0;
-     SHMPoolNode *node;
-
-     fusion_list_foreach(node, shmpool->nodes) {
-          if (node->fusion_id == from_id) {
-               SHMPoolNode *new_node;
+     SHMPoolNode *new_node;
 
-               new_node = fusion_core_malloc( fusion_core, sizeof(SHMPoolNode) );
-               if (!new_node) {
-                    ret = -ENOMEM;
-                    break;
-               }
+     new_node = fusion_core_malloc( fusion_core, sizeof(SHMPoolNode) );
+     if (!new_node)
+          return -ENOMEM;
 
-               new_node->fusion_id = fusion_id;
-               new_node->count = node->count;
+     new_node->fusion_id = fusion_id;
+     new_node->count = node->count;
 
-               fusion_list_prepend(&shmpool->nodes, &new_node->link);
+     fusion_list_prepend(&shmpool->nodes, &new_node->link);
 
-               break;
-          }
-     }
+     fusionee_own(shmpool->entry.entries->dev, fusion_id, FUSIONEE_OWNED_SHMPOOL_NODES,
+                  &new_node->owned, &shmpool->entry);
 
-     return ret;
+     return 0;
 }
 
 static void free_all_nodes(FusionSHMPool * shmpool)
@@ -425,9 +440,6 @@ static void free_all_nodes(FusionSHMPool * shmpool)
      FusionLink *n;
      SHMPoolNode *node;
 
-     fusion_list_foreach_safe(node, n, shmpool->nodes) {
-          fusion_core_free( fusion_core, node);
-     }
-
-     shmpool->nodes = NULL;
+     fusion_list_foreach_safe(node, n, shmpool->nodes)
+          free_node(shmpool, node);
 }
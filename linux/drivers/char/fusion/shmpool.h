@@ -68,10 +68,10 @@ int fusion_shmpool_destroy(FusionDev * dev, int id);
 
 /* internal functions */
 
-void fusion_shmpool_detach_all(FusionDev * dev, FusionID fusion_id);
+void fusion_shmpool_detach_all(FusionDev * dev, Fusionee * fusionee);
 
 int fusion_shmpool_fork_all(FusionDev * dev,
-                            FusionID fusion_id, FusionID from_id);
+                            Fusionee * fusionee, Fusionee * from);
 
 #ifdef FUSION_CORE_SHMPOOLS
 int fusion_shmpool_map(FusionDev *dev, struct vm_area_struct *vma);
@@ -47,10 +47,10 @@ fusion_core_enter( int          cpu_index,
 
      core->cpu_index = cpu_index;
 
-     sema_init( &core->lock, 1 );
-
      D_MAGIC_SET( core, FusionCore );
 
+     fusion_core_lock_init( core, &core->lock );
+
      *ret_core = core;
 
      return FC_OK;
@@ -61,6 +61,7 @@ fusion_core_exit( FusionCore *core )
 {
      D_MAGIC_ASSERT( core, FusionCore );
 
+     fusion_core_lock_deinit( core, &core->lock );
 
      D_MAGIC_CLEAR( core );
 
@@ -126,20 +127,174 @@ fusion_core_get_pointer( FusionCore      *core,
 }
 
 
+FusionCoreResult
+fusion_core_cache_create( FusionCore   *core,
+                          const char   *name,
+                          size_t        size,
+                          FusionCache **ret_cache )
+{
+     FusionCache *cache;
+
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_ASSERT( ret_cache != NULL );
+
+     cache = kmalloc( sizeof(FusionCache), GFP_KERNEL );
+     if (!cache)
+          return FC_FAILURE;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 23)
+     cache->slab = kmem_cache_create( name, size, 0, SLAB_HWCACHE_ALIGN, NULL );
+#else
+     cache->slab = kmem_cache_create( name, size, 0, SLAB_HWCACHE_ALIGN, NULL, NULL );
+#endif
+     if (!cache->slab) {
+          kfree( cache );
+          return FC_FAILURE;
+     }
+
+     D_MAGIC_SET( cache, FusionCache );
+
+     *ret_cache = cache;
+
+     return FC_OK;
+}
+
+void
+fusion_core_cache_destroy( FusionCore  *core,
+                           FusionCache *cache )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     kmem_cache_destroy( cache->slab );
+
+     D_MAGIC_CLEAR( cache );
+
+     kfree( cache );
+}
+
+void *
+fusion_core_cache_alloc( FusionCore  *core,
+                         FusionCache *cache )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     return kmem_cache_zalloc( cache->slab, GFP_KERNEL );
+}
+
 void
-fusion_core_lock( FusionCore *core )
+fusion_core_cache_free( FusionCore  *core,
+                        FusionCache *cache,
+                        void        *ptr )
 {
      D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( cache, FusionCache );
+
+     if (ptr)
+          kmem_cache_free( cache->slab, ptr );
+}
+
 
-     down( &core->lock );
+void
+fusion_core_lock( FusionCore *core )
+{
+     fusion_core_lock_acquire( core, &core->lock );
 }
 
 void
 fusion_core_unlock( FusionCore *core )
+{
+     fusion_core_lock_release( core, &core->lock );
+}
+
+
+FusionCoreResult
+fusion_core_lock_init( FusionCore *core,
+                       FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+
+     memset( lock, 0, sizeof(FusionLock) );
+
+     init_rwsem( &lock->sem );
+
+     D_MAGIC_SET( lock, FusionLock );
+
+     return FC_OK;
+}
+
+void
+fusion_core_lock_deinit( FusionCore *core,
+                         FusionLock *lock )
 {
      D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
 
-     up( &core->lock );
+     D_MAGIC_CLEAR( lock );
+}
+
+void
+fusion_core_lock_acquire( FusionCore *core,
+                          FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     down_write( &lock->sem );
+
+     lock->owner = current;
+}
+
+bool
+fusion_core_lock_tryacquire( FusionCore *core,
+                             FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     if (!down_write_trylock( &lock->sem ))
+          return false;
+
+     lock->owner = current;
+
+     return true;
+}
+
+void
+fusion_core_lock_acquire_shared( FusionCore *core,
+                                 FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     down_read( &lock->sem );
+}
+
+void
+fusion_core_lock_release( FusionCore *core,
+                          FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     if (lock->owner == current) {
+          lock->owner = NULL;
+
+          up_write( &lock->sem );
+     }
+     else
+          up_read( &lock->sem );
+}
+
+bool
+fusion_core_lock_exclusive( FusionCore *core,
+                            FusionLock *lock )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( lock, FusionLock );
+
+     return lock->owner == current;
 }
 
 
@@ -168,30 +323,63 @@ fusion_core_wq_deinit( FusionCore      *core,
      D_MAGIC_CLEAR( queue );
 }
 
-void
-fusion_core_wq_wait( FusionCore      *core,
-                     FusionWaitQueue *queue,
-                     int             *timeout_ms,
-                     bool             interruptible )
+static inline void
+relock( FusionCore *core,
+        FusionLock *lock,
+        bool        exclusive )
 {
+     if (exclusive)
+          fusion_core_lock_acquire( core, lock );
+     else
+          fusion_core_lock_acquire_shared( core, lock );
+}
+
+static void
+wq_wait( FusionCore      *core,
+         FusionWaitQueue *queue,
+         FusionLock      *outer,
+         FusionLock      *inner,
+         int             *timeout_ms,
+         bool             interruptible,
+         bool             exclusive,
+         struct task_struct *handoff )
+{
+     bool outer_exclusive = fusion_core_lock_exclusive( core, outer );
+     bool inner_exclusive = inner && fusion_core_lock_exclusive( core, inner );
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
      DEFINE_WAIT(wait);
 
      D_MAGIC_ASSERT( core, FusionCore );
      D_MAGIC_ASSERT( queue, FusionWaitQueue );
 
-     prepare_to_wait( &queue->queue, &wait, interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE );
+     if (exclusive)
+          prepare_to_wait_exclusive( &queue->queue, &wait, interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE );
+     else
+          prepare_to_wait( &queue->queue, &wait, interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE );
+
+     if (inner)
+          fusion_core_lock_release( core, inner );
 
-     fusion_core_unlock( core );
+     fusion_core_lock_release( core, outer );
 
      if (timeout_ms)
           *timeout_ms = schedule_timeout(*timeout_ms);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+     /* Yielding schedules away already, unless the task is running or can't be yielded to. */
+     else if (!handoff || yield_to( handoff, true ) <= 0)
+          schedule();
+#else
      else
           schedule();
+#endif
 
      finish_wait( &queue->queue, &wait );
 
-     fusion_core_lock( core );
+     relock( core, outer, outer_exclusive );
+
+     if (inner)
+          relock( core, inner, inner_exclusive );
 #else
      wait_queue_t wait;
 
@@ -203,17 +391,28 @@ fusion_core_wq_wait( FusionCore      *core,
      current->state = interruptible ? TASK_INTERRUPTIBLE : TASK_UNINTERRUPTIBLE;
 
      write_lock( &queue->queue.lock);
-     __add_wait_queue( &queue->queue, &wait);
+     if (exclusive) {
+          wait.flags |= WQ_FLAG_EXCLUSIVE;
+          __add_wait_queue_tail( &queue->queue, &wait);
+     }
+     else
+          __add_wait_queue( &queue->queue, &wait);
      write_unlock( &queue->queue.lock );
 
-     fusion_core_unlock( core );
+     if (inner)
+          fusion_core_lock_release( core, inner );
+
+     fusion_core_lock_release( core, outer );
 
      if (timeout_ms)
           *timeout_ms = schedule_timeout(*timeout_ms);
      else
           schedule();
 
-     fusion_core_lock( core );
+     relock( core, outer, outer_exclusive );
+
+     if (inner)
+          relock( core, inner, inner_exclusive );
 
      write_lock( &queue->queue.lock );
      __remove_wait_queue( &queue->queue, &wait );
@@ -221,6 +420,47 @@ fusion_core_wq_wait( FusionCore      *core,
 #endif
 }
 
+void
+fusion_core_wq_wait_nested( FusionCore      *core,
+                            FusionWaitQueue *queue,
+                            FusionLock      *outer,
+                            FusionLock      *inner,
+                            int             *timeout_ms,
+                            bool             interruptible )
+{
+     wq_wait( core, queue, outer, inner, timeout_ms, interruptible, false, NULL );
+}
+
+void
+fusion_core_wq_wait( FusionCore      *core,
+                     FusionWaitQueue *queue,
+                     FusionLock      *lock,
+                     int             *timeout_ms,
+                     bool             interruptible )
+{
+     wq_wait( core, queue, lock, NULL, timeout_ms, interruptible, false, NULL );
+}
+
+void
+fusion_core_wq_wait_exclusive( FusionCore      *core,
+                               FusionWaitQueue *queue,
+                               FusionLock      *lock,
+                               int             *timeout_ms,
+                               bool             interruptible )
+{
+     wq_wait( core, queue, lock, NULL, timeout_ms, interruptible, true, NULL );
+}
+
+void
+fusion_core_wq_wait_handoff( FusionCore         *core,
+                             FusionWaitQueue    *queue,
+                             FusionLock         *lock,
+                             struct task_struct *task,
+                             bool                interruptible )
+{
+     wq_wait( core, queue, lock, NULL, NULL, interruptible, false, task );
+}
+
 void
 fusion_core_wq_wake( FusionCore      *core,
                      FusionWaitQueue *queue )
@@ -231,3 +471,29 @@ fusion_core_wq_wake( FusionCore      *core,
      wake_up_all( &queue->queue );
 }
 
+void
+fusion_core_wq_wake_one( FusionCore      *core,
+                         FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+     wake_up( &queue->queue );
+}
+
+void
+fusion_core_wq_wake_sync( FusionCore      *core,
+                          FusionWaitQueue *queue )
+{
+     D_MAGIC_ASSERT( core, FusionCore );
+     D_MAGIC_ASSERT( queue, FusionWaitQueue );
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+     __wake_up_sync( &queue->queue, TASK_NORMAL );
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
+     __wake_up_sync( &queue->queue, TASK_NORMAL, 1 );
+#else
+     wake_up_all( &queue->queue );
+#endif
+}
+
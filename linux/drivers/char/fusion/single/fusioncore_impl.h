@@ -23,15 +23,32 @@
 #include <asm/semaphore.h>
 #endif
 
+#include <linux/rwsem.h>
+#include <linux/slab.h>
 #include <linux/wait.h>
 
 
+typedef struct {
+     int                 magic;
+
+     struct rw_semaphore sem;
+     struct task_struct *owner;     /* holder of the exclusive lock */
+} FusionLock;
+
+
+typedef struct {
+     int                 magic;
+
+     struct kmem_cache  *slab;
+} FusionCache;
+
+
 struct __Fusion_FusionCore {
      int                 magic;
 
      int                 cpu_index;
 
-     struct semaphore    lock;
+     FusionLock          lock;
 
      void               *pointers[10];
 };
@@ -33,6 +33,7 @@
 #include "fusionee.h"
 #include "list.h"
 #include "skirmish.h"
+#include "slots.h"
 
 #define MAX_PRE_ACQUISITIONS  256
 
@@ -40,9 +41,22 @@
 
 typedef struct __FUSION_FusionSkirmish FusionSkirmish;
 
+/*
+ * Entry of a skirmish in the holder index, see skirmish_index().
+ */
+typedef struct {
+     FusionLink      link;
+
+     FusionSkirmish *skirmish;
+
+     int             pid;     /* zero if not indexed */
+} SkirmishHolding;
+
 struct __FUSION_FusionSkirmish {
      FusionEntry entry;
 
+     FusionSlot *slot;   /* non-NULL if shared with user space */
+
      int lock_fid;       /* non-zero if locked */
      int lock_pid;
      int lock_count;
@@ -65,6 +79,11 @@ struct __FUSION_FusionSkirmish {
      int transfer2_count;
      unsigned int transfer2_serial;
 
+     SkirmishHolding holdings[3];  /* by lock_pid, transfer_from_pid and transfer2_from_pid */
+     SkirmishHolding sharing;      /* in the list of skirmishs having a slot */
+
+     FusionSkirmish *next_candidate;
+
 #ifdef FUSION_DEBUG_SKIRMISH_DEADLOCK
      int pre_acquis[MAX_PRE_ACQUISITIONS];
 
@@ -144,6 +163,128 @@ print_skirmish( FusionSkirmish* skirmish )
 
 /******************************************************************************/
 
+static inline unsigned int
+holder_bucket(int pid)
+{
+     return (unsigned int) pid % SKIRMISH_HOLDER_BUCKETS;
+}
+
+/*
+ * Keep the holder index in sync with the lock and transfer state,
+ * called whenever the state of the skirmish may have changed.
+ *
+ * A skirmish is indexed by the pids holding it in the kernel or having transferred it.
+ * Entries are allowed to be stale, but a skirmish must never be missing.
+ */
+static void
+skirmish_index(FusionDev * dev, FusionSkirmish * skirmish)
+{
+     int  i;
+     int  pids[3];
+     bool locked = false;
+
+     pids[0] = (skirmish->lock_pid > 0) ? skirmish->lock_pid : 0;
+     pids[1] = skirmish->transfer_to  ? skirmish->transfer_from_pid  : 0;
+     pids[2] = skirmish->transfer2_to ? skirmish->transfer2_from_pid : 0;
+
+     for (i = 0; i < D_ARRAY_SIZE(pids); i++) {
+          SkirmishHolding *holding = &skirmish->holdings[i];
+
+          if (holding->pid == pids[i])
+               continue;
+
+          /* Other skirmishs may be updated concurrently in shared locking mode. */
+          if (!locked && !fusion_dev_exclusive( dev )) {
+               fusion_core_lock_acquire( fusion_core, &dev->skirmish_index.lock );
+               locked = true;
+          }
+
+          if (holding->pid)
+               fusion_list_remove( &dev->skirmish_index.holders[holder_bucket(holding->pid)], &holding->link );
+
+          holding->skirmish = skirmish;
+          holding->pid      = pids[i];
+
+          if (holding->pid)
+               fusion_list_prepend( &dev->skirmish_index.holders[holder_bucket(holding->pid)], &holding->link );
+     }
+
+     if (locked)
+          fusion_core_lock_release( fusion_core, &dev->skirmish_index.lock );
+}
+
+static inline bool
+holding_matches(const SkirmishHolding * holding, int pid)
+{
+     return holding->pid && (!pid || holding->pid == pid);
+}
+
+/*
+ * Collect the skirmishs indexed for the pid (or any pid if zero) and optionally those having
+ * a slot held in user space by the thread (or fusionee if pid is zero), each one once.
+ * Requires the world to be locked exclusively.
+ */
+static FusionSkirmish *
+skirmish_candidates(FusionDev * dev, int pid, FusionID fusion_id, bool sharing)
+{
+     unsigned int     i;
+     int              n;
+     SkirmishHolding *holding;
+     FusionSkirmish  *skirmish;
+     FusionSkirmish  *candidates = NULL;
+
+     FUSION_ASSERT( fusion_dev_exclusive( dev ) );
+
+     for (i = 0; i < SKIRMISH_HOLDER_BUCKETS; i++) {
+          if (pid && i != holder_bucket(pid))
+               continue;
+
+          fusion_list_foreach (holding, dev->skirmish_index.holders[i]) {
+               if (!holding_matches( holding, pid ))
+                    continue;
+
+               skirmish = holding->skirmish;
+
+               /* Only take the first matching holding of each skirmish. */
+               for (n = 0; &skirmish->holdings[n] != holding; n++) {
+                    if (holding_matches( &skirmish->holdings[n], pid ))
+                         break;
+               }
+
+               if (&skirmish->holdings[n] != holding)
+                    continue;
+
+               skirmish->next_candidate = candidates;
+               candidates = skirmish;
+          }
+     }
+
+     if (sharing) {
+          fusion_list_foreach (holding, dev->skirmish_index.shared) {
+               skirmish = holding->skirmish;
+
+               /* Only read the state, others are synchronized when locked. */
+               if (!fusion_slot_held_by( skirmish->slot, pid, fusion_id ))
+                    continue;
+
+               for (n = 0; n < D_ARRAY_SIZE(skirmish->holdings); n++) {
+                    if (holding_matches( &skirmish->holdings[n], pid ))
+                         break;
+               }
+
+               if (n < D_ARRAY_SIZE(skirmish->holdings))
+                    continue;
+
+               skirmish->next_candidate = candidates;
+               candidates = skirmish;
+          }
+     }
+
+     return candidates;
+}
+
+/******************************************************************************/
+
 static void
 fusion_skirmish_print(FusionEntry * entry, void *ctx, struct seq_file *p)
 {
@@ -189,20 +330,98 @@ fusion_skirmish_print(FusionEntry * entry, void *ctx, struct seq_file *p)
                 skirmish->entry.waiters
                );
 
+     if (skirmish->slot)
+          seq_printf(p, ", slot:0x%08x c:%u f:%u",
+                     (unsigned int) skirmish->slot->state,
+                     skirmish->slot->count,
+                     FUSION_SLOT_FUSION_ID(skirmish->slot->state)
+                    );
+
      for (i = 0; i < skirmish->entry.waiters; i++)
           seq_printf(p, " %d", skirmish->entry.waiters_list[i]);
 
      seq_printf(p, "\n");
 }
 
-FUSION_ENTRY_CLASS(FusionSkirmish, skirmish, NULL, NULL, fusion_skirmish_print)
+static void
+fusion_skirmish_destruct(FusionEntry * entry, void *ctx)
+{
+     FusionSkirmish *skirmish = (FusionSkirmish *) entry;
+     FusionDev      *dev      = (FusionDev *) ctx;
+
+     int             i;
+     SkirmishHolding *holding;
+
+     for (i = 0; i < D_ARRAY_SIZE(skirmish->holdings); i++) {
+          holding = &skirmish->holdings[i];
+
+          if (holding->pid)
+               fusion_list_remove( &dev->skirmish_index.holders[holder_bucket(holding->pid)], &holding->link );
+     }
+
+     if (skirmish->slot) {
+          fusion_list_remove( &dev->skirmish_index.shared, &skirmish->sharing.link );
+
+          fusion_slot_free(dev, skirmish->slot);
+     }
+}
+
+FUSION_ENTRY_CLASS(FusionSkirmish, skirmish, NULL, fusion_skirmish_destruct, fusion_skirmish_print)
+
+/******************************************************************************/
+
+/*
+ * Take over the state of a shared skirmish held in user space by the thread or fusionee.
+ */
+static void
+slot_sync_in(FusionSkirmish * skirmish, int pid, FusionID fusion_id)
+{
+     int lock_pid;
+     int lock_fid;
+     int lock_count;
+
+     if (fusion_slot_take(skirmish->slot, pid, fusion_id, &lock_pid, &lock_fid, &lock_count)) {
+          skirmish->lock_fid   = lock_fid;
+          skirmish->lock_pid   = lock_pid;
+          skirmish->lock_count = lock_count;
+     }
+}
+
+/*
+ * Hand the state of a shared skirmish back to user space, unless it's being transferred.
+ */
+static void
+slot_sync_out(FusionSkirmish * skirmish)
+{
+     FusionSlot *slot = skirmish->slot;
+
+     if (!slot || !(slot->state & FUSION_SLOT_KERNEL))
+          return;
+
+     if (skirmish->lock_pid < 0 || skirmish->transfer_to || skirmish->transfer2_to)
+          return;
+
+     fusion_slot_give(slot, skirmish->lock_pid, skirmish->lock_fid,
+                      skirmish->lock_count, skirmish->entry.waiters > 0);
+
+     skirmish->lock_fid   = 0;
+     skirmish->lock_pid   = 0;
+     skirmish->lock_count = 0;
+}
 
 /******************************************************************************/
 int fusion_skirmish_init(FusionDev * dev)
 {
+     int ret;
+
      FUSION_DEBUG("%s \n", __FUNCTION__);
 
-     fusion_entries_init(&dev->skirmish, &skirmish_class, dev, dev);
+     ret = fusion_entries_init(&dev->skirmish, &skirmish_class, dev, dev);
+     if (ret)
+          return ret;
+
+     if (!dev->refs)
+          fusion_core_lock_init( fusion_core, &dev->skirmish_index.lock );
 
      fusion_entries_create_proc_entry(dev, "skirmishs", &dev->skirmish);
 
@@ -216,6 +435,9 @@ void fusion_skirmish_deinit(FusionDev * dev)
      fusion_entries_destroy_proc_entry( dev, "skirmishs" );
 
      fusion_entries_deinit(&dev->skirmish);
+
+     if (!dev->refs)
+          fusion_core_lock_deinit( fusion_core, &dev->skirmish_index.lock );
 }
 
 /******************************************************************************/
@@ -231,26 +453,41 @@ int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
      FusionSkirmish *skirmish;
 #ifdef FUSION_DEBUG_SKIRMISH_DEADLOCK
      FusionSkirmish *s;
+     FusionSkirmish *held;
      int i;
      bool outer = true;
 #endif
 
      FUSION_DEBUG( "%s( id %d, fusion_id %d )\n", __FUNCTION__, id, fusion_id);
-     dev->stat.skirmish_prevail_swoop++;
+
+#ifdef FUSION_DEBUG_SKIRMISH_DEADLOCK
+     /* Deadlock detection looks at all skirmishs. */
+     if (!fusion_dev_exclusive( dev ))
+          return FUSION_RESTART_EXCLUSIVE;
+#endif
+
+     atomic_inc( &dev->stat.skirmish_prevail_swoop );
 
      ret = fusion_skirmish_lookup(&dev->skirmish, id, &skirmish);
      if (ret)
           return ret;
 
+     slot_sync_in( skirmish, fusion_core_pid( fusion_core ), 0 );
+
      if (skirmish->lock_pid == fusion_core_pid( fusion_core )) {
           skirmish->lock_count++;
           skirmish->lock_total++;
+          slot_sync_out( skirmish );
+          skirmish_index( dev, skirmish );
+          fusion_skirmish_unlock( skirmish );
           return 0;
      }
 #ifdef FUSION_DEBUG_SKIRMISH_DEADLOCK
+     held = skirmish_candidates( dev, fusion_core_pid( fusion_core ), 0, false );
+
      /* look in currently acquired skirmishs for this one being
         a pre-acquisition, indicating a potential deadlock */
-     fusion_list_foreach(s, dev->skirmish.list) {
+     for (s = held; s; s = s->next_candidate) {
           if (s->lock_pid != fusion_core_pid( fusion_core ))
                continue;
 
@@ -272,7 +509,7 @@ int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
 
      /* remember all previously acquired skirmishs being pre-acquisitions for
         this one, to detect potential deadlocks due to a lock order twist */
-     fusion_list_foreach(s, dev->skirmish.list) {
+     for (s = held; s; s = s->next_candidate) {
           int free = -1;
 
           if (s->lock_pid != fusion_core_pid( fusion_core ))
@@ -311,16 +548,19 @@ int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
 #endif
 
 
-     while (   skirmish->lock_pid
-               || (    (skirmish->transfer2_to == 0)
-                       &&  skirmish->transfer_to
-                       && (fusionee_dispatcher_pid(dev, skirmish-> transfer_to) != fusion_core_pid( fusion_core )))
-               || (     skirmish->transfer2_to
-                        && (fusionee_dispatcher_pid(dev, skirmish-> transfer2_to) != fusion_core_pid( fusion_core ))) ) {
-          ret = fusion_skirmish_wait(skirmish, NULL);
-          if (ret)
-               return ret;
-     }
+     do {
+          while (   fusion_slot_held( skirmish->slot, true )
+                    || skirmish->lock_pid
+                    || (    (skirmish->transfer2_to == 0)
+                            &&  skirmish->transfer_to
+                            && (fusionee_dispatcher_pid(dev, skirmish-> transfer_to) != fusion_core_pid( fusion_core )))
+                    || (     skirmish->transfer2_to
+                             && (fusionee_dispatcher_pid(dev, skirmish-> transfer2_to) != fusion_core_pid( fusion_core ))) ) {
+               ret = fusion_skirmish_wait(skirmish, NULL);
+               if (ret)
+                    return ret;
+          }
+     } while (!fusion_slot_acquire( skirmish->slot ));
 
      FUSION_DEBUG( "  -> lock_pid = %d\n", fusion_core_pid( fusion_core ) );
 
@@ -331,6 +571,12 @@ int fusion_skirmish_prevail(FusionDev * dev, int id, int fusion_id)
 
      skirmish->lock_total++;
 
+     slot_sync_out( skirmish );
+
+     skirmish_index( dev, skirmish );
+
+     fusion_skirmish_unlock( skirmish );
+
      return 0;
 }
 
@@ -345,9 +591,12 @@ int fusion_skirmish_swoop(FusionDev * dev, int id, int fusion_id)
      if (ret)
           return ret;
 
-     dev->stat.skirmish_prevail_swoop++;
+     atomic_inc( &dev->stat.skirmish_prevail_swoop );
+
+     slot_sync_in( skirmish, fusion_core_pid( fusion_core ), 0 );
 
-     if (   skirmish->lock_fid
+     if (   fusion_slot_held( skirmish->slot, false )
+            || skirmish->lock_fid
             || (    (skirmish->transfer2_to == 0)
                     &&  skirmish->transfer_to
                     && (fusionee_dispatcher_pid(dev, skirmish->transfer_to) != fusion_core_pid( fusion_core )))
@@ -356,9 +605,18 @@ int fusion_skirmish_swoop(FusionDev * dev, int id, int fusion_id)
           if (skirmish->lock_pid == fusion_core_pid( fusion_core )) {
                skirmish->lock_count++;
                skirmish->lock_total++;
+               slot_sync_out( skirmish );
+               skirmish_index( dev, skirmish );
+               fusion_skirmish_unlock( skirmish );
                return 0;
           }
 
+          fusion_skirmish_unlock( skirmish );
+          return -EAGAIN;
+     }
+
+     if (!fusion_slot_acquire( skirmish->slot )) {
+          fusion_skirmish_unlock( skirmish );
           return -EAGAIN;
      }
 
@@ -370,6 +628,12 @@ int fusion_skirmish_swoop(FusionDev * dev, int id, int fusion_id)
 
      skirmish->lock_total++;
 
+     slot_sync_out( skirmish );
+
+     skirmish_index( dev, skirmish );
+
+     fusion_skirmish_unlock( skirmish );
+
      return 0;
 }
 
@@ -377,14 +641,31 @@ int
 fusion_skirmish_lock_count(FusionDev * dev, int id, int fusion_id,
                            int *ret_lock_count)
 {
-     int ret;
-     FusionSkirmish *skirmish;
+     FusionSkirmish     *skirmish;
+     FusionSlot         *slot;
+     unsigned long long  state;
 
-     ret = fusion_skirmish_lookup(&dev->skirmish, id, &skirmish);
-     if (ret)
-          return ret;
+     /* No locking, only the owner itself modifies the lock count. */
+     rcu_read_lock();
+
+     skirmish = fusion_skirmish_lookup_rcu(&dev->skirmish, id);
+     if (!skirmish) {
+          rcu_read_unlock();
+          *ret_lock_count = 0;
+          return -EINVAL;
+     }
+
+     slot  = skirmish->slot;
+     state = slot ? slot->state : FUSION_SLOT_KERNEL;
 
-     if (skirmish->lock_fid == fusion_id &&
+     if (!(state & FUSION_SLOT_KERNEL)) {
+          if (FUSION_SLOT_FUSION_ID(state) == fusion_id &&
+              (state & FUSION_SLOT_TID_MASK) == fusion_core_pid( fusion_core ))
+               *ret_lock_count = slot->count;
+          else
+               *ret_lock_count = 0;
+     }
+     else if (skirmish->lock_fid == fusion_id &&
          skirmish->lock_pid == fusion_core_pid( fusion_core )) {
           *ret_lock_count = skirmish->lock_count;
      }
@@ -392,6 +673,8 @@ fusion_skirmish_lock_count(FusionDev * dev, int id, int fusion_id,
           *ret_lock_count = 0;
      }
 
+     rcu_read_unlock();
+
      return 0;
 }
 
@@ -407,10 +690,14 @@ int fusion_skirmish_dismiss(FusionDev * dev, int id, int fusion_id)
      if (ret)
           return ret;
 
-     dev->stat.skirmish_dismiss++;
+     atomic_inc( &dev->stat.skirmish_dismiss );
+
+     slot_sync_in( skirmish, fusion_core_pid( fusion_core ), 0 );
 
-     if (skirmish->lock_pid != fusion_core_pid( fusion_core ))
+     if (skirmish->lock_pid != fusion_core_pid( fusion_core )) {
+          fusion_skirmish_unlock( skirmish );
           return -EIO;
+     }
 
      if (--skirmish->lock_count == 0) {
           FUSION_DEBUG( "  -> lock_pid = 0\n" );
@@ -423,6 +710,12 @@ int fusion_skirmish_dismiss(FusionDev * dev, int id, int fusion_id)
           fusion_skirmish_notify(skirmish);
      }
 
+     slot_sync_out( skirmish );
+
+     skirmish_index( dev, skirmish );
+
+     fusion_skirmish_unlock( skirmish );
+
      return 0;
 }
 
@@ -482,7 +775,9 @@ fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
      FUSION_SKIRMISH_LOG("FusionSkirmish: Found entry at %p!\n", skirmish);
 
      /* Statistics... */
-     dev->stat.skirmish_wait++;
+     atomic_inc( &dev->stat.skirmish_wait );
+
+     slot_sync_in( skirmish, fusion_core_pid( fusion_core ), 0 );
 
      /* Check if not a resumed call. */
      if (!wait->lock_count) {
@@ -490,6 +785,9 @@ fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
           if (skirmish->lock_pid != fusion_core_pid( fusion_core )) {
                FUSION_SKIRMISH_LOG
                ("FusionSkirmish: Tried to wait for skirmish not held by the current task!\n");
+               slot_sync_out( skirmish );
+               skirmish_index( dev, skirmish );
+               fusion_skirmish_unlock( skirmish );
                return -EIO;
           }
 
@@ -505,11 +803,19 @@ fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
 
           /* Notify potential notifiers waiting for the entry. */
           fusion_skirmish_notify(skirmish);
+
+          /* Let user space take it meanwhile. */
+          slot_sync_out( skirmish );
+
+          skirmish_index( dev, skirmish );
      }
      /* This might happen when lock count was not initialized. */
      else if (skirmish->lock_pid == fusion_core_pid( fusion_core )) {
           FUSION_SKIRMISH_LOG
           ("FusionSkirmish: Tried to resume wait for skirmish still held by the current task!\n");
+          slot_sync_out( skirmish );
+          skirmish_index( dev, skirmish );
+          fusion_skirmish_unlock( skirmish );
           return -EIO;
      }
 
@@ -562,28 +868,30 @@ fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
      }
 
      /* Wait until the lock can be taken again. */
-     while (skirmish->lock_pid) {
-          ret2 = fusion_skirmish_wait(skirmish, NULL);
-
-          /* Check for normal or unusual results. */
-          switch (ret2) {
-               case 0:
-                    break;
+     do {
+          while (fusion_slot_held( skirmish->slot, true ) || skirmish->lock_pid) {
+               ret2 = fusion_skirmish_wait(skirmish, NULL);
 
-               case -EINTR:
-                    /* Return immediately upon signal. */
-                    FUSION_SKIRMISH_LOG
-                    ("FusionSkirmish: Interrupted while waiting for relock!\n");
-                    return ret2;
+               /* Check for normal or unusual results. */
+               switch (ret2) {
+                    case 0:
+                         break;
 
-               default:
-                    /* Return immediately upon unusual result. */
-                    FUSION_SKIRMISH_LOG
-                    ("FusionSkirmish: Error while waiting for notification (%d)!\n",
-                     ret2);
-                    return ret2;
+                    case -EINTR:
+                         /* Return immediately upon signal. */
+                         FUSION_SKIRMISH_LOG
+                         ("FusionSkirmish: Interrupted while waiting for relock!\n");
+                         return ret2;
+
+                    default:
+                         /* Return immediately upon unusual result. */
+                         FUSION_SKIRMISH_LOG
+                         ("FusionSkirmish: Error while waiting for notification (%d)!\n",
+                          ret2);
+                         return ret2;
+               }
           }
-     }
+     } while (!fusion_slot_acquire( skirmish->slot ));
 
      FUSION_DEBUG( "  -> lock_pid = %d\n", fusion_core_pid( fusion_core ) );
 
@@ -591,6 +899,12 @@ fusion_skirmish_wait_(FusionDev * dev, FusionSkirmishWait * wait,
      skirmish->lock_pid   = fusion_core_pid( fusion_core );
      skirmish->lock_count = wait->lock_count;
 
+     slot_sync_out( skirmish );
+
+     skirmish_index( dev, skirmish );
+
+     fusion_skirmish_unlock( skirmish );
+
      FUSION_SKIRMISH_LOG("FusionSkirmish: ...done (%d).\n", ret);
 
      return ret;
@@ -607,26 +921,38 @@ int fusion_skirmish_notify_(FusionDev * dev, int id, FusionID fusion_id)
      if (ret)
           return ret;
 
-     dev->stat.skirmish_notify++;
+     atomic_inc( &dev->stat.skirmish_notify );
 
-     if (skirmish->lock_pid != fusion_core_pid( fusion_core ))
+     slot_sync_in( skirmish, fusion_core_pid( fusion_core ), 0 );
+
+     if (skirmish->lock_pid != fusion_core_pid( fusion_core )) {
+          slot_sync_out( skirmish );
+          skirmish_index( dev, skirmish );
+          fusion_skirmish_unlock( skirmish );
           return -EIO;
+     }
 
      skirmish->notify_count++;
 
      fusion_skirmish_notify(skirmish);
 
+     slot_sync_out( skirmish );
+
+     skirmish_index( dev, skirmish );
+
+     fusion_skirmish_unlock( skirmish );
+
      return 0;
 }
 
 void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
 
      FUSION_DEBUG("%s: fusion_id=%d\n", __FUNCTION__, fusion_id);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     for (skirmish = skirmish_candidates( dev, 0, fusion_id, true ); skirmish; skirmish = skirmish->next_candidate) {
+          slot_sync_in( skirmish, 0, fusion_id );
 
           if (skirmish->lock_fid == fusion_id) {
                FUSION_DEBUG( "  -> lock_pid = 0\n" );
@@ -662,17 +988,21 @@ void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id)
 
                fusion_core_wq_wake( fusion_core, &skirmish->entry.wait);
           }
+
+          slot_sync_out( skirmish );
+
+          skirmish_index( dev, skirmish );
      }
 }
 
 void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, int pid)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
 
      FUSION_DEBUG("%s: pid=%d\n", __FUNCTION__, pid);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     for (skirmish = skirmish_candidates( dev, pid, 0, true ); skirmish; skirmish = skirmish->next_candidate) {
+          slot_sync_in( skirmish, pid, 0 );
 
           if (skirmish->lock_pid == pid) {
                FUSION_DEBUG( "  -> lock_pid = 0\n" );
@@ -708,6 +1038,10 @@ void fusion_skirmish_dismiss_all_from_pid(FusionDev * dev, int pid)
 
                fusion_core_wq_wake( fusion_core, &skirmish->entry.wait);
           }
+
+          slot_sync_out( skirmish );
+
+          skirmish_index( dev, skirmish );
      }
 }
 
@@ -715,12 +1049,12 @@ void
 fusion_skirmish_transfer_all(FusionDev * dev,
                              FusionID to, FusionID from, int from_pid, unsigned int serial)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
 
      FUSION_DEBUG("%s: to=%ld, from=%ld, from_pid=%d, serial=%d\n", __FUNCTION__, to, from, from_pid, serial );
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
+     for (skirmish = skirmish_candidates( dev, from_pid, 0, true ); skirmish; skirmish = skirmish->next_candidate) {
+          slot_sync_in( skirmish, from_pid, 0 );
 
           if (skirmish->lock_pid == from_pid) {
                if (skirmish->transfer_to == 0) {
@@ -764,18 +1098,20 @@ fusion_skirmish_transfer_all(FusionDev * dev,
                     fusion_core_wq_wake( fusion_core, &skirmish->entry.wait);
                }
           }
+
+          slot_sync_out( skirmish );
+
+          skirmish_index( dev, skirmish );
      }
 }
 
 void fusion_skirmish_reclaim_all(FusionDev * dev, int from_pid)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
 
      FUSION_DEBUG("%s: from_pid=%d\n", __FUNCTION__, from_pid);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
-
+     for (skirmish = skirmish_candidates( dev, from_pid, 0, false ); skirmish; skirmish = skirmish->next_candidate) {
           if ((skirmish->transfer2_to == 0)
               &&  skirmish->transfer_to
               && (skirmish->transfer_from_pid == from_pid) ) {
@@ -816,18 +1152,20 @@ void fusion_skirmish_reclaim_all(FusionDev * dev, int from_pid)
                skirmish->transfer2_from_pid = 0;
                skirmish->transfer2_count    = 0;
           }
+
+          slot_sync_out( skirmish );
+
+          skirmish_index( dev, skirmish );
      }
 }
 
 void fusion_skirmish_return_all(FusionDev * dev, int from_fusion_id, int to_pid, unsigned int serial)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
 
      FUSION_DEBUG("%s: from_fusion_id=%d, to_pid=%d, serial=%d\n", __FUNCTION__, from_fusion_id, to_pid, serial);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
-
+     for (skirmish = skirmish_candidates( dev, to_pid, 0, false ); skirmish; skirmish = skirmish->next_candidate) {
           if (skirmish->transfer2_to == 0) {
                if (skirmish->transfer_to       == from_fusion_id &&
                    skirmish->transfer_from_pid == to_pid         &&
@@ -859,18 +1197,18 @@ void fusion_skirmish_return_all(FusionDev * dev, int from_fusion_id, int to_pid,
 
                skirmish->lock_pid = -1;
           }
+
+          skirmish_index( dev, skirmish );
      }
 }
 
 void fusion_skirmish_return_all_from(FusionDev * dev, int from_fusion_id)
 {
-     FusionLink *l;
+     FusionSkirmish *skirmish;
 
      FUSION_DEBUG("%s: from_fusion_id=%d\n", __FUNCTION__, from_fusion_id);
 
-     fusion_list_foreach(l, dev->skirmish.list) {
-          FusionSkirmish *skirmish = (FusionSkirmish *) l;
-
+     for (skirmish = skirmish_candidates( dev, 0, 0, false ); skirmish; skirmish = skirmish->next_candidate) {
           if (skirmish->transfer2_to == 0) {
                if (skirmish->transfer_to == from_fusion_id) {
                     FUSION_ASSERT(skirmish->transfer_from != 0);
@@ -898,6 +1236,45 @@ void fusion_skirmish_return_all_from(FusionDev * dev, int from_fusion_id)
 
                skirmish->lock_pid = -1;
           }
+
+          skirmish_index( dev, skirmish );
      }
 }
 
+
+int fusion_skirmish_share(FusionDev * dev, int id, unsigned int *ret_index)
+{
+     int             ret;
+     FusionSkirmish *skirmish;
+
+     /* Slots are writable by all fusionees, which would bypass permissions. */
+     if (dev->secure)
+          return -EOPNOTSUPP;
+
+     ret = fusion_skirmish_lookup(&dev->skirmish, id, &skirmish);
+     if (ret)
+          return ret;
+
+     if (!skirmish->slot) {
+          ret = fusion_slot_alloc(dev, id, &skirmish->slot, ret_index);
+          if (ret) {
+               fusion_skirmish_unlock( skirmish );
+               return ret;
+          }
+
+          skirmish->sharing.skirmish = skirmish;
+
+          fusion_list_prepend( &dev->skirmish_index.shared, &skirmish->sharing.link );
+
+          /* Hand over the current state unless it's being transferred. */
+          slot_sync_out( skirmish );
+
+          skirmish_index( dev, skirmish );
+     }
+     else
+          *ret_index = skirmish->slot - dev->slots.area;
+
+     fusion_skirmish_unlock( skirmish );
+
+     return 0;
+}
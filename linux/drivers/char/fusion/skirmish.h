@@ -43,6 +43,8 @@ int fusion_skirmish_wait_(FusionDev * dev,
 
 int fusion_skirmish_notify_(FusionDev * dev, int id, FusionID fusion_id);
 
+int fusion_skirmish_share(FusionDev * dev, int id, unsigned int *ret_index);
+
 /* internal functions */
 
 void fusion_skirmish_dismiss_all(FusionDev * dev, int fusion_id);
@@ -0,0 +1,296 @@
+/*
+   (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+   (c) Copyright 2002-2004  Convergence (integrated media) GmbH
+
+   All rights reserved.
+
+   Written by Denis Oliver Kropp <dok@directfb.org>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version
+   2 of the License, or (at your option) any later version.
+*/
+
+#include <linux/version.h>
+#include <linux/module.h>
+#ifdef HAVE_LINUX_CONFIG_H
+#include <linux/config.h>
+#endif
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+#include <linux/fusion.h>
+
+#include "fusiondev.h"
+#include "slots.h"
+
+static int
+slots_alloc_area(FusionSlots * slots)
+{
+     if (slots->area)
+          return 0;
+
+     /* Zeroed, and suitable for remap_vmalloc_range(). */
+     slots->area = vmalloc_user(FUSION_SLOTS_SIZE);
+     if (!slots->area)
+          return -ENOMEM;
+
+     return 0;
+}
+
+void fusion_slots_deinit(FusionDev * dev)
+{
+     if (dev->slots.area) {
+          vfree(dev->slots.area);
+
+          dev->slots.area = NULL;
+     }
+
+     memset(dev->slots.used, 0, sizeof(dev->slots.used));
+}
+
+int fusion_slots_mmap(FusionDev * dev, struct vm_area_struct *vma)
+{
+     int ret;
+
+     /* Nothing is shared in secure worlds, see fusion_skirmish_share(). */
+     if (dev->secure)
+          return -EOPNOTSUPP;
+
+     if (vma->vm_end - vma->vm_start != FUSION_SLOTS_SIZE)
+          return -EINVAL;
+
+     ret = slots_alloc_area(&dev->slots);
+     if (ret)
+          return ret;
+
+     return remap_vmalloc_range(vma, dev->slots.area, 0);
+}
+
+int
+fusion_slot_alloc(FusionDev * dev, int id,
+                  FusionSlot ** ret_slot, unsigned int *ret_index)
+{
+     int         ret;
+     int         index;
+     FusionSlot *slot;
+
+     ret = slots_alloc_area(&dev->slots);
+     if (ret)
+          return ret;
+
+     index = find_first_zero_bit(dev->slots.used, FUSION_SLOTS_NUM);
+     if (index >= FUSION_SLOTS_NUM)
+          return -ENOSPC;
+
+     set_bit(index, dev->slots.used);
+
+     slot = &dev->slots.area[index];
+
+     slot->state = FUSION_SLOT_KERNEL;
+     slot->count = 0;
+     slot->id    = id;
+
+     *ret_slot  = slot;
+     *ret_index = index;
+
+     return 0;
+}
+
+void fusion_slot_free(FusionDev * dev, FusionSlot * slot)
+{
+     int index = slot - dev->slots.area;
+
+     FUSION_ASSERT(index >= 0 && index < FUSION_SLOTS_NUM);
+     FUSION_ASSERT(test_bit(index, dev->slots.used));
+
+     /* Keep user space away from the slot until it's reused. */
+     slot->state = FUSION_SLOT_KERNEL;
+     slot->id    = 0;
+
+     clear_bit(index, dev->slots.used);
+}
+
+static inline bool
+state_held_by(unsigned long long state, int pid, FusionID fusion_id)
+{
+     if (!state || (state & FUSION_SLOT_KERNEL))
+          return false;
+
+     return (state & FUSION_SLOT_TID_MASK) == pid || (fusion_id && FUSION_SLOT_FUSION_ID(state) == fusion_id);
+}
+
+/*
+ * Check if a slot is held in user space by the thread or fusionee, without taking it.
+ */
+bool
+fusion_slot_held_by(FusionSlot * slot, int pid, FusionID fusion_id)
+{
+     return slot && state_held_by(READ_ONCE(slot->state), pid, fusion_id);
+}
+
+/*
+ * Take over a slot held in user space by the thread or fusionee.
+ *
+ * The holder must not be running in user space meanwhile, i.e. it's the caller or it's dead.
+ * The fusion id is matched against the state only, which it's published with atomically.
+ */
+bool
+fusion_slot_take(FusionSlot * slot, int pid, FusionID fusion_id,
+                 int *ret_pid, int *ret_fusion_id, int *ret_count)
+{
+     unsigned long long state;
+
+     if (!slot)
+          return false;
+
+     do {
+          state = READ_ONCE(slot->state);
+
+          if (!state_held_by(state, pid, fusion_id))
+               return false;
+     } while (cmpxchg64(&slot->state, state, FUSION_SLOT_KERNEL | (state & FUSION_SLOT_TID_MASK)) != state);
+
+     *ret_pid       = state & FUSION_SLOT_TID_MASK;
+     *ret_fusion_id = FUSION_SLOT_FUSION_ID(state);
+     *ret_count     = slot->count;
+
+     return true;
+}
+
+/*
+ * Hand a slot tracked by the kernel back to user space, either free or held by the thread.
+ */
+void
+fusion_slot_give(FusionSlot * slot, int pid, int fusion_id, int count, bool waiters)
+{
+     FUSION_ASSERT(slot->state & FUSION_SLOT_KERNEL);
+
+     if (pid) {
+          slot->count = count;
+
+          smp_wmb();
+
+          slot->state = FUSION_SLOT_HOLDER(fusion_id, pid) | (waiters ? FUSION_SLOT_WAITERS : 0);
+     }
+     else
+          slot->state = 0;
+}
+
+/*
+ * Check if a slot is held in user space, letting the holder enter
+ * the kernel for the final release if the caller is going to wait.
+ */
+bool
+fusion_slot_held(FusionSlot * slot, bool waiting)
+{
+     unsigned long long state;
+
+     if (!slot)
+          return false;
+
+     while (true) {
+          state = READ_ONCE(slot->state);
+
+          if (!state || (state & FUSION_SLOT_KERNEL))
+               return false;
+
+          if (!waiting || (state & FUSION_SLOT_WAITERS))
+               return true;
+
+          if (cmpxchg64(&slot->state, state, state | FUSION_SLOT_WAITERS) == state)
+               return true;
+     }
+}
+
+/*
+ * Claim a slot found to be free, fails if user space has been faster.
+ */
+bool
+fusion_slot_acquire(FusionSlot * slot)
+{
+     if (!slot || (slot->state & FUSION_SLOT_KERNEL))
+          return true;
+
+     return cmpxchg64(&slot->state, 0, FUSION_SLOT_KERNEL) == 0;
+}
+
+/******************************************************************************/
+
+static int
+counters_alloc_area(FusionCounters * counters)
+{
+     if (counters->area)
+          return 0;
+
+     counters->area = vmalloc_user(FUSION_REF_COUNTERS_SIZE);
+     if (!counters->area)
+          return -ENOMEM;
+
+     return 0;
+}
+
+void fusion_counters_deinit(FusionCounters * counters)
+{
+     if (counters->area) {
+          vfree(counters->area);
+
+          counters->area = NULL;
+     }
+
+     memset(counters->used, 0, sizeof(counters->used));
+}
+
+int fusion_counters_mmap(FusionCounters * counters, struct vm_area_struct *vma)
+{
+     int ret;
+
+     if (vma->vm_end - vma->vm_start != FUSION_REF_COUNTERS_SIZE)
+          return -EINVAL;
+
+     ret = counters_alloc_area(counters);
+     if (ret)
+          return ret;
+
+     return remap_vmalloc_range(vma, counters->area, 0);
+}
+
+int
+fusion_counter_alloc(FusionCounters * counters,
+                     int ** ret_counter, unsigned int *ret_index)
+{
+     int ret;
+     int index;
+
+     ret = counters_alloc_area(counters);
+     if (ret)
+          return ret;
+
+     index = find_first_zero_bit(counters->used, FUSION_COUNTERS_NUM);
+     if (index >= FUSION_COUNTERS_NUM)
+          return -ENOSPC;
+
+     set_bit(index, counters->used);
+
+     counters->area[index] = 0;
+
+     *ret_counter = &counters->area[index];
+     *ret_index   = index;
+
+     return 0;
+}
+
+void fusion_counter_free(FusionCounters * counters, int *counter)
+{
+     int index = counter - counters->area;
+
+     FUSION_ASSERT(index >= 0 && index < FUSION_COUNTERS_NUM);
+     FUSION_ASSERT(test_bit(index, counters->used));
+
+     *counter = 0;
+
+     clear_bit(index, counters->used);
+}
@@ -0,0 +1,75 @@
+/*
+   (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+   (c) Copyright 2002-2004  Convergence (integrated media) GmbH
+
+   All rights reserved.
+
+   Written by Denis Oliver Kropp <dok@directfb.org>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version
+   2 of the License, or (at your option) any later version.
+*/
+
+#ifndef __FUSION__SLOTS_H__
+#define __FUSION__SLOTS_H__
+
+#include <linux/mm.h>
+#include <linux/fusion.h>
+
+#include "types.h"
+
+#define FUSION_SLOTS_NUM     (FUSION_SLOTS_SIZE / sizeof(FusionSlot))
+#define FUSION_COUNTERS_NUM  (FUSION_REF_COUNTERS_SIZE / sizeof(int))
+
+/*
+ * Memory shared with user space for lock states (see FusionSlot).
+ */
+typedef struct {
+     FusionSlot    *area;                                    /* allocated on first use */
+     unsigned long  used[BITS_TO_LONGS(FUSION_SLOTS_NUM)];
+} FusionSlots;
+
+/*
+ * Memory shared with the user space of a single fusionee for reference counts.
+ */
+typedef struct {
+     int           *area;                                    /* allocated on first use */
+     unsigned long  used[BITS_TO_LONGS(FUSION_COUNTERS_NUM)];
+} FusionCounters;
+
+/* module init/cleanup */
+
+void fusion_slots_deinit(FusionDev * dev);
+void fusion_counters_deinit(FusionCounters * counters);
+
+/* public API */
+
+int  fusion_slots_mmap(FusionDev * dev, struct vm_area_struct *vma);
+int  fusion_counters_mmap(FusionCounters * counters, struct vm_area_struct *vma);
+
+/* internal functions */
+
+int  fusion_slot_alloc(FusionDev * dev, int id,
+                       FusionSlot ** ret_slot, unsigned int *ret_index);
+
+void fusion_slot_free(FusionDev * dev, FusionSlot * slot);
+
+bool fusion_slot_held_by(FusionSlot * slot, int pid, FusionID fusion_id);
+
+bool fusion_slot_take(FusionSlot * slot, int pid, FusionID fusion_id,
+                      int *ret_pid, int *ret_fusion_id, int *ret_count);
+
+void fusion_slot_give(FusionSlot * slot, int pid, int fusion_id, int count, bool waiters);
+
+bool fusion_slot_held(FusionSlot * slot, bool waiting);
+
+bool fusion_slot_acquire(FusionSlot * slot);
+
+int  fusion_counter_alloc(FusionCounters * counters,
+                          int ** ret_counter, unsigned int *ret_index);
+
+void fusion_counter_free(FusionCounters * counters, int *counter);
+
+#endif
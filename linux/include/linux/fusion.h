@@ -79,6 +79,12 @@ typedef struct {
      const void              *msg_data;      /* message data, must not be NULL */
 } FusionSendMessage;
 
+/*
+ * Messages larger than a packet are queued in fragments and read() reassembles them. If the
+ * buffer of read() is smaller than a message, it's returned in pieces by subsequent calls.
+ */
+#define FUSION_MESSAGE_SIZE_MAX   0x1000000      /* max. size of message data, including extra data of calls */
+
 /*
  * Receiving a message
  */
@@ -88,7 +94,9 @@ typedef enum {
      FMT_REACTOR,                            /* msg_id is the reactor id */
      FMT_SHMPOOL,                            /* msg_id is the pool id */
      FMT_CALL3,                              /* msg_id is the call id */
-     FMT_LEAVE                               /* FusionID in message data */
+     FMT_LEAVE,                              /* FusionID in message data */
+     FMT_SKIP,                               /* receive ring only, skip to the start of the ring */
+     FMT_CALL3_ARENA                         /* msg_id is the call id, data is in the call arena (FCEF_ARENA) */
 } FusionMessageType;
 
 typedef struct {
@@ -101,6 +109,31 @@ typedef struct {
      /* message data follows */
 } FusionReadMessage;
 
+/*
+ * Receiving messages via a ring, mapped read/write at FUSION_RECEIVE_RING_OFFSET.
+ *
+ * The mapping consists of this header padded to a page, followed by the data area whose size
+ * has to be a power of two. Mapping it enables the ring for the fusionee.
+ *
+ * The kernel writes messages (FusionReadMessage with data, aligned to four bytes) and advances
+ * 'head', user space advances 'tail' after processing them. Both are byte counts that wrap around.
+ * A message is never split, an FMT_SKIP header fills the rest of the data area instead, or
+ * nothing if less than a header remains.
+ *
+ * Messages that don't fit into the ring, or are to be acknowledged by the next read(), are queued
+ * for read() like before, while no other messages are added to the ring. The ring has to be empty
+ * before calling read() therefore, which returns zero without blocking if it's not. poll() reports
+ * messages in either.
+ */
+typedef struct {
+     unsigned int             head;          /* written by the kernel */
+     unsigned int             tail;          /* written by user space */
+     unsigned int             size;          /* size of the data area */
+} FusionReceiveRing;
+
+#define FUSION_RECEIVE_RING_OFFSET    0x50000000 /* mmap() offset of the ring */
+#define FUSION_RECEIVE_RING_SIZE_MAX  0x200000   /* max. size of the data area */
+
 /*
  * Dispatching a message via a reactor
  */
@@ -161,7 +194,10 @@ typedef enum {
      FCEF_ERROR               = 0x00000008,
      FCEF_RESUMABLE           = 0x00000010,
      FCEF_DONE                = 0x00000020,
-     FCEF_ALL                 = 0x0000003f
+     FCEF_HANDOFF             = 0x00000040,  /* FUSION_CALL_EXECUTE3 only: yield directly to the dispatcher of the callee */
+     FCEF_ASYNC               = 0x00000080,  /* FUSION_CALL_EXECUTE3 only: don't wait, return a handle for FUSION_CALL_WAIT */
+     FCEF_ARENA               = 0x00000100,  /* FUSION_CALL_EXECUTE3 only: 'ptr' is the offset of a call arena block */
+     FCEF_ALL                 = 0x000001ff
 } FusionCallExecFlags;
 
 typedef struct {
@@ -201,8 +237,103 @@ typedef struct {
 
      FusionCallExecFlags      flags;         /* execution flags */
      unsigned int             serial;        /* with FCEF_RESUMABLE used for EINTR handling, intialise with zero!!! */
+                                             /* with FCEF_ASYNC returns the handle, zero for FCEF_ONEWAY */
 } FusionCallExecute3;
 
+/*
+ * Completion of an execution started with FCEF_ASYNC. The return data is written to 'ret_ptr' of the execution,
+ * so the buffer has to stay valid until completion. Skirmishs are not transferred to the callee.
+ */
+typedef struct {
+     unsigned int             handle;        /* handle returned by FUSION_CALL_EXECUTE3 */
+
+     int                      result;        /* Returns 0, -ENODATA without return data, -EAGAIN if not completed yet or another error. */
+     unsigned int             ret_length;    /* Returns the actual length of the return data. */
+} FusionCallHandle;
+
+/*
+ * Waiting for asynchronous executions via FUSION_CALL_WAIT, limited to FUSION_CALL_WAIT_MAX handles
+ * per call, more are refused with EINVAL.
+ */
+#define FUSION_CALL_WAIT_MAX      64             /* max. number of handles to wait for */
+
+typedef struct {
+     FusionCallHandle        *handles;       /* array of handles */
+     unsigned int             num_handles;   /* number of handles */
+     unsigned int             min_complete;  /* number of handles to wait for, zero only polls */
+
+     unsigned int             completed;     /* Returns the number of completed handles, which are no longer valid. */
+} FusionCallWait;
+
+/*
+ * Asynchronous call execution via rings, mapped read/write at FUSION_CALL_RING_OFFSET.
+ *
+ * The mapping consists of this header padded to a page, followed by the submission queue and the
+ * completion queue at the given offsets. Both have the same number of entries, the largest power
+ * of two fitting into the mapping. Mapping it enables the rings for the fusionee.
+ *
+ * User space fills submissions and advances 'sq_tail'. FUSION_CALL_RING_ENTER sends them like
+ * FUSION_CALL_EXECUTE3 without waiting for the result, advancing 'sq_head', including waiting
+ * for the quota. Return data is copied to 'ret_ptr' and the completion is added by
+ * FUSION_CALL_RING_ENTER as well, which can wait for a number of completions to be available.
+ * User space advances 'cq_head' after processing them. Calls are only sent while their completion
+ * is guaranteed to fit, i.e. the number of calls in flight is limited by the number of entries.
+ *
+ * One-way calls complete only if they fail to be sent. Skirmishs held by the caller are not
+ * transferred to the callee.
+ */
+typedef struct {
+     unsigned int             sq_head;       /* written by the kernel */
+     unsigned int             sq_tail;       /* written by user space */
+     unsigned int             cq_head;       /* written by user space */
+     unsigned int             cq_tail;       /* written by the kernel */
+
+     unsigned int             entries;       /* number of entries of each queue */
+     unsigned int             sq_offset;     /* offset of the submission queue within the mapping */
+     unsigned int             cq_offset;     /* offset of the completion queue within the mapping */
+} FusionCallRing;
+
+typedef struct {
+     FusionCallExecute3       execute;       /* flags other than FCEF_ONEWAY and FCEF_QUEUE are ignored */
+
+     unsigned long            user_data;     /* passed to the completion */
+} FusionCallSubmission;
+
+typedef struct {
+     unsigned long            user_data;     /* from the submission */
+
+     int                      result;        /* zero or error code, -ENODATA if nothing was returned */
+     unsigned int             ret_length;    /* actual length of return data */
+} FusionCallCompletion;
+
+typedef struct {
+     unsigned int             to_submit;     /* [input] max number of submissions to send */
+     unsigned int             min_complete;  /* [input] number of available completions to wait for */
+
+     unsigned int             submitted;     /* [output] number of submissions sent */
+} FusionCallRingEnter;
+
+#define FUSION_CALL_RING_OFFSET       0x60000000 /* mmap() offset of the rings */
+#define FUSION_CALL_RING_SIZE_MAX     0x100000   /* max. size of the mapping */
+
+/*
+ * Passing call data without copying via the call arena, shared by all fusionees of the world and
+ * mapped read/write at FUSION_CALL_ARENA_OFFSET, its size is a module parameter.
+ *
+ * The caller writes the arguments to a block allocated with FUSION_CALL_ARENA_ALLOC and executes
+ * the call with FCEF_ARENA, 'ptr' being the offset of the block. The callee receives FMT_CALL3_ARENA
+ * with the offset in 'call_ptr' and writes the return data to the block, replacing the arguments.
+ * FUSION_CALL_RETURN3 ignores 'ptr' then, passing only the length. The block can't be used by
+ * another execution or be freed until the call returned, FCEF_ONEWAY and FCEF_ASYNC are not supported.
+ */
+typedef struct {
+     unsigned int             size;          /* size of the block, rounded up to pages */
+
+     unsigned int             offset;        /* Returns the offset of the block within the arena. */
+} FusionCallArenaAlloc;
+
+#define FUSION_CALL_ARENA_OFFSET      0x70000000 /* mmap() offset of the arena */
+
 typedef struct {
      int                      call_id;       /* id of currently executing call */
 
@@ -226,6 +357,20 @@ typedef struct {
      FusionID                 fusion_id;     /* [output] owner of the call */
 } FusionCallGetOwner;
 
+/*
+ * Besides the owner, other fusionees may serve a call by adding themselves as a worker via
+ * FUSION_CALL_ADD_WORKER, which is subject to permissions. Each execution is sent to the one with
+ * the fewest executions pending and packets queued, preferring the owner. The call message carries
+ * the handler and context of the fusionee it is sent to, i.e. the ones given when adding the worker.
+ * Executions pending at a worker that leaves the world complete without return data.
+ */
+typedef struct {
+     int                      call_id;       /* [input] call to serve */
+
+     void                    *handler;       /* function pointer of handler to call at the worker */
+     void                    *ctx;           /* optional handler context */
+} FusionCallAddWorker;
+
 typedef struct {
      int                      call_id;       /* [input] call from which to get the owner */
      FusionID                 fusion_id;     /* [input] fusionee to set quota for */
@@ -289,6 +434,22 @@ typedef struct {
      int                      catcher;       /* fusion id of the catcher */
 } FusionRefThrow;
 
+/*
+ * Sharing the local count of a reference with user space
+ *
+ * The count of the calling fusionee is moved to an int at 'index' within its own array of
+ * counters, mapped read/write at FUSION_REF_COUNTERS_OFFSET. While the counter is positive,
+ * user space may increment it, or decrement it as long as it stays positive, by an atomic
+ * compare and swap. Changes from or to zero have to use FUSION_REF_UP/DOWN.
+ */
+typedef struct {
+     int                      id;            /* reference id */
+     unsigned int             index;         /* returns the index of the counter */
+} FusionRefShare;
+
+#define FUSION_REF_COUNTERS_OFFSET  0x44000000 /* mmap() offset of the counters */
+#define FUSION_REF_COUNTERS_SIZE    0x4000     /* mmap() size of the counters */
+
 /*
  * Killing other fusionees (experimental)
  */
@@ -310,6 +471,50 @@ typedef struct {
      unsigned int             notify_count;  /* MUST NOT be reset when the system call is resumed after a signal. */
 } FusionSkirmishWait;
 
+/*
+ * Shared state of a skirmish or property, mapped read/write at FUSION_SLOTS_OFFSET.
+ *
+ * A free skirmish or available property has a state of zero. User space acquires (leases)
+ * it by an atomic compare and swap of zero with FUSION_SLOT_HOLDER() of its fusion id and
+ * thread id, publishing both at once, sets count afterwards, and handles recursion by
+ * changing count only. The final dismiss (cede) is a compare and swap of the holder with zero.
+ *
+ * If that fails due to FUSION_SLOT_WAITERS, or FUSION_SLOT_KERNEL is set, e.g. while the
+ * skirmish is transferred during a call or the property is purchased, the regular ioctls
+ * have to be used.
+ */
+typedef struct {
+     unsigned long long       state;         /* holder (FUSION_SLOT_HOLDER) and flags */
+     unsigned int             count;         /* lock count, only written by the holder */
+     int                      id;            /* id of the entry using the slot, zero if unused */
+} FusionSlot;
+
+#define FUSION_SLOT_WAITERS       0x80000000 /* holder has to use the ioctl for the final dismiss */
+#define FUSION_SLOT_KERNEL        0x40000000 /* state is tracked by the kernel, use the ioctls */
+#define FUSION_SLOT_TID_MASK      0x3fffffff
+
+#define FUSION_SLOT_HOLDER(fusion_id,tid)  (((unsigned long long)(unsigned int)(fusion_id) << 32) | (tid))
+#define FUSION_SLOT_FUSION_ID(state)       ((unsigned int)((state) >> 32))
+
+#define FUSION_SLOTS_OFFSET       0x40000000 /* mmap() offset of the slots */
+#define FUSION_SLOTS_SIZE         0x10000    /* mmap() size of the slots */
+
+/*
+ * Share a skirmish via the slots, not supported in secure worlds
+ */
+typedef struct {
+     int                      id;            /* skirmish id */
+     unsigned int             index;         /* returns the index of the slot */
+} FusionSkirmishShare;
+
+/*
+ * Share a property via the slots, not supported in secure worlds
+ */
+typedef struct {
+     int                      id;            /* property id */
+     unsigned int             index;         /* returns the index of the slot */
+} FusionPropertyShare;
+
 /*
  * Shared memory pools
  */
@@ -401,6 +606,33 @@ typedef struct {
      pid_t     pid;
 } FusionGetFusioneeInfo;
 
+/*
+ * Running a sequence of commands in one system call.
+ *
+ * Each op is run like a separate ioctl() with 'cmd' and 'arg', including the permission
+ * checks of secure mode, and its return value is stored in 'result'. Processing stops at
+ * the first op returning an error, which is returned. 'processed' returns the number of
+ * ops that succeeded, i.e. the index of the failing op.
+ *
+ * FUSION_BATCH itself can't be part of a batch. The world stays locked between the ops,
+ * so a batch is limited to FUSION_BATCH_MAX ops, more are refused with EINVAL.
+ */
+#define FUSION_BATCH_MAX          64             /* max. number of ops in a batch */
+
+typedef struct {
+     unsigned int             cmd;           /* ioctl command */
+     unsigned long            arg;           /* ioctl argument */
+
+     int                      result;        /* Returns the return value of the command. */
+} FusionBatchOp;
+
+typedef struct {
+     FusionBatchOp           *ops;           /* array of ops */
+     unsigned int             num_ops;       /* number of ops */
+
+     unsigned int             processed;     /* Returns the number of succeeded ops. */
+} FusionBatch;
+
 
 #define FUSION_ENTER                         _IOR(FT_LOUNGE,    0x00, FusionEnter)
 #define FUSION_UNBLOCK                       _IO (FT_LOUNGE,    0x01)
@@ -419,6 +651,11 @@ typedef struct {
 
 #define FUSION_GET_FUSIONEE_INFO             _IOR(FT_LOUNGE,    0x09, FusionGetFusioneeInfo)
 
+#define FUSION_BATCH                         _IOW(FT_LOUNGE,    0x0A, FusionBatch)
+
+/* Microseconds a blocking read spins before sleeping, capped by the module, zero disables. */
+#define FUSION_SET_BUSY_POLL                 _IOW(FT_LOUNGE,    0x0B, unsigned int)
+
 
 #define FUSION_SEND_MESSAGE                  _IOW(FT_MESSAGING, 0x00, FusionSendMessage)
 
@@ -431,6 +668,12 @@ typedef struct {
 #define FUSION_CALL_RETURN3                  _IOW(FT_CALL,      0x06, FusionCallReturn3)
 #define FUSION_CALL_GET_OWNER                _IOW(FT_CALL,      0x07, FusionCallGetOwner)
 #define FUSION_CALL_SET_QUOTA                _IOW(FT_CALL,      0x08, FusionCallSetQuota)
+#define FUSION_CALL_RING_ENTER               _IOW(FT_CALL,      0x09, FusionCallRingEnter)
+#define FUSION_CALL_WAIT                     _IOW(FT_CALL,      0x0A, FusionCallWait)
+#define FUSION_CALL_ARENA_ALLOC              _IOW(FT_CALL,      0x0B, FusionCallArenaAlloc)
+#define FUSION_CALL_ARENA_FREE               _IOW(FT_CALL,      0x0C, unsigned int)
+#define FUSION_CALL_ADD_WORKER               _IOW(FT_CALL,      0x0D, FusionCallAddWorker)
+#define FUSION_CALL_REMOVE_WORKER            _IOW(FT_CALL,      0x0E, int)
 
 #define FUSION_REF_NEW                       _IOW(FT_REF,       0x00, int)
 #define FUSION_REF_UP                        _IOW(FT_REF,       0x01, int)
@@ -447,6 +690,7 @@ typedef struct {
 #define FUSION_REF_CATCH                     _IOW(FT_REF,       0x0C, int)
 #define FUSION_REF_THROW                     _IOW(FT_REF,       0x0D, FusionRefThrow)
 #define FUSION_REF_SET_SYNC                  _IOW(FT_REF,       0x0E, int)
+#define FUSION_REF_SHARE                     _IOW(FT_REF,       0x0F, FusionRefShare)
 
 #define FUSION_SKIRMISH_NEW                  _IOW(FT_SKIRMISH,  0x00, int)
 #define FUSION_SKIRMISH_PREVAIL              _IOW(FT_SKIRMISH,  0x01, int)
@@ -456,6 +700,7 @@ typedef struct {
 #define FUSION_SKIRMISH_LOCK_COUNT           _IOW(FT_SKIRMISH,  0x05, int)
 #define FUSION_SKIRMISH_WAIT                 _IOW(FT_SKIRMISH,  0x06, FusionSkirmishWait)
 #define FUSION_SKIRMISH_NOTIFY               _IOW(FT_SKIRMISH,  0x07, int)
+#define FUSION_SKIRMISH_SHARE                _IOW(FT_SKIRMISH,  0x08, FusionSkirmishShare)
 
 #define FUSION_PROPERTY_NEW                  _IOW(FT_PROPERTY,  0x00, int)
 #define FUSION_PROPERTY_LEASE                _IOW(FT_PROPERTY,  0x01, int)
@@ -463,6 +708,7 @@ typedef struct {
 #define FUSION_PROPERTY_CEDE                 _IOW(FT_PROPERTY,  0x03, int)
 #define FUSION_PROPERTY_HOLDUP               _IOW(FT_PROPERTY,  0x04, int)
 #define FUSION_PROPERTY_DESTROY              _IOW(FT_PROPERTY,  0x05, int)
+#define FUSION_PROPERTY_SHARE                _IOW(FT_PROPERTY,  0x06, FusionPropertyShare)
 
 #define FUSION_REACTOR_NEW                   _IOW(FT_REACTOR,   0x00, int)
 #define FUSION_REACTOR_ATTACH                _IOW(FT_REACTOR,   0x01, FusionReactorAttach)
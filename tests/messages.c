@@ -0,0 +1,221 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+/*
+ * Reads a message larger than a packet queued behind and before small messages,
+ * using various buffer sizes.
+ *
+ * Each message has to arrive intact and in order, and a message must never be
+ * split across reads if it fits into the buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <linux/fusion.h>
+
+#include <direct/direct.h>
+#include <direct/messages.h>
+
+
+#define MESSAGE_SIZE(size)  ((sizeof(FusionReadMessage) + (size) + 3) & ~3)
+
+static const int message_sizes[] = { 100, 200, 300, 40000, 100, 20000 };
+static const int buffer_sizes[]  = { 64, 256, 1024, 16384, 20100, 40016, 65536, 131072 };
+
+#define NUM_MESSAGES  (sizeof(message_sizes) / sizeof(message_sizes[0]))
+#define NUM_BUFFERS   (sizeof(buffer_sizes) / sizeof(buffer_sizes[0]))
+#define NUM_READS     4096
+
+
+static int      fd;
+static FusionID fusion_id;
+
+static char stream[256 * 1024];       /* all data read, concatenated */
+static int  boundaries[NUM_READS];    /* stream offsets where a read ended */
+
+
+static int
+send_messages (void)
+{
+  unsigned int      i;
+  int               n;
+  char             *data;
+  FusionSendMessage send;
+
+  data = malloc (65536);
+  if (!data)
+    return -1;
+
+  for (i = 0; i < NUM_MESSAGES; i++)
+    {
+      for (n = 0; n < message_sizes[i]; n++)
+        data[n] = i + n;
+
+      send.fusion_id   = fusion_id;
+      send.msg_id      = i;
+      send.msg_channel = 0;
+      send.msg_size    = message_sizes[i];
+      send.msg_data    = data;
+
+      while (ioctl (fd, FUSION_SEND_MESSAGE, &send))
+        {
+          if (errno != EINTR)
+            {
+              perror ("FUSION_SEND_MESSAGE");
+              free (data);
+              return -1;
+            }
+        }
+    }
+
+  free (data);
+
+  return 0;
+}
+
+static int
+check_stream (int buf_size, int num_reads)
+{
+  unsigned int i;
+  int          n;
+  int          b      = 0;
+  int          offset = 0;
+  int          errors = 0;
+
+  for (i = 0; i < NUM_MESSAGES; i++)
+    {
+      FusionReadMessage *header = (FusionReadMessage *) (stream + offset);
+      char              *data   = (char *) (header + 1);
+      int                length = MESSAGE_SIZE (message_sizes[i]);
+
+      if (header->msg_type != FMT_SEND || header->msg_id != (int) i || header->msg_size != message_sizes[i])
+        {
+          D_ERROR( "FusionTest/Messages: [%d] Message %u has type %d, id %d, size %d!\n",
+                   buf_size, i, header->msg_type, header->msg_id, header->msg_size );
+          return 1;
+        }
+
+      for (n = 0; n < message_sizes[i]; n++)
+        {
+          if (data[n] != (char) (i + n))
+            {
+              D_ERROR( "FusionTest/Messages: [%d] Message %u is corrupt at %d!\n", buf_size, i, n );
+              errors++;
+              break;
+            }
+        }
+
+      /* Skip reads ending before this message. */
+      while (b < num_reads && boundaries[b] <= offset)
+        b++;
+
+      if (length <= buf_size && b < num_reads && boundaries[b] < offset + length)
+        {
+          D_ERROR( "FusionTest/Messages: [%d] Message %u (%d bytes) split at %d!\n",
+                   buf_size, i, length, boundaries[b] - offset );
+          errors++;
+        }
+
+      offset += length;
+    }
+
+  return errors;
+}
+
+static int
+test_buffer_size (int buf_size)
+{
+  unsigned int i;
+  int          total     = 0;
+  int          received  = 0;
+  int          num_reads = 0;
+
+  for (i = 0; i < NUM_MESSAGES; i++)
+    total += MESSAGE_SIZE (message_sizes[i]);
+
+  if (send_messages())
+    return 1;
+
+  while (received < total)
+    {
+      ssize_t len = read (fd, stream + received, buf_size);
+
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          perror ("reading messages");
+          return 1;
+        }
+
+      if (len == 0 || len > buf_size || received + len > total || num_reads == NUM_READS)
+        {
+          D_ERROR( "FusionTest/Messages: [%d] Read returned %zd after %d of %d bytes!\n",
+                   buf_size, len, received, total );
+          return 1;
+        }
+
+      received += len;
+
+      boundaries[num_reads++] = received;
+    }
+
+  D_INFO( "FusionTest/Messages: [%6d] Read %d bytes in %d reads.\n", buf_size, total, num_reads );
+
+  return check_stream (buf_size, num_reads);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned int i;
+  int          errors = 0;
+  FusionEnter  enter  = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  direct_initialize();
+
+  /* Open the Fusion Kernel Device, creating the world. */
+  fd = open ("/dev/fusion0", O_RDWR | O_EXCL);
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR | O_EXCL);
+
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  fusion_id = enter.fusion_id;
+
+  for (i = 0; i < NUM_BUFFERS; i++)
+    errors += test_buffer_size (buffer_sizes[i]);
+
+  close (fd);
+
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+/*
+ *      Fusion Kernel Module
+ *
+ *      (c) Copyright 2002-2011  The world wide DirectFB Open Source Community (directfb.org)
+ *
+ *
+ *      This program is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU General Public License
+ *      as published by the Free Software Foundation; either version
+ *      2 of the License, or (at your option) any later version.
+ */
+
+/*
+ * Contends for a shared skirmish via its slot from several fusionees while
+ * killing them at random, also right after releasing the skirmish in user space.
+ *
+ * The kernel has to release the skirmish of a dying holder, but never the one
+ * just acquired by another fusionee. Each holder leaves its incarnation in the
+ * critical section, finding one that's neither zero nor killed is a violation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include <linux/fusion.h>
+
+#include <direct/direct.h>
+#include <direct/messages.h>
+
+
+#define NUM_WORKERS   8
+#define NUM_KILLS     2000
+
+typedef struct {
+  volatile unsigned int  holder;                         /* incarnation in the critical section */
+  volatile unsigned int  violations;
+  volatile unsigned long entered;
+
+  volatile char          killed[NUM_WORKERS + NUM_KILLS + 1]; /* by incarnation */
+} Shared;
+
+static Shared     *shared;
+static FusionSlot *slot;
+static int         skirmish_id;
+
+
+static int
+open_device (int master)
+{
+  int fd;
+
+  fd = open ("/dev/fusion0", O_RDWR | (master ? O_EXCL : 0));
+  if (fd < 0)
+    fd = open ("/dev/fusion/0", O_RDWR | (master ? O_EXCL : 0));
+
+  return fd;
+}
+
+static void
+skirmish_prevail (int fd, unsigned long long holder)
+{
+  /* Uncontended, acquire in user space. */
+  if (__sync_bool_compare_and_swap (&slot->state, 0, holder))
+    {
+      slot->count = 1;
+      return;
+    }
+
+  while (ioctl (fd, FUSION_SKIRMISH_PREVAIL, &skirmish_id))
+    {
+      if (errno != EINTR)
+        {
+          perror ("FUSION_SKIRMISH_PREVAIL");
+          _exit (1);
+        }
+    }
+}
+
+static void
+skirmish_dismiss (int fd, unsigned long long holder)
+{
+  /* No waiters and not tracked by the kernel, release in user space. */
+  if (__sync_bool_compare_and_swap (&slot->state, holder, 0))
+    return;
+
+  while (ioctl (fd, FUSION_SKIRMISH_DISMISS, &skirmish_id))
+    {
+      if (errno != EINTR)
+        {
+          perror ("FUSION_SKIRMISH_DISMISS");
+          _exit (1);
+        }
+    }
+}
+
+static void
+worker (unsigned int incarnation)
+{
+  int                fd;
+  unsigned long long holder;
+  FusionEnter        enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  fd = open_device (0);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      _exit (1);
+    }
+
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      _exit (1);
+    }
+
+  holder = FUSION_SLOT_HOLDER (enter.fusion_id, syscall (SYS_gettid));
+
+  while (1)
+    {
+      unsigned int previous;
+      int          i;
+
+      skirmish_prevail (fd, holder);
+
+      previous = __sync_lock_test_and_set (&shared->holder, incarnation);
+      if (previous && !shared->killed[previous])
+        __sync_fetch_and_add (&shared->violations, 1);
+
+      for (i = 0; i < 100; i++)
+        __sync_synchronize();
+
+      shared->entered++;
+
+      __sync_bool_compare_and_swap (&shared->holder, incarnation, 0);
+
+      skirmish_dismiss (fd, holder);
+    }
+}
+
+static pid_t
+spawn (unsigned int incarnation)
+{
+  pid_t pid = fork();
+
+  if (pid < 0)
+    {
+      perror ("fork");
+      exit (1);
+    }
+
+  if (!pid)
+    worker (incarnation);
+
+  return pid;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int                  i;
+  int                  fd;
+  pid_t                pids[NUM_WORKERS];
+  unsigned int         incarnations[NUM_WORKERS];
+  unsigned int         incarnation = 0;
+  FusionSkirmishShare  share;
+  FusionEnter          enter = {{ FUSION_API_MAJOR, FUSION_API_MINOR }};
+
+  direct_initialize();
+
+  /* Open the Fusion Kernel Device, creating the world. */
+  fd = open_device (1);
+  if (fd < 0)
+    {
+      perror ("opening /dev/fusion failed");
+      return -1;
+    }
+
+  if (ioctl (fd, FUSION_ENTER, &enter))
+    {
+      perror ("FUSION_ENTER failed");
+      close (fd);
+      return -2;
+    }
+
+  if (ioctl (fd, FUSION_SKIRMISH_NEW, &skirmish_id))
+    {
+      perror ("FUSION_SKIRMISH_NEW failed");
+      close (fd);
+      return -3;
+    }
+
+  share.id = skirmish_id;
+
+  if (ioctl (fd, FUSION_SKIRMISH_SHARE, &share))
+    {
+      perror ("FUSION_SKIRMISH_SHARE failed");
+      close (fd);
+      return -4;
+    }
+
+  slot = mmap (NULL, FUSION_SLOTS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, FUSION_SLOTS_OFFSET);
+  if (slot == MAP_FAILED)
+    {
+      perror ("mapping the slots failed");
+      close (fd);
+      return -5;
+    }
+
+  slot += share.index;
+
+  shared = mmap (NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+    {
+      perror ("mapping shared memory failed");
+      close (fd);
+      return -6;
+    }
+
+  D_INFO( "FusionTest/Slots: Contending for skirmish %d from %d fusionees...\n", skirmish_id, NUM_WORKERS );
+
+  for (i = 0; i < NUM_WORKERS; i++)
+    {
+      incarnations[i] = ++incarnation;
+      pids[i]         = spawn (incarnations[i]);
+    }
+
+  /* Kill a random worker, while holding the skirmish or not, and replace it. */
+  for (i = 0; i < NUM_KILLS; i++)
+    {
+      int n = rand() % NUM_WORKERS;
+
+      usleep (rand() % 2000);
+
+      /* Mark first, the skirmish may be released before kill() returns. */
+      shared->killed[incarnations[n]] = 1;
+
+      kill (pids[n], SIGKILL);
+      waitpid (pids[n], NULL, 0);
+
+      incarnations[n] = ++incarnation;
+      pids[n]         = spawn (incarnations[n]);
+    }
+
+  for (i = 0; i < NUM_WORKERS; i++)
+    {
+      shared->killed[incarnations[i]] = 1;
+
+      kill (pids[i], SIGKILL);
+      waitpid (pids[i], NULL, 0);
+    }
+
+  D_INFO( "FusionTest/Slots: Entered %lu times, killed %d holders or contenders, %u violations.\n",
+          shared->entered, NUM_KILLS + NUM_WORKERS, shared->violations );
+
+  /* All holders are gone, the skirmish has to be free again. */
+  if (ioctl (fd, FUSION_SKIRMISH_SWOOP, &skirmish_id))
+    {
+      D_ERROR( "FusionTest/Slots: Skirmish still held (state 0x%016llx)!\n", slot->state );
+      shared->violations++;
+    }
+  else
+    ioctl (fd, FUSION_SKIRMISH_DISMISS, &skirmish_id);
+
+  ioctl (fd, FUSION_SKIRMISH_DESTROY, &skirmish_id);
+
+  close (fd);
+
+  return shared->violations ? 1 : 0;
+}